@@ -23,6 +23,7 @@
 struct alf_actor {
 	u32 head;
 	u32 tail;
+	u32 retries; /* cmpxchg failures on head, statistics only */
 };
 
 struct alf_queue {
@@ -46,6 +47,15 @@ void		  alf_queue_free(struct alf_queue *q);
 #define __helper_alf_enqueue_store __helper_alf_enqueue_store_unroll
 #define __helper_alf_dequeue_load  __helper_alf_dequeue_load_unroll
 
+/* Account a failed cmpxchg, only reached on contention.  The update
+ * is racy, which is acceptable as it is only for statistics.
+ */
+static inline bool alf_actor_retry(struct alf_actor *actor)
+{
+	WRITE_ONCE(actor->retries, actor->retries + 1);
+	return true;
+}
+
 /* Main Multi-Producer ENQUEUE
  *
  * Even-though current API have a "fixed" semantics of aborting if it
@@ -76,7 +86,8 @@ alf_mp_enqueue(const u32 n;
 
 		p_next = p_head + n;
 	}
-	while (unlikely(cmpxchg(&q->producer.head, p_head, p_next) != p_head));
+	while (unlikely(cmpxchg(&q->producer.head, p_head, p_next) != p_head) &&
+	       alf_actor_retry(&q->producer));
 	/* The memory barrier of smp_load_acquire(&q->consumer.tail)
 	 * is satisfied by cmpxchg implicit full memory barrier
 	 */
@@ -97,6 +108,49 @@ alf_mp_enqueue(const u32 n;
 	return n;
 }
 
+/* Multi-Producer ENQUEUE with "variable" semantics
+ *
+ * Enqueue as many elements as fit in the queue, instead of aborting
+ * when the full bulk does not fit.  Returns the number of elements
+ * enqueued (from the start of ptr[]), which can be zero when full.
+ *
+ * Same preemption rules as alf_mp_enqueue().
+ */
+static inline int
+alf_mp_enqueue_variable(const u32 n;
+			struct alf_queue *q, void *ptr[n], const u32 n)
+{
+	u32 p_head, p_next, c_tail, space, elems;
+
+	/* Reserve part of the array for enqueue STORE/WRITE */
+	do {
+		p_head = READ_ONCE(q->producer.head);
+		c_tail = READ_ONCE(q->consumer.tail);/* as smp_load_aquire */
+
+		space = q->size + c_tail - p_head;
+		if (space == 0)
+			return 0;
+		else
+			elems = min(space, n);
+
+		p_next = p_head + elems;
+	}
+	while (unlikely(cmpxchg(&q->producer.head, p_head, p_next) != p_head) &&
+	       alf_actor_retry(&q->producer));
+
+	/* STORE the elems into the queue array */
+	__helper_alf_enqueue_store(p_head, q, ptr, elems);
+	smp_wmb(); /* Write-Memory-Barrier matching dequeue LOADs */
+
+	/* Wait for other concurrent preceding enqueues not yet done */
+	while (unlikely(READ_ONCE(q->producer.tail) != p_head))
+		cpu_relax();
+	/* Mark this enq done and avail for consumption */
+	WRITE_ONCE(q->producer.tail, p_next);
+
+	return elems;
+}
+
 /* Main Multi-Consumer DEQUEUE */
 static inline int
 alf_mc_dequeue(const u32 n;
@@ -118,7 +172,8 @@ alf_mc_dequeue(const u32 n;
 
 		c_next = c_head + elems;
 	}
-	while (unlikely(cmpxchg(&q->consumer.head, c_head, c_next) != c_head));
+	while (unlikely(cmpxchg(&q->consumer.head, c_head, c_next) != c_head) &&
+	       alf_actor_retry(&q->consumer));
 
 	/* LOAD the elems from the queue array.
 	 *   We don't need a smb_rmb() Read-Memory-Barrier here because
@@ -247,6 +302,22 @@ alf_queue_empty(struct alf_queue *q)
 	return c_tail == p_tail;
 }
 
+/* Single-Consumer peek at the next element, without dequeuing it.
+ * Returns NULL if the queue is empty.  Same rules as alf_sc_dequeue().
+ */
+static inline void *
+alf_sc_peek(struct alf_queue *q)
+{
+	u32 c_head = q->consumer.head;
+	u32 p_tail = READ_ONCE(q->producer.tail);
+
+	if (c_head == p_tail)
+		return NULL;
+
+	smp_rmb(); /* Read-Memory-Barrier matching enq STOREs */
+	return q->ring[c_head & q->mask];
+}
+
 static inline int
 alf_queue_count(struct alf_queue *q)
 {
@@ -0,0 +1,222 @@
+/*
+ *	Batched operations on top of the upstream 'struct ptr_ring'.
+ *
+ *	Not part of the kernel tree, thus kept out of linux/ptr_ring.h,
+ *	as the kernel's own copy of that header shadows ours.  The produce
+ *	side only use the ptr_ring fields available since its introduction
+ *	(v4.8).
+ *
+ *	Producing a batch only needs a single smp_wmb() to publish all
+ *	entries, and callers using the locked variants only take the
+ *	producer_lock once per batch.
+ *
+ *	The consume side (ptr_ring_consume_bulk) relies on the deferred
+ *	invalidation via consumer_head/consumer_tail/batch, upstream since
+ *	v4.12 ("ptr_ring: batch ring zeroing").
+ */
+#ifndef _LINUX_PTR_RING_BATCH_H
+#define _LINUX_PTR_RING_BATCH_H 1
+
+#include <linux/mm.h> /* missing in ptr_ring.h on >= v4.16 */
+#include <linux/ptr_ring.h>
+
+/* Produce up to n entries from array, taking the slots in order until
+ * the ring is full.  Returns the number of entries produced.
+ *
+ * Callers must hold producer_lock.
+ */
+static inline int __ptr_ring_produce_batched(struct ptr_ring *r,
+					     void **array, int n)
+{
+	int producer = r->producer;
+	int i, cnt;
+
+	if (unlikely(!r->size))
+		return 0;
+	if (unlikely(n > r->size))
+		n = r->size;
+
+	/* Count free slots. Entries are only NULL'ed by the consumer,
+	 * thus once seen empty they stay empty under producer_lock.
+	 */
+	for (cnt = 0; cnt < n; cnt++) {
+		if (READ_ONCE(r->queue[producer]))
+			break;
+		if (unlikely(++producer >= r->size))
+			producer = 0;
+	}
+	if (unlikely(!cnt))
+		return 0;
+
+	/* Make sure the pointers we are storing points to valid data. */
+	/* Pairs with the READ_ONCE in __ptr_ring_consume. */
+	smp_wmb();
+
+	producer = r->producer;
+	for (i = 0; i < cnt; i++) {
+		WRITE_ONCE(r->queue[producer++], array[i]);
+		if (unlikely(producer >= r->size))
+			producer = 0;
+	}
+	r->producer = producer;
+	return cnt;
+}
+
+static inline int ptr_ring_produce_batched(struct ptr_ring *r,
+					   void **array, int n)
+{
+	int ret;
+
+	spin_lock(&r->producer_lock);
+	ret = __ptr_ring_produce_batched(r, array, n);
+	spin_unlock(&r->producer_lock);
+
+	return ret;
+}
+
+static inline int ptr_ring_produce_batched_irq(struct ptr_ring *r,
+					       void **array, int n)
+{
+	int ret;
+
+	spin_lock_irq(&r->producer_lock);
+	ret = __ptr_ring_produce_batched(r, array, n);
+	spin_unlock_irq(&r->producer_lock);
+
+	return ret;
+}
+
+static inline int ptr_ring_produce_batched_any(struct ptr_ring *r,
+					       void **array, int n)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&r->producer_lock, flags);
+	ret = __ptr_ring_produce_batched(r, array, n);
+	spin_unlock_irqrestore(&r->producer_lock, flags);
+
+	return ret;
+}
+
+static inline int ptr_ring_produce_batched_bh(struct ptr_ring *r,
+					      void **array, int n)
+{
+	int ret;
+
+	spin_lock_bh(&r->producer_lock);
+	ret = __ptr_ring_produce_batched(r, array, n);
+	spin_unlock_bh(&r->producer_lock);
+
+	return ret;
+}
+
+/* Zero out consumed entries [consumer_tail, consumer_head) in the
+ * reverse order, see __ptr_ring_discard_one.
+ */
+static inline void __ptr_ring_batch_zero_tail(struct ptr_ring *r,
+					      int consumer_head)
+{
+	int head = consumer_head - 1;
+
+	while (likely(head >= r->consumer_tail))
+		r->queue[head--] = NULL;
+	r->consumer_tail = consumer_head;
+}
+
+/* Consume up to n entries in one pass.  Upstream
+ * __ptr_ring_consume_batched() loops __ptr_ring_consume(), paying a
+ * peek, discard, batch check and consumer_head store per entry.
+ * Instead copy out the contiguous non-NULL entries, invalidate the
+ * consumed slots with the same batching rules as
+ * __ptr_ring_discard_one, and publish consumer_head only once.
+ *
+ * Callers must hold consumer_lock.
+ */
+static inline int __ptr_ring_consume_bulk(struct ptr_ring *r,
+					  void **array, int n)
+{
+	int consumer_head = r->consumer_head;
+	void *ptr;
+	int i;
+
+	if (unlikely(!r->size))
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		/* The READ_ONCE guarantees that anyone accessing data
+		 * through the pointer is up to date. Pairs with smp_wmb
+		 * in __ptr_ring_produce.
+		 */
+		ptr = READ_ONCE(r->queue[consumer_head]);
+		if (!ptr)
+			break;
+		array[i] = ptr;
+
+		/* Always invalidate at end of ring, keeps wrap simple */
+		if (unlikely(++consumer_head >= r->size)) {
+			__ptr_ring_batch_zero_tail(r, consumer_head);
+			consumer_head = 0;
+			r->consumer_tail = 0;
+		}
+	}
+
+	if (consumer_head - r->consumer_tail >= r->batch)
+		__ptr_ring_batch_zero_tail(r, consumer_head);
+
+	/* matching READ_ONCE in __ptr_ring_empty for lockless tests */
+	WRITE_ONCE(r->consumer_head, consumer_head);
+
+	return i;
+}
+
+static inline int ptr_ring_consume_bulk(struct ptr_ring *r,
+					void **array, int n)
+{
+	int ret;
+
+	spin_lock(&r->consumer_lock);
+	ret = __ptr_ring_consume_bulk(r, array, n);
+	spin_unlock(&r->consumer_lock);
+
+	return ret;
+}
+
+static inline int ptr_ring_consume_bulk_irq(struct ptr_ring *r,
+					    void **array, int n)
+{
+	int ret;
+
+	spin_lock_irq(&r->consumer_lock);
+	ret = __ptr_ring_consume_bulk(r, array, n);
+	spin_unlock_irq(&r->consumer_lock);
+
+	return ret;
+}
+
+static inline int ptr_ring_consume_bulk_any(struct ptr_ring *r,
+					    void **array, int n)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&r->consumer_lock, flags);
+	ret = __ptr_ring_consume_bulk(r, array, n);
+	spin_unlock_irqrestore(&r->consumer_lock, flags);
+
+	return ret;
+}
+
+static inline int ptr_ring_consume_bulk_bh(struct ptr_ring *r,
+					   void **array, int n)
+{
+	int ret;
+
+	spin_lock_bh(&r->consumer_lock);
+	ret = __ptr_ring_consume_bulk(r, array, n);
+	spin_unlock_bh(&r->consumer_lock);
+
+	return ret;
+}
+
+#endif /* _LINUX_PTR_RING_BATCH_H */
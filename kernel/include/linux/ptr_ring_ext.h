@@ -0,0 +1,244 @@
+/*
+ *	Definitions for the 'struct ptr_ring_ext' datastructure.
+ *
+ *	A ptr_ring with an adaptive consumer batch size.  Not part of the
+ *	kernel tree, thus it wraps the upstream 'struct ptr_ring' (the
+ *	kernel's copy of linux/ptr_ring.h shadows ours), instead of
+ *	extending it.
+ *
+ *	The consumer defers invalidating (NULL'ing) consumed slots until
+ *	r->batch entries are consumed, which avoids cache line bouncing
+ *	when the ring runs near-full, where the producer writes into the
+ *	cache lines the consumer invalidates.  But deferring also keeps
+ *	free slots from the producer.  The upstream batch is fixed at init
+ *	time, here it is adapted at invalidation time: halve it when the
+ *	producer stalled on a full ring since last check, and double it
+ *	(up to batch_max) while the ring stays occupied a full batch ahead
+ *	of the consumer.
+ *
+ *	Only the ptr_ring_ext_* API may be used on the ring, as the stall
+ *	events are counted by the produce wrappers, and the adaption is
+ *	driven by the consume wrappers.  The ring must not be resized.
+ */
+#ifndef _LINUX_PTR_RING_EXT_H
+#define _LINUX_PTR_RING_EXT_H 1
+
+#include <linux/ptr_ring_batch.h>
+
+/* Tuning stats for the adaptive consumer batch size */
+struct ptr_ring_batch_stats {
+	unsigned long grow;   /* batch doubled, ring seen near-full */
+	unsigned long shrink; /* batch halved, producer stalled */
+	unsigned long stalls; /* producer full events seen by consumer */
+};
+
+struct ptr_ring_ext {
+	struct ptr_ring ring;
+	/* Producer side: stall events (ring full) */
+	unsigned int producer_full ____cacheline_aligned_in_smp;
+	/* Consumer side, under consumer_lock */
+	bool batch_adaptive ____cacheline_aligned_in_smp;
+	int batch_base; /* batch selected by ptr_ring_init */
+	int batch_max;  /* upper bound for the adaptive batch */
+	unsigned int producer_full_seen;
+	struct ptr_ring_batch_stats batch_stats;
+};
+
+static inline int ptr_ring_ext_init(struct ptr_ring_ext *q, int size,
+				    gfp_t gfp)
+{
+	struct ptr_ring *r = &q->ring;
+	int ret;
+
+	ret = ptr_ring_init(r, size, gfp);
+	if (ret)
+		return ret;
+
+	q->producer_full = q->producer_full_seen = 0;
+	q->batch_adaptive = false;
+	q->batch_base = r->batch;
+	/* Adaptive batch can grow up to 4x, but not above half the ring */
+	q->batch_max = max(1, min(r->batch * 4, r->size / 2));
+	memset(&q->batch_stats, 0, sizeof(q->batch_stats));
+	return 0;
+}
+
+static inline void ptr_ring_ext_cleanup(struct ptr_ring_ext *q,
+					void (*destroy)(void *))
+{
+	ptr_ring_cleanup(&q->ring, destroy);
+}
+
+/* Producer side.  The stall counter is only written by the producer
+ * (under producer_lock), but read locklessly by the consumer.
+ */
+static inline void __ptr_ring_ext_stall(struct ptr_ring_ext *q)
+{
+	WRITE_ONCE(q->producer_full, q->producer_full + 1);
+}
+
+static inline int __ptr_ring_ext_produce(struct ptr_ring_ext *q, void *ptr)
+{
+	int ret = __ptr_ring_produce(&q->ring, ptr);
+
+	if (unlikely(ret))
+		__ptr_ring_ext_stall(q);
+	return ret;
+}
+
+static inline int __ptr_ring_ext_produce_batched(struct ptr_ring_ext *q,
+						 void **array, int n)
+{
+	int ret = __ptr_ring_produce_batched(&q->ring, array, n);
+
+	if (unlikely(ret < n))
+		__ptr_ring_ext_stall(q);
+	return ret;
+}
+
+static inline int ptr_ring_ext_produce(struct ptr_ring_ext *q, void *ptr)
+{
+	int ret;
+
+	spin_lock(&q->ring.producer_lock);
+	ret = __ptr_ring_ext_produce(q, ptr);
+	spin_unlock(&q->ring.producer_lock);
+
+	return ret;
+}
+
+static inline int ptr_ring_ext_produce_bh(struct ptr_ring_ext *q, void *ptr)
+{
+	int ret;
+
+	spin_lock_bh(&q->ring.producer_lock);
+	ret = __ptr_ring_ext_produce(q, ptr);
+	spin_unlock_bh(&q->ring.producer_lock);
+
+	return ret;
+}
+
+static inline int ptr_ring_ext_produce_batched(struct ptr_ring_ext *q,
+					       void **array, int n)
+{
+	int ret;
+
+	spin_lock(&q->ring.producer_lock);
+	ret = __ptr_ring_ext_produce_batched(q, array, n);
+	spin_unlock(&q->ring.producer_lock);
+
+	return ret;
+}
+
+/* Adapt the batch size, called after a batch was invalidated.
+ *
+ * Changes r->batch, which upstream consume use for deferring the
+ * invalidation.  It shares a cache line with r->size and r->queue,
+ * read by the producer, thus it is only written on actual change.
+ */
+static inline void __ptr_ring_ext_adapt_batch(struct ptr_ring_ext *q)
+{
+	struct ptr_ring *r = &q->ring;
+	unsigned int full;
+	int probe, batch;
+
+	/* Reading producer cache line, but only once per batch */
+	full = READ_ONCE(q->producer_full);
+	if (full != q->producer_full_seen) {
+		q->batch_stats.stalls += full - q->producer_full_seen;
+		q->producer_full_seen = full;
+		if (r->batch > 1) {
+			WRITE_ONCE(r->batch, r->batch >> 1);
+			q->batch_stats.shrink++;
+		}
+		return;
+	}
+
+	if (r->batch >= q->batch_max)
+		return;
+
+	/* Occupancy probe: is the ring filled a batch ahead? */
+	probe = r->consumer_head + r->batch;
+	if (probe >= r->size)
+		probe -= r->size;
+	if (READ_ONCE(r->queue[probe])) {
+		batch = min(r->batch << 1, q->batch_max);
+		WRITE_ONCE(r->batch, batch);
+		q->batch_stats.grow++;
+	}
+}
+
+/* Consumer side.  A batch was invalidated if consumer_tail moved. */
+static inline void *__ptr_ring_ext_consume(struct ptr_ring_ext *q)
+{
+	int tail = q->ring.consumer_tail;
+	void *ptr;
+
+	ptr = __ptr_ring_consume(&q->ring);
+	if (q->batch_adaptive && q->ring.consumer_tail != tail)
+		__ptr_ring_ext_adapt_batch(q);
+	return ptr;
+}
+
+static inline int __ptr_ring_ext_consume_batched(struct ptr_ring_ext *q,
+						 void **array, int n)
+{
+	int tail = q->ring.consumer_tail;
+
+	n = __ptr_ring_consume_bulk(&q->ring, array, n);
+	if (q->batch_adaptive && q->ring.consumer_tail != tail)
+		__ptr_ring_ext_adapt_batch(q);
+	return n;
+}
+
+static inline void *ptr_ring_ext_consume(struct ptr_ring_ext *q)
+{
+	void *ptr;
+
+	spin_lock(&q->ring.consumer_lock);
+	ptr = __ptr_ring_ext_consume(q);
+	spin_unlock(&q->ring.consumer_lock);
+
+	return ptr;
+}
+
+static inline void *ptr_ring_ext_consume_bh(struct ptr_ring_ext *q)
+{
+	void *ptr;
+
+	spin_lock_bh(&q->ring.consumer_lock);
+	ptr = __ptr_ring_ext_consume(q);
+	spin_unlock_bh(&q->ring.consumer_lock);
+
+	return ptr;
+}
+
+static inline int ptr_ring_ext_consume_batched(struct ptr_ring_ext *q,
+					       void **array, int n)
+{
+	int ret;
+
+	spin_lock(&q->ring.consumer_lock);
+	ret = __ptr_ring_ext_consume_batched(q, array, n);
+	spin_unlock(&q->ring.consumer_lock);
+
+	return ret;
+}
+
+/* Enable/disable runtime adaption of the consumer batch size.  Tuning
+ * is recorded in q->batch_stats.  Disabling restores the batch size
+ * selected by ptr_ring_init.
+ */
+static inline void ptr_ring_ext_set_batch_adaptive(struct ptr_ring_ext *q,
+						   bool on)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->ring.consumer_lock, flags);
+	q->batch_adaptive = on;
+	WRITE_ONCE(q->ring.batch, q->batch_base);
+	q->producer_full_seen = READ_ONCE(q->producer_full);
+	spin_unlock_irqrestore(&q->ring.consumer_lock, flags);
+}
+
+#endif /* _LINUX_PTR_RING_EXT_H */
@@ -0,0 +1,86 @@
+/*
+ *	Definitions for the 'struct ptr_ring_spsc' datastructure.
+ *
+ *	A lockless Single-Producer/Single-Consumer variant of ptr_ring.
+ *
+ *	The ptr_ring NULL-slot protocol does not need any locking, when
+ *	it is guaranteed that only a single context produce and only a
+ *	single context consume entries.  The spinlocks in ptr_ring exist
+ *	for the multi-producer/multi-consumer case.  This type wraps a
+ *	ptr_ring, such that the locked ptr_ring API cannot be used by
+ *	mistake, and only exposes the lockless "__" operations.
+ *
+ *	The caller MUST guarantee:
+ *	 - Only one context (CPU, and no interrupting softirq/irq on
+ *	   that CPU) enqueue at any time.
+ *	 - Only one context dequeue at any time.
+ *	 - The ring is not resized while in use (resize takes the locks).
+ *
+ *	A typical use-case is a queue per remote CPU, like the per CPU
+ *	queues in bench_page_pool_cross_cpu.c.
+ *
+ *	Builds on the upstream ptr_ring (the kernel's copy of
+ *	linux/ptr_ring.h shadows ours), and the batched produce from
+ *	linux/ptr_ring_batch.h.
+ */
+#ifndef _LINUX_PTR_RING_SPSC_H
+#define _LINUX_PTR_RING_SPSC_H 1
+
+#include <linux/ptr_ring_batch.h>
+
+struct ptr_ring_spsc {
+	struct ptr_ring ring;
+};
+
+static inline int ptr_ring_spsc_init(struct ptr_ring_spsc *q, int size,
+				     gfp_t gfp)
+{
+	return ptr_ring_init(&q->ring, size, gfp);
+}
+
+static inline void ptr_ring_spsc_cleanup(struct ptr_ring_spsc *q,
+					 void (*destroy)(void *))
+{
+	ptr_ring_cleanup(&q->ring, destroy);
+}
+
+/* Producer side */
+static inline bool ptr_ring_spsc_full(struct ptr_ring_spsc *q)
+{
+	return __ptr_ring_full(&q->ring);
+}
+
+static inline int ptr_ring_spsc_produce(struct ptr_ring_spsc *q, void *ptr)
+{
+	return __ptr_ring_produce(&q->ring, ptr);
+}
+
+static inline int ptr_ring_spsc_produce_batched(struct ptr_ring_spsc *q,
+						void **array, int n)
+{
+	return __ptr_ring_produce_batched(&q->ring, array, n);
+}
+
+/* Consumer side */
+static inline bool ptr_ring_spsc_empty(struct ptr_ring_spsc *q)
+{
+	return __ptr_ring_empty(&q->ring);
+}
+
+static inline void *ptr_ring_spsc_peek(struct ptr_ring_spsc *q)
+{
+	return __ptr_ring_peek(&q->ring);
+}
+
+static inline void *ptr_ring_spsc_consume(struct ptr_ring_spsc *q)
+{
+	return __ptr_ring_consume(&q->ring);
+}
+
+static inline int ptr_ring_spsc_consume_batched(struct ptr_ring_spsc *q,
+						void **array, int n)
+{
+	return __ptr_ring_consume_batched(&q->ring, array, n);
+}
+
+#endif /* _LINUX_PTR_RING_SPSC_H */
@@ -19,7 +19,8 @@
  * Qmempool cannot easily replace all kmem_cache usage, because it is
  * restricted in which contexts is can be used in, as the Lock-Free
  * queue is not preemption safe.  This version is optimized for usage
- * from softirq context, and cannot be used from hardirq context.
+ * from softirq context.  Pools created by qmempool_create_irqsafe()
+ * can also be used from hardirq context, via the "_irq" API.
  *
  * Only support GFP_ATOMIC allocations from SLAB.
  *
@@ -33,6 +34,11 @@
 #include <linux/alf_queue.h>
 #include <linux/prefetch.h>
 #include <linux/hardirq.h>
+#include <linux/mm.h>
+#include <linux/topology.h>
+#include <linux/shrinker.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
 
 /* Bulking is an essential part of the performance gains as this
  * amortize the cost of cmpxchg ops used when accessing sharedq
@@ -40,8 +46,56 @@
 #define QMEMPOOL_BULK 16
 #define QMEMPOOL_REFILL_MULTIPLIER 2
 
+/* Bounds for the adaptive per CPU bulk size, where QMEMPOOL_BULK is
+ * the initial bulk size.  The on stack arrays are QMEMPOOL_BULK_MAX.
+ */
+#define QMEMPOOL_BULK_MIN 4
+#define QMEMPOOL_BULK_MAX 32
+
+/* Snapshot of queue activity, for detecting idle queues */
+struct qmempool_snap {
+	u32 p_tail;
+	u32 c_head;
+};
+
+/* Per CPU statistics, always enabled.  Only the owning CPU updates
+ * them (from a preemptive safe context), thus plain increments.  Using
+ * unsigned long avoids torn reads on 32-bit, when read via debugfs.
+ *
+ * The hit/miss counters are per element, the rest per event, except
+ * slab_free which counts elements returned to SLAB.
+ */
+struct qmempool_stats {
+	unsigned long alloc_hit;  /* served from localq */
+	unsigned long alloc_miss; /* localq empty */
+	unsigned long free_hit;   /* stored in localq */
+	unsigned long free_miss;  /* localq full */
+	unsigned long refill;     /* localq refill from sharedq */
+	unsigned long flush;      /* localq flush to sharedq */
+	unsigned long slab_alloc; /* sharedq empty, alloc from SLAB */
+	unsigned long slab_free;  /* sharedq full, elems free'ed to SLAB */
+	unsigned long remote;     /* elems returned to remote node */
+};
+
 struct qmempool_percpu {
 	struct alf_queue *localq;
+	struct qmempool_stats stat;
+
+	/* Adaptive sizing, updated on slowpath events only, see
+	 * __qmempool_adapt().  The bulk is the transfer size between
+	 * localq and sharedq, and depth is the max elements cached in
+	 * localq (bounded by the localq size).
+	 */
+	unsigned int bulk;
+	unsigned int depth;
+	unsigned int refills;
+	unsigned int flushes;
+	unsigned long window_start; /* jiffies */
+
+	/* Idle decay of localq, the work runs on the owning CPU */
+	struct qmempool *pool;
+	struct qmempool_snap idle;
+	struct work_struct decay_work;
 };
 
 struct qmempool {
@@ -49,12 +103,16 @@ struct qmempool {
 	 *  queue where access is protected by an atomic cmpxchg operation.
 	 *  The queue support bulk transfers, which amortize the cost
 	 *  of the atomic cmpxchg operation.
+	 *
+	 * There is a sharedq per NUMA node (indexed by node id), which
+	 *  only contains elements with memory belonging to that node.
 	 */
-	struct alf_queue	*sharedq;
+	struct alf_queue	**sharedq;
 
 	/* Per CPU local "cache" queues for faster atomic free access.
 	 * The local queues (localq) are Single-Producer-Single-Consumer
-	 * queues as they are per CPU.
+	 * queues as they are per CPU.  Only online CPUs have a localq,
+	 * see CPU hotplug handling in qmempool.c.
 	 */
 	struct qmempool_percpu __percpu *percpu;
 
@@ -62,26 +120,86 @@ struct qmempool {
 	struct kmem_cache	*kmem;
 
 	/* Setup */
+	uint32_t localq_sz;
 	uint32_t prealloc;
 	gfp_t gfp_mask;
+	bool numa; /* More than one memory node, route elems to home node */
+	bool adaptive; /* Adapt per CPU bulk and depth, default on */
+	bool prefetch; /* Prefetch next localq element on alloc, default on */
+	bool irqsafe;  /* Hardirq-safe pool, only use the "_irq" API */
+
+	/* Optional element init callbacks, see qmempool_create_ctor() */
+	void (*ctor)(void *elem);
+	void (*reset)(void *elem);
+
+	/* On global qmempool_list, for CPU hotplug */
+	struct list_head list;
+
+	/* Reclaim: release cached elements under memory pressure, and
+	 * decay caches that have been idle for a while.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	struct shrinker *shrinker;
+#else
+	struct shrinker shrinker;
+	bool shrinker_registered;
+#endif
+	struct delayed_work decay_work;
+	struct qmempool_snap *sharedq_idle; /* per node */
+
+	/* Statistics file, in debugfs dir "qmempool" */
+	struct dentry *debugfs;
 };
 
+/* The pool shrinker, embedded in the pool before v6.7 */
+static inline struct shrinker *qmempool_shrinker(struct qmempool *pool)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	return pool->shrinker;
+#else
+	return &pool->shrinker;
+#endif
+}
+
+/* Create and destroy must be called from process context */
 extern void qmempool_destroy(struct qmempool *pool);
 extern struct qmempool *qmempool_create(
 	uint32_t localq_sz, uint32_t sharedq_sz, uint32_t prealloc,
 	struct kmem_cache *kmem, gfp_t gfp_mask);
+extern struct qmempool *qmempool_create_ctor(
+	uint32_t localq_sz, uint32_t sharedq_sz, uint32_t prealloc,
+	struct kmem_cache *kmem, gfp_t gfp_mask,
+	void (*ctor)(void *elem), void (*reset)(void *elem));
+extern struct qmempool *qmempool_create_irqsafe(
+	uint32_t localq_sz, uint32_t sharedq_sz, uint32_t prealloc,
+	struct kmem_cache *kmem, gfp_t gfp_mask);
 
 extern void *__qmempool_alloc_from_sharedq(
-	struct qmempool *pool, gfp_t gfp_mask, struct alf_queue *localq);
+	struct qmempool *pool, gfp_t gfp_mask, struct qmempool_percpu *cpu);
 extern void __qmempool_free_to_sharedq(void *elem, struct qmempool *pool,
-				       struct alf_queue *localq);
+				       struct qmempool_percpu *cpu);
+extern void __qmempool_free_remote(void *elem, struct qmempool *pool,
+				   int nid);
+extern int __qmempool_alloc_bulk_from_sharedq(
+	struct qmempool *pool, gfp_t gfp_mask, struct qmempool_percpu *cpu,
+	int n, void **ptrs);
+extern void __qmempool_free_bulk_to_sharedq(struct qmempool *pool,
+					    struct qmempool_percpu *cpu,
+					    int n, void **ptrs);
+
+/* The NUMA node the element memory belongs to */
+static inline int qmempool_elem_node(void *elem)
+{
+	return page_to_nid(virt_to_page(elem));
+}
 
 /* The percpu variables (SPSC queues) needs preempt protection, and
  * the shared MPMC queue also needs protection against the same CPU
  * access the same queue.
  *
  * Specialize and optimize the qmempool to run from softirq.
- * Don't allow qmempool to be used from interrupt context.
+ * Don't allow qmempool to be used from interrupt context, except for
+ * irqsafe pools, see __qmempool_alloc_irq().
  *
  * IDEA: When used from softirq, take advantage of the protection
  * softirq gives.  A softirq will never preempt another softirq,
@@ -131,24 +249,37 @@ static inline void __qmempool_preempt_enable(int in_serving_softirq)
  */
 static inline void * main_qmempool_alloc(struct qmempool *pool, gfp_t gfp_mask)
 {
-	/* NUMA considerations, for now the numa node is not handles,
-	 * this could be handled via e.g. numa_mem_id()
+	/* NUMA: the localq only caches elements from the local memory
+	 * node, numa_mem_id(), as main_qmempool_free() returns remote
+	 * elements to their home node.  Thus, no node check is needed.
 	 */
-	void *elem;
+	void *elem, *next;
 	struct qmempool_percpu *cpu;
 	int num;
 
 	/* 1. attempt get element from local per CPU queue */
 	cpu = this_cpu_ptr(pool->percpu);
 	num = alf_sc_dequeue(cpu->localq, (void **)&elem, 1);
-	if (num == 1) /* Succes: alloc elem by deq from localq cpu cache */
-		return elem;
+	if (num == 1) { /* Succes: alloc elem by deq from localq cpu cache */
+		cpu->stat.alloc_hit++;
+		/* Hide the first-touch miss of the next alloc */
+		if (pool->prefetch) {
+			next = alf_sc_peek(cpu->localq);
+			if (next)
+				prefetchw(next);
+		}
+	} else {
+		/* 2. attempt get element from shared queue.  This
+		 * involves refilling the localq for next round.
+		 * Side-effect can be alloc from SLAB.
+		 */
+		elem = __qmempool_alloc_from_sharedq(pool, gfp_mask, cpu);
+		if (unlikely(!elem))
+			return NULL;
+	}
 
-	/* 2. attempt get element from shared queue.  This involves
-	 * refilling the localq for next round. Side-effect can be
-	 * alloc from SLAB.
-	 */
-	elem = __qmempool_alloc_from_sharedq(pool, gfp_mask, cpu->localq);
+	if (pool->reset)
+		pool->reset(elem);
 	return elem;
 }
 
@@ -173,23 +304,34 @@ static inline void *__qmempool_alloc_softirq(struct qmempool *pool,
 static inline void main_qmempool_free(struct qmempool *pool, void *elem)
 {
 	struct qmempool_percpu *cpu;
-	int num;
 
-	/* NUMA considerations, how do we make sure to avoid caching
-	 * elements from a different NUMA node.
+	/* NUMA: avoid caching elements from a different node in
+	 * localq, return these to the sharedq of their home node.
 	 */
+	if (pool->numa) {
+		int nid = qmempool_elem_node(elem);
 
-	/* 1. attempt to free/return element to local per CPU queue */
+		if (unlikely(nid != numa_mem_id())) {
+			__qmempool_free_remote(elem, pool, nid);
+			return;
+		}
+	}
+
+	/* 1. attempt to free/return element to local per CPU queue,
+	 * limited by the effective (adaptive) depth of localq.
+	 */
 	cpu = this_cpu_ptr(pool->percpu);
-	num = alf_sp_enqueue(cpu->localq, &elem, 1);
-	if (num == 1) /* success: element free'ed by enqueue to localq */
-		return;
+	if (likely(alf_queue_count(cpu->localq) < cpu->depth) &&
+	    alf_sp_enqueue(cpu->localq, &elem, 1) == 1) {
+		cpu->stat.free_hit++;
+		return; /* success: element free'ed by enqueue to localq */
+	}
 
 	/* 2. localq cannot store more elements, need to return some
 	 * from localq to sharedq, to make room. Side-effect can be
 	 * free to SLAB.
 	 */
-	__qmempool_free_to_sharedq(elem, pool, cpu->localq);
+	__qmempool_free_to_sharedq(elem, pool, cpu);
 }
 
 static inline void __qmempool_free(struct qmempool *pool, void *elem)
@@ -205,10 +347,120 @@ static inline void __qmempool_free_softirq(struct qmempool *pool, void *elem)
 	main_qmempool_free(pool, elem);
 }
 
+/* Hardirq-safe variants, for pools created by qmempool_create_irqsafe()
+ *
+ * Used when elements are e.g. free'ed from hardirq TX completion.
+ * Protection is local IRQ disable, instead of BH disable, and covers
+ * both the per CPU localq and the sharedq (where a producer must not
+ * be interrupted by another producer on the same CPU).  The internal
+ * pool maintenance (decay, hotplug drain, shrinker) also disables
+ * IRQs for these pools.  Thus, all users of such a pool MUST use the
+ * "_irq" API, from any context.
+ *
+ * A this_cpu cmpxchg based localq is not used, as the localq bulk
+ * transfers to/from sharedq must be atomic against interrupts anyhow.
+ * See qmempool_bench for the measured cost against the BH variants.
+ */
+static inline void *__qmempool_alloc_irq(struct qmempool *pool,
+					 gfp_t gfp_mask)
+{
+	unsigned long flags;
+	void *elem;
+
+	local_irq_save(flags);
+	elem = main_qmempool_alloc(pool, gfp_mask);
+	local_irq_restore(flags);
+	return elem;
+}
+
+static inline void __qmempool_free_irq(struct qmempool *pool, void *elem)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	main_qmempool_free(pool, elem);
+	local_irq_restore(flags);
+}
+
+/* Bulk alloc and free
+ *
+ * Move whole bulks between the callers array and the queues, paying
+ * for the localq/sharedq access once per bulk instead of per element.
+ * The bulk alloc takes what localq holds, and the remainder directly
+ * from sharedq (without refilling localq), and last from SLAB.
+ *
+ * Returns number of elements allocated, which is less than 'n' only
+ * if SLAB is depleted.
+ */
+static inline int main_qmempool_alloc_bulk(struct qmempool *pool,
+					   gfp_t gfp_mask, int n, void **ptrs)
+{
+	struct qmempool_percpu *cpu = this_cpu_ptr(pool->percpu);
+	int num, i;
+
+	num = alf_sc_dequeue(cpu->localq, ptrs, n);
+	cpu->stat.alloc_hit += num;
+	if (unlikely(num < n)) {
+		cpu->stat.alloc_miss += n - num;
+		num += __qmempool_alloc_bulk_from_sharedq(pool, gfp_mask, cpu,
+							  n - num, &ptrs[num]);
+	}
+
+	if (pool->reset)
+		for (i = 0; i < num; i++)
+			pool->reset(ptrs[i]);
+	return num;
+}
+
+/* The bulk free enqueues the whole array into localq, if it fits
+ * within the localq depth, else into sharedq.  NUMA pools always take
+ * the slowpath, as elements must be returned to their home node.
+ */
+static inline void main_qmempool_free_bulk(struct qmempool *pool,
+					   int n, void **ptrs)
+{
+	struct qmempool_percpu *cpu = this_cpu_ptr(pool->percpu);
+
+	if (likely(!pool->numa) &&
+	    alf_queue_count(cpu->localq) + n <= cpu->depth &&
+	    alf_sp_enqueue(cpu->localq, ptrs, n) == n) {
+		cpu->stat.free_hit += n;
+		return;
+	}
+
+	__qmempool_free_bulk_to_sharedq(pool, cpu, n, ptrs);
+}
+
+static inline int __qmempool_alloc_bulk(struct qmempool *pool,
+					gfp_t gfp_mask, int n, void **ptrs)
+{
+	int state, num;
+
+	state = __qmempool_preempt_disable();
+	num = main_qmempool_alloc_bulk(pool, gfp_mask, n, ptrs);
+	__qmempool_preempt_enable(state);
+	return num;
+}
+
+static inline void __qmempool_free_bulk(struct qmempool *pool,
+					int n, void **ptrs)
+{
+	int state;
+
+	state = __qmempool_preempt_disable();
+	main_qmempool_free_bulk(pool, n, ptrs);
+	__qmempool_preempt_enable(state);
+}
+
 /* API users can choose to use "__" prefixed versions for inlining */
 extern void *qmempool_alloc(struct qmempool *pool, gfp_t gfp_mask);
 extern void *qmempool_alloc_softirq(struct qmempool *pool, gfp_t gfp_mask);
 extern void qmempool_free(struct qmempool *pool, void *elem);
 extern void qmempool_free_softirq(struct qmempool *pool, void *elem);
+extern int qmempool_alloc_bulk(struct qmempool *pool, gfp_t gfp_mask,
+			       int n, void **ptrs);
+extern void qmempool_free_bulk(struct qmempool *pool, int n, void **ptrs);
+extern void *qmempool_alloc_irq(struct qmempool *pool, gfp_t gfp_mask);
+extern void qmempool_free_irq(struct qmempool *pool, void *elem);
 
 #endif /* _LINUX_QMEMPOOL_H */
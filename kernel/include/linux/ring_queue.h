@@ -99,12 +99,17 @@
  * - Multi- or single-producer enqueue.
  * - Bulk dequeue.
  * - Bulk enqueue.
+ * - Relaxed tail sync (RTS) and head/tail sync (HTS) multi-producer modes.
  *
- * Note: the ring implementation is not preemptable. A core must not
- * be interrupted by another task that uses the same ring.
+ * Note: the default MP ring implementation is not preemptable. A core
+ * must not be interrupted by another task that uses the same ring.
+ * The RTS and HTS producer modes (RING_F_MP_RTS_ENQ, RING_F_MP_HTS_ENQ)
+ * remove the in-order wait on prod.tail, and are meant for setups
+ * where producers can be preempted, e.g. on overcommitted vCPUs.
  */
 
 #include <linux/errno.h>
+#include <linux/bug.h>
 #include <asm/processor.h>  /* cpu_relax() */
 #include <linux/compiler.h> /* barrier() */
 #include <linux/percpu.h>
@@ -114,6 +119,38 @@ enum ring_queue_queue_behavior {
 	RING_QUEUE_VARIABLE   /* Enq/Deq as many items a possible from ring */
 };
 
+/* Producer synchronization modes, selected by flags at create time */
+enum ring_queue_sync_type {
+	RING_QUEUE_SYNC_MT = 0,	/* Multi-thread safe (default mode) */
+	RING_QUEUE_SYNC_ST,	/* Single thread only */
+	RING_QUEUE_SYNC_MT_RTS,	/* Multi-thread, relaxed tail sync */
+	RING_QUEUE_SYNC_MT_HTS,	/* Multi-thread, head/tail sync */
+};
+
+/* RTS: position and update counter, read and cmpxchg'ed as one unit.
+ * The tail is only moved forward, when the last producer in flight
+ * finish, thus producers don't wait for each-other in-order.
+ */
+union ring_queue_rts_poscnt {
+	u64 raw;
+	struct {
+		u32 cnt;	/* Head/tail update counter */
+		u32 pos;	/* Head/tail position */
+	} val;
+};
+
+/* HTS: head and tail read and cmpxchg'ed as one unit.  Only one
+ * producer at a time can be in flight (head != tail), but waiting
+ * happens before an index is reserved, not after writing entries.
+ */
+union ring_queue_hts_pos {
+	u64 raw;
+	struct {
+		u32 head;	/* Producer head */
+		u32 tail;	/* Producer tail */
+	} pos;
+};
+
 /**
  * The ring queue structure.
  *
@@ -133,8 +170,20 @@ struct ring_queue {
 		u32 sp_enqueue;	/* True, if single producer */
 		u32 size;	/* Size of ring */
 		u32 mask;	/* Mask (size-1) of ring */
-		u32 head;	/* Producer head */
-		u32 tail;	/* Producer tail */
+		/* The tail position MUST stay at the same offset in
+		 * all sync modes, as the consumer only reads prod.tail
+		 */
+		union {
+			struct {
+				u32 head;	/* Producer head */
+				u32 tail;	/* Producer tail */
+			};
+			union ring_queue_hts_pos hts;	/* HTS head+tail */
+			union ring_queue_rts_poscnt rts_tail; /* RTS tail */
+		};
+		u32 sync_type;	/* enum ring_queue_sync_type */
+		u32 htd_max;	/* RTS: Max allowed head-tail distance */
+		union ring_queue_rts_poscnt rts_head; /* RTS head */
 	} prod ____cacheline_aligned_in_smp;
 
 	/* Ring consumer status */
@@ -158,12 +207,15 @@ struct ring_queue {
 
 #define RING_F_SP_ENQ 0x0001 /* Flag selects enqueue "single-producer" */
 #define RING_F_SC_DEQ 0x0002 /* Flag selects dequeue "single-consumer" */
+#define RING_F_MP_RTS_ENQ 0x0004 /* Enqueue "multi-producer" relaxed tail */
+#define RING_F_MP_HTS_ENQ 0x0008 /* Enqueue "multi-producer" head/tail sync */
 #define RING_QUEUE_QUOT_EXCEED (1 << 31)  /* Quota exceed for burst ops */
 #define RING_QUEUE_SZ_MASK  (unsigned)(0x0fffffff) /* Ring size mask */
 
 struct ring_queue * ring_queue_create(unsigned int count, unsigned int flags);
 bool ring_queue_free(struct ring_queue *r);
 int ring_queue_set_water_mark(struct ring_queue *r, unsigned count);
+int ring_queue_set_prod_htd_max(struct ring_queue *r, unsigned count);
 
 /* the actual enqueue of pointers on the ring.
  * Placed here since identical code needed in both
@@ -342,6 +394,194 @@ __ring_queue_sp_do_enqueue(struct ring_queue *r, void * const *obj_table,
 	return ret;
 }
 
+/* Calculate return value, and check watermark, shared by RTS/HTS */
+static inline int
+__ring_queue_enqueue_ret(struct ring_queue *r, u32 free_entries, unsigned n,
+			 enum ring_queue_queue_behavior behavior)
+{
+	u32 mask = r->prod.mask;
+
+	/* if we exceed the watermark */
+	if (unlikely(((mask + 1) - free_entries + n) > r->prod.watermark))
+		return (behavior == RING_QUEUE_FIXED) ? -EDQUOT :
+			(int)(n | RING_QUEUE_QUOT_EXCEED);
+
+	return (behavior == RING_QUEUE_FIXED) ? 0 : n;
+}
+
+/* Main: Multi-Producer Enqueue, Relaxed Tail Sync (RTS)
+ *  can Enqueue several objects on the ring (multi-producers safe)
+ *
+ * Producers don't wait for preceding producers to update the tail.
+ * Instead every producer increment the tail update counter, and the
+ * last producer to finish (tail.cnt catching up with head.cnt) moves
+ * tail.pos to head.pos.  To avoid the consumer being starved, the
+ * distance between head and tail is limited by prod.htd_max.
+ */
+static inline int
+__ring_queue_mp_rts_do_enqueue(struct ring_queue *r, void * const *obj_table,
+			       unsigned n,
+			       enum ring_queue_queue_behavior behavior)
+{
+	union ring_queue_rts_poscnt oh, nh, ot, nt, h;
+	u32 prod_head, cons_tail, free_entries;
+	const unsigned max = n;
+	unsigned i;
+	u32 mask = r->prod.mask;
+	int ret;
+
+	/* move prod.rts_head atomically */
+	oh.raw = READ_ONCE(r->prod.rts_head.raw);
+	do {
+		/* Reset n to the initial burst count */
+		n = max;
+
+		/* Wait for head-tail distance to get within limit */
+		while (unlikely(oh.val.pos - READ_ONCE(r->prod.tail) >
+				r->prod.htd_max)) {
+			cpu_relax();
+			oh.raw = READ_ONCE(r->prod.rts_head.raw);
+		}
+
+		cons_tail = READ_ONCE(r->cons.tail);
+		free_entries = (mask + cons_tail - oh.val.pos);
+
+		/* check that we have enough room in ring */
+		if (unlikely(n > free_entries)) {
+			if (behavior == RING_QUEUE_FIXED) {
+				return -ENOBUFS;
+			} else {
+				/* No free entry available */
+				if (unlikely(free_entries == 0)) {
+					return 0;
+				}
+
+				n = free_entries;
+			}
+		}
+
+		nh.val.pos = oh.val.pos + n;
+		nh.val.cnt = oh.val.cnt + 1;
+		h.raw = cmpxchg64(&r->prod.rts_head.raw, oh.raw, nh.raw);
+		if (likely(h.raw == oh.raw))
+			break;
+		oh.raw = h.raw;
+	} while (1);
+	/* smp_rmb() for cons.tail is implicit by cmpxchg */
+
+	prod_head = oh.val.pos;
+	ENQUEUE_PTRS(); /* write entries in ring */
+	smp_wmb(); /* matching dequeue LOADs */
+
+	ret = __ring_queue_enqueue_ret(r, free_entries, n, behavior);
+
+	/* Increment tail.cnt, and if we are the last producer in
+	 * flight, move tail.pos up to head.pos
+	 */
+	ot.raw = READ_ONCE(r->prod.rts_tail.raw);
+	do {
+		h.raw = READ_ONCE(r->prod.rts_head.raw);
+		nt.raw = ot.raw;
+		if (++nt.val.cnt == h.val.cnt)
+			nt.val.pos = h.val.pos;
+		nh.raw = cmpxchg64(&r->prod.rts_tail.raw, ot.raw, nt.raw);
+		if (likely(nh.raw == ot.raw))
+			break;
+		ot.raw = nh.raw;
+	} while (1);
+
+	return ret;
+}
+
+/* HTS: Move prod head, waiting for preceding enqueue to finish.
+ * Returns the number of reserved entries, or -ENOBUFS.
+ */
+static inline int
+__ring_queue_hts_move_prod_head(struct ring_queue *r, unsigned n,
+				enum ring_queue_queue_behavior behavior,
+				u32 *old_head, u32 *free_entries)
+{
+	union ring_queue_hts_pos op, np;
+	const unsigned max = n;
+	u32 mask = r->prod.mask;
+	u32 cons_tail;
+
+	/* move prod.hts.pos.head atomically */
+	op.raw = READ_ONCE(r->prod.hts.raw);
+	do {
+		/* Reset n to the initial burst count */
+		n = max;
+
+		/* Wait for preceding enqueue to finish (head == tail) */
+		while (unlikely(op.pos.head != op.pos.tail)) {
+			cpu_relax();
+			op.raw = READ_ONCE(r->prod.hts.raw);
+		}
+
+		cons_tail = READ_ONCE(r->cons.tail);
+		*free_entries = (mask + cons_tail - op.pos.head);
+
+		/* check that we have enough room in ring */
+		if (unlikely(n > *free_entries)) {
+			if (behavior == RING_QUEUE_FIXED) {
+				return -ENOBUFS;
+			} else {
+				/* No free entry available */
+				if (unlikely(*free_entries == 0)) {
+					return 0;
+				}
+
+				n = *free_entries;
+			}
+		}
+
+		np.pos.tail = op.pos.tail;
+		np.pos.head = op.pos.head + n;
+		np.raw = cmpxchg64(&r->prod.hts.raw, op.raw, np.raw);
+		if (likely(np.raw == op.raw))
+			break;
+		op.raw = np.raw;
+	} while (1);
+	/* smp_rmb() for cons.tail is implicit by cmpxchg */
+
+	*old_head = op.pos.head;
+	return n;
+}
+
+/* Main: Multi-Producer Enqueue, Head/Tail Sync (HTS)
+ *  can Enqueue several objects on the ring (multi-producers safe)
+ *
+ * Head and tail are updated as one unit, and a producer can only
+ * reserve room when no other enqueue is in flight (head == tail).
+ * Thus, a preempted producer only stalls others before they have
+ * reserved anything, and tail is updated without waiting.
+ */
+static inline int
+__ring_queue_mp_hts_do_enqueue(struct ring_queue *r, void * const *obj_table,
+			       unsigned n,
+			       enum ring_queue_queue_behavior behavior)
+{
+	u32 prod_head, free_entries;
+	unsigned i;
+	u32 mask = r->prod.mask;
+	int ret;
+
+	ret = __ring_queue_hts_move_prod_head(r, n, behavior,
+					      &prod_head, &free_entries);
+	if (unlikely(ret <= 0))
+		return ret;
+	n = ret;
+
+	ENQUEUE_PTRS(); /* write entries in ring */
+	smp_wmb(); /* matching dequeue LOADs */
+
+	ret = __ring_queue_enqueue_ret(r, free_entries, n, behavior);
+
+	/* No other producer can be in flight, simply publish tail */
+	WRITE_ONCE(r->prod.tail, prod_head + n);
+	return ret;
+}
+
 /* Main: Multi-Consumer dequeue (cmpxchg based)
  *  can dequeue several objects from a ring (multi-consumers safe).
  */
@@ -494,6 +734,57 @@ ring_queue_sp_enqueue_bulk(struct ring_queue *r, void * const *obj_table,
 	return __ring_queue_sp_do_enqueue(r, obj_table, n, RING_QUEUE_FIXED);
 }
 
+/**
+ * Enqueue several objects on the ring (multi-producers safe), using
+ * relaxed tail sync.  Ring MUST have been created with RING_F_MP_RTS_ENQ.
+ *
+ * @return
+ *   Same as ring_queue_mp_enqueue_bulk().
+ */
+static inline int
+ring_queue_mp_rts_enqueue_bulk(struct ring_queue *r, void * const *obj_table,
+			       unsigned n)
+{
+	return __ring_queue_mp_rts_do_enqueue(r, obj_table, n,
+					      RING_QUEUE_FIXED);
+}
+
+/**
+ * Enqueue several objects on the ring (multi-producers safe), using
+ * head/tail sync.  Ring MUST have been created with RING_F_MP_HTS_ENQ.
+ *
+ * @return
+ *   Same as ring_queue_mp_enqueue_bulk().
+ */
+static inline int
+ring_queue_mp_hts_enqueue_bulk(struct ring_queue *r, void * const *obj_table,
+			       unsigned n)
+{
+	return __ring_queue_mp_hts_do_enqueue(r, obj_table, n,
+					      RING_QUEUE_FIXED);
+}
+
+/* Select enqueue variant based on the producer sync mode that was
+ * specified at ring creation time (see flags).
+ */
+static inline int
+__ring_queue_do_enqueue(struct ring_queue *r, void * const *obj_table,
+			unsigned n, enum ring_queue_queue_behavior behavior)
+{
+	switch (r->prod.sync_type) {
+	case RING_QUEUE_SYNC_ST:
+		return __ring_queue_sp_do_enqueue(r, obj_table, n, behavior);
+	case RING_QUEUE_SYNC_MT_RTS:
+		return __ring_queue_mp_rts_do_enqueue(r, obj_table, n,
+						      behavior);
+	case RING_QUEUE_SYNC_MT_HTS:
+		return __ring_queue_mp_hts_do_enqueue(r, obj_table, n,
+						      behavior);
+	default:
+		return __ring_queue_mp_do_enqueue(r, obj_table, n, behavior);
+	}
+}
+
 /* This function calls the multi-producer or the single-producer
  * version depending on the default behavior that was specified at
  * ring creation time (see flags).
@@ -502,10 +793,7 @@ static inline int
 ring_queue_enqueue_bulk(struct ring_queue *r, void * const *obj_table,
 		      unsigned n)
 {
-	if (r->prod.sp_enqueue)
-		return ring_queue_sp_enqueue_bulk(r, obj_table, n);
-	else
-		return ring_queue_mp_enqueue_bulk(r, obj_table, n);
+	return __ring_queue_do_enqueue(r, obj_table, n, RING_QUEUE_FIXED);
 }
 
 /**
@@ -556,10 +844,7 @@ ring_queue_sp_enqueue(struct ring_queue *r, void *obj)
 static inline int
 ring_queue_enqueue(struct ring_queue *r, void *obj)
 {
-	if (r->prod.sp_enqueue)
-		return ring_queue_sp_enqueue(r, obj);
-	else
-		return ring_queue_mp_enqueue(r, obj);
+	return ring_queue_enqueue_bulk(r, &obj, 1);
 }
 
 /**
@@ -741,14 +1026,27 @@ ring_queue_sp_enqueue_burst(struct ring_queue *r, void * const *obj_table,
 	return __ring_queue_sp_do_enqueue(r, obj_table, n, RING_QUEUE_VARIABLE);
 }
 
+static inline int
+ring_queue_mp_rts_enqueue_burst(struct ring_queue *r, void * const *obj_table,
+				unsigned n)
+{
+	return __ring_queue_mp_rts_do_enqueue(r, obj_table, n,
+					      RING_QUEUE_VARIABLE);
+}
+
+static inline int
+ring_queue_mp_hts_enqueue_burst(struct ring_queue *r, void * const *obj_table,
+				unsigned n)
+{
+	return __ring_queue_mp_hts_do_enqueue(r, obj_table, n,
+					      RING_QUEUE_VARIABLE);
+}
+
 static inline int
 ring_queue_enqueue_burst(struct ring_queue *r, void * const *obj_table,
 		      unsigned n)
 {
-	if (r->prod.sp_enqueue)
-		return ring_queue_sp_enqueue_burst(r, obj_table, n);
-	else
-		return ring_queue_mp_enqueue_burst(r, obj_table, n);
+	return __ring_queue_do_enqueue(r, obj_table, n, RING_QUEUE_VARIABLE);
 }
 
 static inline int
@@ -772,4 +1070,185 @@ ring_queue_dequeue_burst(struct ring_queue *r, void **obj_table, unsigned n)
 		return ring_queue_mc_dequeue_burst(r, obj_table, n);
 }
 
+/*** Zero-copy API ***
+ *
+ * Instead of copying pointers between a caller array and ring[], the
+ * *_zc_*_start() functions reserve entries and hand out direct
+ * pointers into ring[].  The reserved area can be split into two
+ * regions, when wrapping the end of ring[].  The caller read/write the
+ * entries, and then calls *_zc_finish() with the number of entries
+ * actually used (which can be less than reserved).
+ *
+ * This is useful for moving objects ring-to-ring without an
+ * intermediate array.  As the reservation must be stable until
+ * finish, this is only supported for single-producer (RING_F_SP_ENQ)
+ * or HTS producer (RING_F_MP_HTS_ENQ) and single-consumer
+ * (RING_F_SC_DEQ) rings.
+ */
+struct ring_queue_zc_data {
+	void **ptr1;		/* First region in ring[] */
+	void **ptr2;		/* Second region (start of ring[]) or NULL */
+	unsigned int n1;	/* Number of entries in first region */
+};
+
+static inline void
+__ring_queue_zc_fill(struct ring_queue *r, u32 head, unsigned n,
+		     struct ring_queue_zc_data *zcd)
+{
+	u32 idx = head & r->prod.mask;
+
+	zcd->ptr1 = &r->ring[idx];
+	if (likely(idx + n <= r->prod.size)) {
+		zcd->n1 = n;
+		zcd->ptr2 = NULL;
+	} else {
+		zcd->n1 = r->prod.size - idx;
+		zcd->ptr2 = &r->ring[0];
+	}
+}
+
+static inline int
+__ring_queue_enqueue_zc_start(struct ring_queue *r, unsigned n,
+			      struct ring_queue_zc_data *zcd,
+			      enum ring_queue_queue_behavior behavior)
+{
+	u32 prod_head, cons_tail, free_entries;
+	u32 mask = r->prod.mask;
+	int ret;
+
+	switch (r->prod.sync_type) {
+	case RING_QUEUE_SYNC_ST:
+		prod_head = READ_ONCE(r->prod.head);
+		smp_rmb(); /* for cons.tail write, making sure deq loads done */
+		cons_tail = READ_ONCE(r->cons.tail);
+		free_entries = mask + cons_tail - prod_head;
+		if (unlikely(n > free_entries)) {
+			if (behavior == RING_QUEUE_FIXED)
+				return -ENOBUFS;
+			n = free_entries;
+			if (unlikely(n == 0))
+				return 0;
+		}
+		WRITE_ONCE(r->prod.head, prod_head + n);
+		break;
+	case RING_QUEUE_SYNC_MT_HTS:
+		ret = __ring_queue_hts_move_prod_head(r, n, behavior,
+						      &prod_head,
+						      &free_entries);
+		if (unlikely(ret <= 0))
+			return ret;
+		n = ret;
+		break;
+	default:
+		WARN_ON_ONCE(1); /* Producer sync mode not supported */
+		return -EINVAL;
+	}
+
+	__ring_queue_zc_fill(r, prod_head, n, zcd);
+	return n;
+}
+
+/**
+ * Reserve room for n objects in the ring for zero-copy enqueue.
+ *
+ * @return
+ *   - n: Success; n entries reserved, described by zcd.
+ *   - -ENOBUFS: Not enough room in the ring; nothing reserved.
+ */
+static inline int
+ring_queue_enqueue_zc_bulk_start(struct ring_queue *r, unsigned n,
+				 struct ring_queue_zc_data *zcd)
+{
+	return __ring_queue_enqueue_zc_start(r, n, zcd, RING_QUEUE_FIXED);
+}
+
+/* Reserve room for up to n objects, returns number of entries reserved */
+static inline int
+ring_queue_enqueue_zc_burst_start(struct ring_queue *r, unsigned n,
+				  struct ring_queue_zc_data *zcd)
+{
+	return __ring_queue_enqueue_zc_start(r, n, zcd, RING_QUEUE_VARIABLE);
+}
+
+/**
+ * Finish zero-copy enqueue, publishing n of the reserved entries.
+ * The number n must be less or equal to the number reserved by start.
+ */
+static inline void
+ring_queue_enqueue_zc_finish(struct ring_queue *r, unsigned n)
+{
+	u32 prod_next = r->prod.tail + n;
+
+	smp_wmb(); /* matching dequeue LOADs */
+	/* Give back unused entries, and for HTS let others proceed */
+	WRITE_ONCE(r->prod.head, prod_next);
+	WRITE_ONCE(r->prod.tail, prod_next);
+}
+
+static inline int
+__ring_queue_dequeue_zc_start(struct ring_queue *r, unsigned n,
+			      struct ring_queue_zc_data *zcd,
+			      enum ring_queue_queue_behavior behavior)
+{
+	u32 cons_head, prod_tail, entries;
+
+	if (WARN_ON_ONCE(!r->cons.sc_dequeue))
+		return -EINVAL;
+
+	cons_head = READ_ONCE(r->cons.head);
+	prod_tail = READ_ONCE(r->prod.tail);
+	entries = prod_tail - cons_head;
+
+	if (n > entries) {
+		if (behavior == RING_QUEUE_FIXED)
+			return -ENOENT;
+		n = entries;
+		if (unlikely(n == 0))
+			return 0;
+	}
+	WRITE_ONCE(r->cons.head, cons_head + n);
+
+	smp_rmb(); /* matching enqueue STOREs */
+	__ring_queue_zc_fill(r, cons_head, n, zcd);
+	return n;
+}
+
+/**
+ * Get direct access to n objects in the ring for zero-copy dequeue.
+ *
+ * @return
+ *   - n: Success; n entries available, described by zcd.
+ *   - -ENOENT: Not enough entries in the ring; nothing reserved.
+ */
+static inline int
+ring_queue_dequeue_zc_bulk_start(struct ring_queue *r, unsigned n,
+				 struct ring_queue_zc_data *zcd)
+{
+	return __ring_queue_dequeue_zc_start(r, n, zcd, RING_QUEUE_FIXED);
+}
+
+/* Access up to n objects, returns number of entries available */
+static inline int
+ring_queue_dequeue_zc_burst_start(struct ring_queue *r, unsigned n,
+				  struct ring_queue_zc_data *zcd)
+{
+	return __ring_queue_dequeue_zc_start(r, n, zcd, RING_QUEUE_VARIABLE);
+}
+
+/**
+ * Finish zero-copy dequeue, releasing n of the entries back to the
+ * producer.  The number n must be less or equal to the number
+ * returned by start.
+ */
+static inline void
+ring_queue_dequeue_zc_finish(struct ring_queue *r, unsigned n)
+{
+	u32 cons_next = r->cons.tail + n;
+
+	/* cons.tail must not be visible before dequeue LOADs are finished */
+	smp_wmb();
+	WRITE_ONCE(r->cons.head, cons_next);
+	WRITE_ONCE(r->cons.tail, cons_next);
+}
+
 #endif /* _LINUX_RING_QUEUE_H */
@@ -0,0 +1,143 @@
+/*
+ * ring_queue_cache - per CPU object cache in-front of a ring_queue
+ *
+ * A mempool style object cache, modelled after the DPDK rte_mempool
+ * cache.  Each CPU have a local cache array of objects (a LIFO stack,
+ * keeping recently freed objects cache-hot), in-front of a shared
+ * Multi-Producer-Multi-Consumer ring_queue.  The shared ring is
+ * backed by a kmem_cache, when it runs empty or overflows.
+ *
+ * The local cache is refilled with up to "size" objects from the
+ * shared ring in one bulk dequeue.  On free, when the local cache
+ * exceed the "flush_threshold", the objects above "size" are
+ * returned to the shared ring in one bulk enqueue.  Thus, the
+ * cmpxchg cost of the shared ring is amortized over the bulk.
+ *
+ * The design is comparable to qmempool, which use alf_queue for both
+ * the shared and per CPU queues.  Like qmempool, this is optimized
+ * for usage from softirq, and cannot be used from hardirq context.
+ *
+ * For licensing details see kernel-base/COPYING
+ */
+#ifndef _LINUX_RING_QUEUE_CACHE_H
+#define _LINUX_RING_QUEUE_CACHE_H
+
+#include <linux/ring_queue.h>
+#include <linux/hardirq.h>
+#include <linux/bottom_half.h>
+
+#define RING_QUEUE_CACHE_MAX_SIZE 512
+
+struct ring_queue_cache_percpu {
+	unsigned int len;	/* Current number of objects in objs[] */
+	void *objs[];		/* Sized flush_threshold + 1 */
+};
+
+struct ring_queue_cache {
+	/* Per CPU local cache, only accessed by owning CPU */
+	struct ring_queue_cache_percpu __percpu *percpu;
+	unsigned int size;		/* Refill up to this many objects */
+	unsigned int flush_threshold;	/* Flush objects above size */
+
+	/* Shared MPMC ring queue */
+	struct ring_queue *ring;
+
+	/* Backed by some SLAB kmem_cache */
+	struct kmem_cache *kmem;
+	gfp_t gfp_mask;
+};
+
+extern struct ring_queue_cache *ring_queue_cache_create(
+	unsigned int cache_size, unsigned int flush_threshold,
+	unsigned int ring_size, unsigned int prealloc,
+	struct kmem_cache *kmem, gfp_t gfp_mask);
+extern void ring_queue_cache_destroy(struct ring_queue_cache *rqc);
+
+extern void *__ring_queue_cache_refill(struct ring_queue_cache *rqc,
+				       struct ring_queue_cache_percpu *cache,
+				       gfp_t gfp_mask);
+extern void __ring_queue_cache_flush(struct ring_queue_cache *rqc,
+				     struct ring_queue_cache_percpu *cache);
+
+/* Main allocation function
+ *
+ * Caller must make sure this is called from a context where the
+ * current CPU's local cache cannot be accessed concurrently, and the
+ * shared ring cannot be preempted (e.g. softirq or BH disabled).
+ */
+static inline void *main_ring_queue_cache_alloc(struct ring_queue_cache *rqc,
+						gfp_t gfp_mask)
+{
+	struct ring_queue_cache_percpu *cache = this_cpu_ptr(rqc->percpu);
+
+	/* 1. Success: alloc elem from local per CPU cache */
+	if (likely(cache->len))
+		return cache->objs[--cache->len];
+
+	/* 2. Refill local cache from shared ring, or alloc from SLAB */
+	return __ring_queue_cache_refill(rqc, cache, gfp_mask);
+}
+
+/* Main free function */
+static inline void main_ring_queue_cache_free(struct ring_queue_cache *rqc,
+					      void *elem)
+{
+	struct ring_queue_cache_percpu *cache = this_cpu_ptr(rqc->percpu);
+
+	/* 1. Always free element to local per CPU cache */
+	cache->objs[cache->len++] = elem;
+
+	/* 2. Flush objects above size to shared ring, if above threshold */
+	if (unlikely(cache->len > rqc->flush_threshold))
+		__ring_queue_cache_flush(rqc, cache);
+}
+
+/* Same BH based protection scheme as qmempool, see qmempool.h */
+static inline void *__ring_queue_cache_alloc(struct ring_queue_cache *rqc,
+					     gfp_t gfp_mask)
+{
+	int in_serving_softirq = in_serving_softirq();
+	void *elem;
+
+	if (!in_serving_softirq)
+		local_bh_disable();
+	elem = main_ring_queue_cache_alloc(rqc, gfp_mask);
+	if (!in_serving_softirq)
+		local_bh_enable();
+	return elem;
+}
+
+static inline void *__ring_queue_cache_alloc_softirq(
+	struct ring_queue_cache *rqc, gfp_t gfp_mask)
+{
+	return main_ring_queue_cache_alloc(rqc, gfp_mask);
+}
+
+static inline void __ring_queue_cache_free(struct ring_queue_cache *rqc,
+					   void *elem)
+{
+	int in_serving_softirq = in_serving_softirq();
+
+	if (!in_serving_softirq)
+		local_bh_disable();
+	main_ring_queue_cache_free(rqc, elem);
+	if (!in_serving_softirq)
+		local_bh_enable();
+}
+
+static inline void __ring_queue_cache_free_softirq(
+	struct ring_queue_cache *rqc, void *elem)
+{
+	main_ring_queue_cache_free(rqc, elem);
+}
+
+/* API users can choose to use "__" prefixed versions for inlining */
+extern void *ring_queue_cache_alloc(struct ring_queue_cache *rqc,
+				    gfp_t gfp_mask);
+extern void *ring_queue_cache_alloc_softirq(struct ring_queue_cache *rqc,
+					    gfp_t gfp_mask);
+extern void ring_queue_cache_free(struct ring_queue_cache *rqc, void *elem);
+extern void ring_queue_cache_free_softirq(struct ring_queue_cache *rqc,
+					  void *elem);
+
+#endif /* _LINUX_RING_QUEUE_CACHE_H */
@@ -0,0 +1,303 @@
+/*
+ *	Extensions to the upstream 'struct skb_array'.
+ *
+ *	Not part of the kernel tree, thus kept out of linux/skb_array.h,
+ *	as the kernel's own copy of that header shadows ours.  Builds on
+ *	the ptr_ring batch operations in linux/ptr_ring_batch.h.
+ */
+#ifndef _LINUX_SKB_ARRAY_EXT_H
+#define _LINUX_SKB_ARRAY_EXT_H 1
+
+#include <linux/ptr_ring_batch.h>
+#include <linux/skb_array.h>
+#include <linux/prefetch.h>
+
+static inline int skb_array_produce_batched(struct skb_array *a,
+					    struct sk_buff **array, int n)
+{
+	return ptr_ring_produce_batched(&a->ring, (void **)array, n);
+}
+
+static inline int skb_array_produce_batched_irq(struct skb_array *a,
+						struct sk_buff **array, int n)
+{
+	return ptr_ring_produce_batched_irq(&a->ring, (void **)array, n);
+}
+
+static inline int skb_array_produce_batched_bh(struct skb_array *a,
+					       struct sk_buff **array, int n)
+{
+	return ptr_ring_produce_batched_bh(&a->ring, (void **)array, n);
+}
+
+static inline int skb_array_produce_batched_any(struct skb_array *a,
+						struct sk_buff **array, int n)
+{
+	return ptr_ring_produce_batched_any(&a->ring, (void **)array, n);
+}
+
+/* One pass variant of skb_array_consume_batched(), see
+ * __ptr_ring_consume_bulk().
+ */
+static inline int skb_array_consume_bulk(struct skb_array *a,
+					 struct sk_buff **array, int n)
+{
+	return ptr_ring_consume_bulk(&a->ring, (void **)array, n);
+}
+
+static inline int skb_array_consume_bulk_irq(struct skb_array *a,
+					     struct sk_buff **array, int n)
+{
+	return ptr_ring_consume_bulk_irq(&a->ring, (void **)array, n);
+}
+
+static inline int skb_array_consume_bulk_any(struct skb_array *a,
+					     struct sk_buff **array, int n)
+{
+	return ptr_ring_consume_bulk_any(&a->ring, (void **)array, n);
+}
+
+static inline int skb_array_consume_bulk_bh(struct skb_array *a,
+					    struct sk_buff **array, int n)
+{
+	return ptr_ring_consume_bulk_bh(&a->ring, (void **)array, n);
+}
+
+/* Prefetching bulk consume.
+ *
+ * The skbs returned by skb_array_consume_batched() are typically cold on
+ * the consuming CPU, as they were written by the producer CPU.  To hide
+ * this latency, prefetch "distance" skbs ahead of the one currently
+ * being processed.  This is done in two stages: first the struct
+ * sk_buff at "distance" ahead, and then skb->data at "distance / 2"
+ * ahead, as reading skb->data requires the struct to be in cache.
+ *
+ * Usage:
+ *	n = skb_array_consume_batched_prefetch(a, skbs, n, distance);
+ *	for (i = 0; i < n; i++) {
+ *		skb_array_prefetch_next(skbs, i, n, distance);
+ *		process(skbs[i]);
+ *	}
+ */
+static inline void __skb_array_prefetch_skb(struct sk_buff *skb)
+{
+	/* struct sk_buff spans several cache lines */
+	prefetch(skb);
+	prefetch(&skb->len);
+	prefetch(&skb->data);
+}
+
+static inline void skb_array_prefetch_next(struct sk_buff **array, int i,
+					   int n, int distance)
+{
+	int data_dist = distance / 2;
+
+	if (!distance)
+		return;
+	if (i + distance < n)
+		__skb_array_prefetch_skb(array[i + distance]);
+	if (data_dist && i + data_dist < n)
+		prefetch(array[i + data_dist]->data);
+}
+
+/* Consume up to n skbs, and prefetch the first "distance" skbs */
+static inline int skb_array_consume_batched_prefetch(struct skb_array *a,
+						     struct sk_buff **array,
+						     int n, int distance)
+{
+	int i, data_dist = distance / 2;
+
+	n = skb_array_consume_batched(a, array, n);
+
+	for (i = 0; i < min(distance, n); i++)
+		__skb_array_prefetch_skb(array[i]);
+	/* The initial window, reading skb->data here cannot be hidden */
+	for (i = 0; i < min(data_dist, n); i++)
+		prefetch(array[i]->data);
+
+	return n;
+}
+
+/* Byte accounting (BQL-style)
+ *
+ * Wraps the upstream 'struct skb_array', with running byte totals
+ * maintained by skb_array_produce_bytes*() and skb_array_consume_bytes*(),
+ * such that the bytes currently queued can be read via
+ * skb_array_bytes_queued().  The totals are only meaningful if all skbs
+ * go through this API, the plain skb_array calls on q->a (that also
+ * allow fake pointers) and the skbs dropped by resize are not accounted.
+ */
+struct skb_array_bytes {
+	struct skb_array a;
+	u64 prod_bytes ____cacheline_aligned_in_smp; /* under producer_lock */
+	u64 cons_bytes ____cacheline_aligned_in_smp; /* under consumer_lock */
+};
+
+static inline int skb_array_bytes_init(struct skb_array_bytes *q, int size,
+				       gfp_t gfp)
+{
+	q->prod_bytes = q->cons_bytes = 0;
+	return skb_array_init(&q->a, size, gfp);
+}
+
+static inline void skb_array_bytes_cleanup(struct skb_array_bytes *q)
+{
+	skb_array_cleanup(&q->a);
+}
+
+static inline int __skb_array_produce_bytes(struct skb_array_bytes *q,
+					    struct sk_buff *skb)
+{
+	int len = __skb_array_len_with_tag(skb);
+	int ret;
+
+	ret = __ptr_ring_produce(&q->a.ring, skb);
+	if (likely(!ret))
+		WRITE_ONCE(q->prod_bytes, q->prod_bytes + len);
+	return ret;
+}
+
+static inline int skb_array_produce_bytes(struct skb_array_bytes *q,
+					  struct sk_buff *skb)
+{
+	int ret;
+
+	spin_lock(&q->a.ring.producer_lock);
+	ret = __skb_array_produce_bytes(q, skb);
+	spin_unlock(&q->a.ring.producer_lock);
+
+	return ret;
+}
+
+static inline int skb_array_produce_bytes_irq(struct skb_array_bytes *q,
+					      struct sk_buff *skb)
+{
+	int ret;
+
+	spin_lock_irq(&q->a.ring.producer_lock);
+	ret = __skb_array_produce_bytes(q, skb);
+	spin_unlock_irq(&q->a.ring.producer_lock);
+
+	return ret;
+}
+
+static inline int skb_array_produce_bytes_bh(struct skb_array_bytes *q,
+					     struct sk_buff *skb)
+{
+	int ret;
+
+	spin_lock_bh(&q->a.ring.producer_lock);
+	ret = __skb_array_produce_bytes(q, skb);
+	spin_unlock_bh(&q->a.ring.producer_lock);
+
+	return ret;
+}
+
+static inline int skb_array_produce_bytes_any(struct skb_array_bytes *q,
+					      struct sk_buff *skb)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&q->a.ring.producer_lock, flags);
+	ret = __skb_array_produce_bytes(q, skb);
+	spin_unlock_irqrestore(&q->a.ring.producer_lock, flags);
+
+	return ret;
+}
+
+/* Consume up to n skbs, but stop before exceeding "budget" bytes.  The
+ * first skb is always consumed (if any), even if larger than budget,
+ * to guarantee progress.  The consumed bytes are returned in *bytes.
+ * Callers must hold consumer_lock.
+ */
+static inline int __skb_array_consume_bytes(struct skb_array_bytes *q,
+					    struct sk_buff **array, int n,
+					    unsigned int budget,
+					    unsigned int *bytes)
+{
+	unsigned int total = 0;
+	struct sk_buff *skb;
+	int i, len;
+
+	for (i = 0; i < n; i++) {
+		skb = __ptr_ring_peek(&q->a.ring);
+		if (!skb)
+			break;
+		len = __skb_array_len_with_tag(skb);
+		if (i && total + len > budget)
+			break;
+		__ptr_ring_discard_one(&q->a.ring);
+		array[i] = skb;
+		total += len;
+	}
+	WRITE_ONCE(q->cons_bytes, q->cons_bytes + total);
+	*bytes = total;
+
+	return i;
+}
+
+static inline int skb_array_consume_bytes(struct skb_array_bytes *q,
+					  struct sk_buff **array, int n,
+					  unsigned int budget,
+					  unsigned int *bytes)
+{
+	int ret;
+
+	spin_lock(&q->a.ring.consumer_lock);
+	ret = __skb_array_consume_bytes(q, array, n, budget, bytes);
+	spin_unlock(&q->a.ring.consumer_lock);
+
+	return ret;
+}
+
+static inline int skb_array_consume_bytes_irq(struct skb_array_bytes *q,
+					      struct sk_buff **array, int n,
+					      unsigned int budget,
+					      unsigned int *bytes)
+{
+	int ret;
+
+	spin_lock_irq(&q->a.ring.consumer_lock);
+	ret = __skb_array_consume_bytes(q, array, n, budget, bytes);
+	spin_unlock_irq(&q->a.ring.consumer_lock);
+
+	return ret;
+}
+
+static inline int skb_array_consume_bytes_bh(struct skb_array_bytes *q,
+					     struct sk_buff **array, int n,
+					     unsigned int budget,
+					     unsigned int *bytes)
+{
+	int ret;
+
+	spin_lock_bh(&q->a.ring.consumer_lock);
+	ret = __skb_array_consume_bytes(q, array, n, budget, bytes);
+	spin_unlock_bh(&q->a.ring.consumer_lock);
+
+	return ret;
+}
+
+static inline int skb_array_consume_bytes_any(struct skb_array_bytes *q,
+					      struct sk_buff **array, int n,
+					      unsigned int budget,
+					      unsigned int *bytes)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&q->a.ring.consumer_lock, flags);
+	ret = __skb_array_consume_bytes(q, array, n, budget, bytes);
+	spin_unlock_irqrestore(&q->a.ring.consumer_lock, flags);
+
+	return ret;
+}
+
+/* Lockless read of bytes queued, can be off by concurrent updates */
+static inline u64 skb_array_bytes_queued(struct skb_array_bytes *q)
+{
+	return READ_ONCE(q->prod_bytes) - READ_ONCE(q->cons_bytes);
+}
+
+#endif /* _LINUX_SKB_ARRAY_EXT_H */
@@ -0,0 +1,74 @@
+#ifndef _LINUX_SLAB_BULK_H
+#define _LINUX_SLAB_BULK_H
+/*
+ * linux/slab_bulk.h
+ *
+ * Helpers for the SLAB bulk API (kmem_cache_{alloc,free}_bulk)
+ *
+ * The cost of kmem_cache_free_bulk() depends heavily on page
+ * locality, see slab_bulk_test03.c.  SLUB builds a detached freelist
+ * for objects belonging to the same slab page, but only looks ahead a
+ * few objects in the array, thus randomly ordered frees mostly end up
+ * freeing one object per page.
+ *
+ * Sorting the array on the object address groups objects per slab
+ * page, as slab objects are in the kernel direct mapping, where the
+ * address order follows the page frame (PFN) order.  For the same
+ * reason it also groups objects per NUMA node, as nodes span PFN
+ * ranges.  This avoids a virt_to_head_page() lookup per compare.
+ */
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/random.h>
+#include <linux/version.h>
+
+/* The benchmarks randomize object order and sizes via
+ * get_random_u32_below(), which replaced prandom_u32_max() in v6.2.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define get_random_u32_below(ceil) prandom_u32_max(ceil)
+#endif
+
+static inline int slab_bulk_cmp_addr(const void *a, const void *b)
+{
+	unsigned long x = (unsigned long)*(void * const *)a;
+	unsigned long y = (unsigned long)*(void * const *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Sort (group) an object array by slab page and NUMA node.  Small
+ * arrays use insertion sort, which is cheaper than the heapsort of
+ * sort() and adaptive to already (partially) ordered arrays.
+ */
+#define SLAB_BULK_INSERTION_SORT 32
+
+static inline void slab_bulk_sort(size_t nr, void **p)
+{
+	size_t i, j;
+	void *obj;
+
+	if (nr > SLAB_BULK_INSERTION_SORT) {
+		sort(p, nr, sizeof(void *), slab_bulk_cmp_addr, NULL);
+		return;
+	}
+	for (i = 1; i < nr; i++) {
+		obj = p[i];
+		for (j = i; j > 0 && (unsigned long)p[j - 1] >
+			     (unsigned long)obj; j--)
+			p[j] = p[j - 1];
+		p[j] = obj;
+	}
+}
+
+/* Like kmem_cache_free_bulk(), but sort the array first.  The content
+ * of the array is reordered.
+ */
+static inline void kmem_cache_free_bulk_sorted(struct kmem_cache *s,
+					       size_t nr, void **p)
+{
+	slab_bulk_sort(nr, p);
+	kmem_cache_free_bulk(s, nr, p);
+}
+
+#endif /* _LINUX_SLAB_BULK_H */
@@ -68,16 +68,6 @@
  * thread, without requiring any lock.
  */
 
-/*
- * Load a data from shared memory.
- */
-#define CMM_LOAD_SHARED(p)		ACCESS_ONCE(p)
-
-/*
- * Identify a shared store.
- */
-#define CMM_STORE_SHARED(x, v)		({ ACCESS_ONCE(x) = (v); })
-
 enum wfcq_ret {
 	WFCQ_RET_DEST_EMPTY	= 0,
 	WFCQ_RET_DEST_NON_EMPTY = 1,
@@ -106,7 +96,7 @@ struct wfcq_tail {
  */
 static inline void wfcq_node_init(struct wfcq_node *node)
 {
-	node->next = NULL;
+	WRITE_ONCE(node->next, NULL);
 }
 
 /*
@@ -142,8 +132,8 @@ static inline bool wfcq_empty(struct wfcq_head *head,
 	 * common case to ensure that dequeuers do not frequently access
 	 * enqueuer's tail->p cache line.
 	 */
-	return CMM_LOAD_SHARED(head->node.next) == NULL
-		&& CMM_LOAD_SHARED(tail->p) == &head->node;
+	return READ_ONCE(head->node.next) == NULL
+		&& READ_ONCE(tail->p) == &head->node;
 }
 
 static inline bool __wfcq_append(struct wfcq_head *head,
@@ -176,7 +166,7 @@ static inline bool __wfcq_append(struct wfcq_head *head,
 	 * store will append "node" to the queue from a dequeuer
 	 * perspective.
 	 */
-	CMM_STORE_SHARED(old_tail->next, new_head);
+	WRITE_ONCE(old_tail->next, new_head);
 
 	preempt_enable();
 
@@ -222,7 +212,7 @@ ___wfcq_node_sync_next(struct wfcq_node *node)
 	/*
 	 * Busy-looping waiting for enqueuer to complete enqueue.
 	 */
-	while ((next = CMM_LOAD_SHARED(node->next)) == NULL)
+	while ((next = READ_ONCE(node->next)) == NULL)
 		___wfcq_busy_wait();
 
 	return next;
@@ -250,9 +240,10 @@ __wfcq_first(struct wfcq_head *head, struct wfcq_tail *tail)
 
 	if (wfcq_empty(head, tail))
 		return NULL;
+	/* The READ_ONCE of head->node.next orders loading node's
+	 * content (address dependency).
+	 */
 	node = ___wfcq_node_sync_next(&head->node);
-	/* Load head->node.next before loading node's content */
-	smp_read_barrier_depends();
 	return node;
 }
 
@@ -284,15 +275,14 @@ __wfcq_next(struct wfcq_head *head,
 	 * node->next as a common case to ensure that iteration on nodes
 	 * do not frequently access enqueuer's tail->p cache line.
 	 */
-	if ((next = CMM_LOAD_SHARED(node->next)) == NULL) {
+	if ((next = READ_ONCE(node->next)) == NULL) {
 		/* Load node->next before tail->p */
 		smp_rmb();
-		if (CMM_LOAD_SHARED(tail->p) == node)
+		if (READ_ONCE(tail->p) == node)
 			return NULL;
 		next = ___wfcq_node_sync_next(node);
 	}
-	/* Load node->next before loading next's content */
-	smp_read_barrier_depends();
+	/* READ_ONCE of node->next orders loading next's content */
 	return next;
 }
 
@@ -315,7 +305,7 @@ __wfcq_dequeue(struct wfcq_head *head, struct wfcq_tail *tail)
 
 	node = ___wfcq_node_sync_next(&head->node);
 
-	if ((next = CMM_LOAD_SHARED(node->next)) == NULL) {
+	if ((next = READ_ONCE(node->next)) == NULL) {
 		/*
 		 * @node is probably the only node in the queue.
 		 * Try to move the tail to &q->head.
@@ -337,12 +327,12 @@ __wfcq_dequeue(struct wfcq_head *head, struct wfcq_tail *tail)
 	}
 
 	/*
-	 * Move queue head forward.
+	 * Move queue head forward.  Paired with READ_ONCE in
+	 * wfcq_empty(), which is allowed without mutual exclusion.
 	 */
-	head->node.next = next;
+	WRITE_ONCE(head->node.next, next);
 
-	/* Load q->head.next before loading node's content */
-	smp_read_barrier_depends();
+	/* READ_ONCE of q->head.next ordered loading node's content */
 	return node;
 }
 
@@ -380,7 +370,7 @@ static inline enum wfcq_ret __wfcq_splice(
 		head = xchg(&src_q_head->node.next, NULL);
 		if (head)
 			break;	/* non-empty */
-		if (CMM_LOAD_SHARED(src_q_tail->p) == &src_q_head->node)
+		if (READ_ONCE(src_q_tail->p) == &src_q_head->node)
 			return WFCQ_RET_SRC_EMPTY;
 		___wfcq_busy_wait();
 	}
@@ -0,0 +1,73 @@
+#ifndef _LINUX_WFCQ_RETURN_H
+#define _LINUX_WFCQ_RETURN_H
+/*
+ * linux/wfcq_return.h
+ *
+ * MPSC object "return channel" based on wfc_queue
+ *
+ * Objects handed out by an owner (e.g. the CPU running RX NAPI) are
+ * freed on remote CPUs, and need to be returned to the owner for
+ * recycling.  Remote CPUs return objects with the wait-free
+ * wfcq_enqueue(), which cannot be blocked by other producers (unlike
+ * alf_queue's tail-wait, or ptr_ring's producer_lock).  The owner
+ * drains everything returned in one go, by splicing the entire queue
+ * in O(1) and then recycling the objects in a batch.
+ *
+ * Objects must embed a struct wfcq_node.  Only the owner may drain.
+ */
+#include <linux/wfc_queue.h>
+#include <linux/cache.h>
+
+struct wfcq_return {
+	struct wfcq_head head ____cacheline_aligned_in_smp; /* owner */
+	struct wfcq_tail tail ____cacheline_aligned_in_smp; /* remote CPUs */
+};
+
+static inline void wfcq_return_init(struct wfcq_return *rc)
+{
+	wfcq_init(&rc->head, &rc->tail);
+}
+
+static inline bool wfcq_return_empty(struct wfcq_return *rc)
+{
+	return wfcq_empty(&rc->head, &rc->tail);
+}
+
+/* Return an object to the owner, wait-free and callable from any CPU.
+ *
+ * Returns true if the channel was empty prior to this return, which
+ * can be used for deciding to kick the owner.
+ */
+static inline bool wfcq_return_put(struct wfcq_return *rc,
+				   struct wfcq_node *node)
+{
+	wfcq_node_init(node);
+	return !wfcq_enqueue(&rc->head, &rc->tail, node);
+}
+
+/* Owner only: splice all returned objects, and invoke recycle on each.
+ * The recycle callback is allowed to reuse the node immediately.
+ *
+ * Returns the number of objects recycled.
+ */
+static __always_inline int wfcq_return_drain(struct wfcq_return *rc,
+	void (*recycle)(struct wfcq_node *node, void *arg), void *arg)
+{
+	struct wfcq_head local_head;
+	struct wfcq_tail local_tail;
+	struct wfcq_node *node, *n;
+	int cnt = 0;
+
+	wfcq_init(&local_head, &local_tail);
+	if (__wfcq_splice(&local_head, &local_tail, &rc->head, &rc->tail)
+	    == WFCQ_RET_SRC_EMPTY)
+		return 0;
+
+	__wfcq_for_each_safe(&local_head, &local_tail, node, n) {
+		recycle(node, arg);
+		cnt++;
+	}
+	return cnt;
+}
+
+#endif /* _LINUX_WFCQ_RETURN_H */
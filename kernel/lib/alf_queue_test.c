@@ -211,6 +211,54 @@ fail:
 #undef SIZE
 }
 
+/* Testing: variable enqueue, partially enqueue a bulk that does not
+ * fit entirely in the queue.
+ */
+static bool test_enqueue_variable(void)
+{
+#define BULK 12
+#define SIZE 16
+	struct alf_queue *q;
+	void *objs[BULK];
+	void *deq_objs[SIZE];
+	int i, n;
+
+	q = alf_queue_alloc(SIZE, GFP_KERNEL);
+	if (IS_ERR_OR_NULL(q))
+		return false;
+	for (i = 0; i < BULK; i++)
+		objs[i] = (void *)(unsigned long)(i + 1);
+
+	/* First bulk fit, second bulk only partially */
+	if (alf_mp_enqueue_variable(q, objs, BULK) != BULK)
+		goto fail;
+	if (alf_mp_enqueue_variable(q, objs, BULK) != (SIZE - BULK))
+		goto fail;
+	/* Full queue */
+	if (alf_mp_enqueue_variable(q, objs, BULK) != 0)
+		goto fail;
+	if (alf_queue_count(q) != SIZE)
+		goto fail;
+
+	/* Partial enqueue must be taken from the start of the array */
+	n = alf_mc_dequeue(q, deq_objs, SIZE);
+	if (n != SIZE)
+		goto fail;
+	for (i = 0; i < SIZE; i++) {
+		if (deq_objs[i] != objs[i % BULK])
+			goto fail;
+	}
+	if (!alf_queue_empty(q))
+		goto fail;
+	alf_queue_free(q);
+	return true;
+fail:
+	alf_queue_free(q);
+	return false;
+#undef BULK
+#undef SIZE
+}
+
 #define TEST_FUNC(func) 					\
 do {								\
 	if (!(func)) {						\
@@ -231,6 +279,7 @@ int run_basic_tests(void)
 	TEST_FUNC(test_add_and_remove_elem());
 	TEST_FUNC(test_add_and_remove_elems_BULK());
 	TEST_FUNC(test_add_until_full());
+	TEST_FUNC(test_enqueue_variable());
 	return passed_count;
 }
 
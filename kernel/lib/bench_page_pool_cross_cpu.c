@@ -20,7 +20,8 @@
 #include <linux/interrupt.h>
 #include <linux/limits.h>
 #include <linux/delay.h>
-#include <linux/ptr_ring.h>
+#include <linux/ptr_ring_batch.h>
+#include <linux/wfcq_return.h>
 
 /* notice time_bench is limited to U32_MAX nr loops */
 static unsigned long loops = 1000000;
@@ -31,11 +32,28 @@ static unsigned int returning_cpus = 2;
 module_param(returning_cpus, uint, 0);
 MODULE_PARM_DESC(returning_cpus, "Concurrent CPUs returning pages");
 
+static unsigned int produce_bulk = 1;
+module_param(produce_bulk, uint, 0);
+MODULE_PARM_DESC(produce_bulk, "Pages produced per queue via batched produce"
+		 " (1 = single produce)");
+
+enum return_mode_type {
+	RETURN_PAGE_POOL = 0,	/* page_pool_put_page, via page_pool ptr_ring */
+	RETURN_WFCQ,		/* wfcq_return channel to the tasklet CPU */
+};
+static unsigned int return_mode = RETURN_PAGE_POOL;
+module_param(return_mode, uint, 0);
+MODULE_PARM_DESC(return_mode, "Page return path 0=page_pool_put_page"
+		 " 1=wfcq return channel");
+
 static int verbose=1;
 //#define MY_POOL_SIZE	4096
 #define MY_POOL_SIZE	32000
 
 #define SPSC_QUEUE_SZ	1024
+#define PRODUCE_BULK_MAX 64
+/* Descriptors in-flight, beyond what the queues can hold */
+#define RETURN_DESC_SLACK 1024
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
 static inline
@@ -165,6 +183,15 @@ struct page_pool *pp_create(int pool_size, unsigned int prefill)
 	return pp;
 }
 
+/* For return_mode RETURN_WFCQ, the page is carried by a descriptor
+ * embedding the wfcq_node, as struct page have no safe field to
+ * embed it in while owned by page_pool.
+ */
+struct page_desc {
+	struct wfcq_node node;
+	struct page *page;
+};
+
 struct datarec {
 	struct page_pool *pp;
 	int nr_cpus;
@@ -173,8 +200,124 @@ struct datarec {
 	struct mutex wait_for_tasklet;
 	int tasklet_cpu;
 	struct tasklet_struct pp_tasklet;
+	/* RETURN_WFCQ: return channel, and descs only touched by tasklet */
+	struct wfcq_return ret_chan;
+	struct page_desc *descs;
+	struct page_desc **free_descs;
+	int nr_descs;
+	int nr_free_descs;
+	u64 drained;
 };
 
+/* Called by the tasklet (owner) for every returned page */
+static void pp_recycle_desc(struct wfcq_node *node, void *arg)
+{
+	struct page_desc *desc = container_of(node, struct page_desc, node);
+	struct datarec *d = arg;
+
+	page_pool_recycle_direct(d->pp, desc->page);
+	desc->page = NULL;
+	d->free_descs[d->nr_free_descs++] = desc;
+}
+
+static struct page_desc *pp_get_desc(struct datarec *d)
+{
+	/* Batch recycle everything returned, when out of descriptors */
+	if (!d->nr_free_descs)
+		d->drained += wfcq_return_drain(&d->ret_chan,
+						pp_recycle_desc, d);
+	if (!d->nr_free_descs)
+		return NULL; /* All in-flight, remote CPUs still returning */
+	return d->free_descs[--d->nr_free_descs];
+}
+
+static bool pp_produce_desc(struct datarec *d, struct ptr_ring *queue,
+			    u64 *full)
+{
+	struct page_desc *desc;
+
+	desc = pp_get_desc(d);
+	if (!desc)
+		return false;
+
+	desc->page = page_pool_alloc_pages(d->pp, GFP_ATOMIC);
+	if (!desc->page) {
+		pr_err("%s(): out-of-pages\n", __func__);
+		d->free_descs[d->nr_free_descs++] = desc;
+		return false;
+	}
+	if (__ptr_ring_produce(queue, desc) < 0) {
+		(*full)++;
+		pp_recycle_desc(&desc->node, d);
+		return false;
+	}
+	return true;
+}
+
+/* Remote CPU returning a page (or RETURN_WFCQ descriptor) */
+static inline void pp_return(struct datarec *d, void *obj)
+{
+	if (return_mode == RETURN_WFCQ)
+		wfcq_return_put(&d->ret_chan,
+				&((struct page_desc *)obj)->node);
+	else
+		_page_pool_put_page(d->pp, obj, false);
+}
+
+static bool pp_descs_alloc(struct datarec *d)
+{
+	int i;
+
+	wfcq_return_init(&d->ret_chan);
+	d->nr_descs = d->nr_cpus * SPSC_QUEUE_SZ + RETURN_DESC_SLACK;
+	d->descs = kcalloc(d->nr_descs, sizeof(*d->descs), GFP_KERNEL);
+	d->free_descs = kcalloc(d->nr_descs, sizeof(*d->free_descs),
+				GFP_KERNEL);
+	if (!d->descs || !d->free_descs)
+		return false;
+	for (i = 0; i < d->nr_descs; i++)
+		d->free_descs[i] = &d->descs[i];
+	d->nr_free_descs = d->nr_descs;
+	return true;
+}
+
+/* Outside softirq, cannot use page_pool_recycle_direct */
+static void pp_put_desc(struct wfcq_node *node, void *arg)
+{
+	struct page_desc *desc = container_of(node, struct page_desc, node);
+	struct datarec *d = arg;
+
+	_page_pool_put_page(d->pp, desc->page, false);
+}
+
+
+/* Produce a bulk of pages into each remote CPU queue, with a single
+ * __ptr_ring_produce_batched() call.  Pages that did not fit in the
+ * queue are recycled.  Returns the number of pages produced.
+ */
+static int pp_produce_bulk(struct page_pool *pp, struct ptr_ring *queue,
+			   int bulk, u64 *full)
+{
+	struct page *pages[PRODUCE_BULK_MAX];
+	int i, n;
+
+	for (i = 0; i < bulk; i++) {
+		pages[i] = page_pool_alloc_pages(pp, GFP_ATOMIC);
+		if (!pages[i]) {
+			pr_err("%s(): out-of-pages\n", __func__);
+			break;
+		}
+	}
+	bulk = i;
+
+	n = __ptr_ring_produce_batched(queue, (void **)pages, bulk);
+	if (n < bulk) {
+		(*full)++;
+		for (i = n; i < bulk; i++)
+			page_pool_recycle_direct(pp, pages[i]);
+	}
+	return n;
+}
 
 static void pp_tasklet_simulate_rx_napi(unsigned long data)
 {
@@ -200,6 +343,21 @@ static void pp_tasklet_simulate_rx_napi(unsigned long data)
 
 	while (cnt < nr_produce && --max_attempts) {
 
+		if (return_mode == RETURN_WFCQ) {
+			queue_id = queue_rr++ % d->nr_cpus;
+			queue = &(d->cpu_queues[queue_id]);
+			if (pp_produce_desc(d, queue, &full))
+				cnt++;
+			continue;
+		}
+
+		if (produce_bulk > 1) {
+			queue_id = queue_rr++ % d->nr_cpus;
+			queue = &(d->cpu_queues[queue_id]);
+			cnt += pp_produce_bulk(pp, queue, produce_bulk, &full);
+			continue;
+		}
+
 		page = page_pool_alloc_pages(pp, gfp_mask);
 		if (!page) {
 			pr_err("%s(): out-of-pages\n", __func__);
@@ -221,8 +379,9 @@ static void pp_tasklet_simulate_rx_napi(unsigned long data)
 		pr_err("%s(%d): FAIL (cnt:%llu), queue full(%llu) too many times\n",
 		       __func__, cpu, cnt, full);
 	} else {
-		pr_info("%s(cpu:%d): done (cnt:%llu) queue full(%llu)\n",
-			__func__, cpu, cnt, full);
+		pr_info("%s(cpu:%d): done (cnt:%llu) queue full(%llu)"
+			" drained(%llu)\n", __func__, cpu, cnt, full,
+			d->drained);
 	}
 
 	mutex_unlock(&d->wait_for_tasklet); /* others are waiting on unlock */
@@ -237,7 +396,7 @@ static int time_pp_put_page_recycle(
 	uint64_t loops_cnt = 0;
 	uint64_t wait_cnt = 0;
 	struct ptr_ring *queue;
-	struct page *page;
+	void *page; /* or page_desc for RETURN_WFCQ */
 	int i;
 
 	if (verbose)
@@ -266,7 +425,7 @@ static int time_pp_put_page_recycle(
 	}
 	ndelay(400); /* Small delay to get more objects in queue */
 	//udelay(2);
-	_page_pool_put_page(d->pp, page, false);
+	pp_return(d, page);
 
 	time_bench_start(rec);
 	/** Loop to measure **/
@@ -289,7 +448,7 @@ static int time_pp_put_page_recycle(
 		 * happens?!?
 		 */
 //		ndelay(10);
-		_page_pool_put_page(d->pp, page, false);
+		pp_return(d, page);
 		loops_cnt++;
 	}
 	time_bench_stop(rec, loops_cnt);
@@ -324,8 +483,14 @@ int run_parallel(const char *desc, uint32_t nr_loops, const cpumask_t *cpumask,
 
 static void empty_ptr_ring(struct page_pool *pp, struct ptr_ring *ring)
 {
+	struct page_desc *desc;
 	struct page *page;
 
+	if (return_mode == RETURN_WFCQ) {
+		while ((desc = ptr_ring_consume_bh(ring)))
+			_page_pool_put_page(pp, desc->page, false);
+		return;
+	}
 	while ((page = ptr_ring_consume_bh(ring))) {
 		_page_pool_put_page(pp, page, false);
 	}
@@ -340,6 +505,7 @@ void noinline run_bench_pp_cpus(
 	struct datarec d;
 	int i, j;
 
+	memset(&d, 0, sizeof(d));
 	tasklet_init(&d.pp_tasklet, pp_tasklet_simulate_rx_napi,
 		     (unsigned long)&d);
 
@@ -370,11 +536,15 @@ void noinline run_bench_pp_cpus(
 	d.nr_loops = nr_loops;
 	mutex_init(&d.wait_for_tasklet);
 
+	if (return_mode == RETURN_WFCQ && !pp_descs_alloc(&d))
+		goto fail;
+
 	mutex_lock(&d.wait_for_tasklet);
 	//tasklet_enable(&d.pp_tasklet);
 	/* tasklet schedule happens in time_pp_put_page_recycle() */
 
-	run_parallel("page_pool_cross_cpu",
+	run_parallel(return_mode == RETURN_WFCQ ?
+		     "page_pool_cross_cpu_wfcq_return" : "page_pool_cross_cpu",
 		     nr_loops, &cpumask, nr_cpus, &d,
 		     time_pp_put_page_recycle);
 
@@ -385,6 +555,10 @@ fail:
 		empty_ptr_ring(pp, &cpu_queues[j]);
 		ptr_ring_cleanup(&cpu_queues[j], NULL);
 	}
+	if (d.descs)
+		wfcq_return_drain(&d.ret_chan, pp_put_desc, &d);
+	kfree(d.free_descs);
+	kfree(d.descs);
 	kfree(cpu_queues);
 	page_pool_destroy(pp);
 }
@@ -403,6 +577,19 @@ static int __init bench_page_pool_cross_cpu_module_init(void)
 	if (verbose)
 		pr_info("Loaded\n");
 
+	if (return_mode > RETURN_WFCQ ||
+	    (return_mode == RETURN_WFCQ && produce_bulk > 1)) {
+		pr_err("Module param return_mode(%u) invalid, or combined"
+		       " with produce_bulk\n", return_mode);
+		return -EINVAL;
+	}
+
+	if (produce_bulk == 0 || produce_bulk > PRODUCE_BULK_MAX) {
+		pr_err("Module param produce_bulk(%u) must be 1-%d\n",
+		       produce_bulk, PRODUCE_BULK_MAX);
+		return -EINVAL;
+	}
+
 	if (loops > U32_MAX) {
 		pr_err("Module param loops(%lu) exceeded U32_MAX(%u)\n",
 		       loops, U32_MAX);
@@ -0,0 +1,379 @@
+/*
+ * Basic unit test of the repo's extensions on top of upstream ptr_ring
+ * and skb_array (linux/ptr_ring_batch.h, linux/ptr_ring_spsc.h,
+ * linux/ptr_ring_ext.h and friends).
+ *
+ * Unlike skb_array_test01, this only use the API available in the
+ * kernel's own linux/ptr_ring.h and linux/skb_array.h, thus it is
+ * built by default.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/ptr_ring_batch.h>
+#include <linux/ptr_ring_spsc.h>
+#include <linux/ptr_ring_ext.h>
+#include <linux/skb_array_ext.h>
+
+static int verbose=1;
+
+/* Fake pointer values to enqueue */
+#define FAKE_PTR(i)	((void *)(unsigned long)(42 + (i)))
+
+/* Consume everything, and check the values continue from "first" */
+static int drain_and_check(struct ptr_ring *r, int first)
+{
+	void *ptr;
+	int n = 0;
+
+	while ((ptr = ptr_ring_consume(r))) {
+		if (ptr != FAKE_PTR(first + n))
+			return -1;
+		n++;
+	}
+	return n;
+}
+
+/*** Basic functionality true/false test functions ***/
+
+static bool test_produce_batched(void)
+{
+#define Q_SIZE 8
+	void *objs[Q_SIZE];
+	struct ptr_ring r;
+	bool result = false;
+	int i;
+
+	if (ptr_ring_init(&r, Q_SIZE, GFP_KERNEL) < 0)
+		return false;
+	for (i = 0; i < Q_SIZE; i++)
+		objs[i] = FAKE_PTR(i);
+
+	if (ptr_ring_produce_batched(&r, objs, 5) != 5)
+		goto out;
+	/* Only three slots left, a partial batch is produced */
+	if (ptr_ring_produce_batched(&r, &objs[5], 5) != 3)
+		goto out;
+	if (ptr_ring_produce_batched(&r, objs, 1) != 0)
+		goto out;
+	if (drain_and_check(&r, 0) != Q_SIZE)
+		goto out;
+
+	/* Wrap around the end of the ring */
+	for (i = 0; i < 3; i++) {
+		if (ptr_ring_produce_batched(&r, objs, 5) != 5)
+			goto out;
+		if (drain_and_check(&r, 0) != 5)
+			goto out;
+	}
+	result = true;
+out:
+	ptr_ring_cleanup(&r, NULL);
+	return result;
+#undef Q_SIZE
+}
+
+/* The one pass consume must keep FIFO order across wrap-around, and
+ * invalidate consumed slots such that the producer can reuse them.
+ */
+static bool test_consume_bulk(void)
+{
+#define Q_SIZE 64
+#define BULK 24
+	void *objs[Q_SIZE];
+	struct ptr_ring r;
+	bool result = false;
+	int i, j, n;
+
+	if (ptr_ring_init(&r, Q_SIZE, GFP_KERNEL) < 0)
+		return false;
+	if (ptr_ring_consume_bulk(&r, objs, BULK) != 0)
+		goto out;
+
+	for (i = 0; i < 10; i++) {
+		for (j = 0; j < BULK; j++)
+			objs[j] = FAKE_PTR(j);
+		if (ptr_ring_produce_batched(&r, objs, BULK) != BULK)
+			goto out;
+		/* Mix single consume and bulk consume */
+		if (ptr_ring_consume(&r) != FAKE_PTR(0))
+			goto out;
+		n = ptr_ring_consume_bulk(&r, objs, Q_SIZE);
+		if (n != BULK - 1)
+			goto out;
+		for (j = 0; j < n; j++)
+			if (objs[j] != FAKE_PTR(j + 1))
+				goto out;
+	}
+
+	/* Fill up what the producer can see as free, and drain again */
+	for (j = 0; j < Q_SIZE; j++)
+		objs[j] = FAKE_PTR(j);
+	n = ptr_ring_produce_batched(&r, objs, Q_SIZE);
+	if (n < Q_SIZE - r.batch)
+		goto out;
+	if (ptr_ring_consume_bulk(&r, objs, Q_SIZE) != n)
+		goto out;
+	result = ptr_ring_empty(&r);
+out:
+	ptr_ring_cleanup(&r, NULL);
+	return result;
+#undef BULK
+#undef Q_SIZE
+}
+
+/* The lockless SPSC API must interoperate with the locked ptr_ring API
+ * on the same ring, as the SPSC type only wraps the ring.
+ */
+static bool test_spsc_produce_consume(void)
+{
+#define Q_SIZE 16
+	struct ptr_ring_spsc q;
+	void *objs[Q_SIZE];
+	bool result = false;
+	int i, n;
+
+	if (ptr_ring_spsc_init(&q, Q_SIZE, GFP_KERNEL) < 0)
+		return false;
+	if (!ptr_ring_spsc_empty(&q))
+		goto out;
+
+	for (i = 0; i < Q_SIZE / 2; i++)
+		if (ptr_ring_spsc_produce(&q, FAKE_PTR(i)) < 0)
+			goto out;
+	for (i = 0; i < Q_SIZE / 2; i++)
+		objs[i] = FAKE_PTR(Q_SIZE / 2 + i);
+	if (ptr_ring_spsc_produce_batched(&q, objs, Q_SIZE / 2) != Q_SIZE / 2)
+		goto out;
+	if (!ptr_ring_spsc_full(&q))
+		goto out;
+	if (ptr_ring_spsc_produce(&q, FAKE_PTR(0)) != -ENOSPC)
+		goto out;
+
+	if (ptr_ring_spsc_peek(&q) != FAKE_PTR(0))
+		goto out;
+	if (ptr_ring_spsc_consume(&q) != FAKE_PTR(0))
+		goto out;
+	n = ptr_ring_spsc_consume_batched(&q, objs, 4);
+	if (n != 4 || objs[0] != FAKE_PTR(1) || objs[3] != FAKE_PTR(4))
+		goto out;
+	/* Remaining via the locked API, in FIFO order */
+	if (drain_and_check(&q.ring, 5) != Q_SIZE - 5)
+		goto out;
+	result = ptr_ring_spsc_empty(&q);
+out:
+	ptr_ring_spsc_cleanup(&q, NULL);
+	return result;
+#undef Q_SIZE
+}
+
+/* A full ring stalls the producer, which must shrink the batch at the
+ * next invalidation.  A ring kept occupied a batch ahead of the
+ * consumer must grow the batch, bounded by batch_max.
+ */
+static bool test_adaptive_batch(void)
+{
+#define Q_SIZE 256
+	struct ptr_ring_ext q;
+	bool result = false;
+	int i, batch;
+	void *ptr;
+
+	if (ptr_ring_ext_init(&q, Q_SIZE, GFP_KERNEL) < 0)
+		return false;
+	ptr_ring_ext_set_batch_adaptive(&q, true);
+	batch = q.ring.batch;
+	if (q.batch_max <= batch || q.batch_max > Q_SIZE / 2)
+		goto out;
+
+	/* Occupied ring: grow until batch_max */
+	for (i = 0; i < Q_SIZE; i++)
+		if (ptr_ring_ext_produce(&q, FAKE_PTR(i)) < 0)
+			goto out;
+	for (i = 0; i < Q_SIZE / 2; i++)
+		if (ptr_ring_ext_consume(&q) != FAKE_PTR(i))
+			goto out;
+	if (q.ring.batch <= batch || q.batch_stats.grow == 0)
+		goto out;
+	if (q.ring.batch > q.batch_max)
+		goto out;
+
+	/* Producer stall: shrink at next invalidation */
+	batch = q.ring.batch;
+	while (ptr_ring_ext_produce(&q, FAKE_PTR(0)) == 0)
+		;
+	if (q.producer_full == 0)
+		goto out;
+	while ((ptr = ptr_ring_ext_consume(&q)) && !q.batch_stats.shrink)
+		;
+	if (q.batch_stats.shrink == 0 || q.batch_stats.stalls == 0)
+		goto out;
+	if (q.ring.batch >= batch)
+		goto out;
+
+	/* Disable restores the init batch size */
+	ptr_ring_ext_set_batch_adaptive(&q, false);
+	result = (q.ring.batch == q.batch_base);
+out:
+	ptr_ring_ext_cleanup(&q, NULL);
+	return result;
+#undef Q_SIZE
+}
+
+/* Prefetching must not change what is consumed, for distances below,
+ * equal to and above the number of skbs returned.
+ */
+static bool test_consume_batched_prefetch(void)
+{
+#define NR_SKBS 8
+	static const int distances[] = { 0, 1, 4, NR_SKBS, 2 * NR_SKBS };
+	struct sk_buff *skbs[NR_SKBS], *deq[NR_SKBS];
+	struct skb_array queue;
+	bool result = false;
+	int i, j, n;
+
+	if (skb_array_init(&queue, 2 * NR_SKBS, GFP_KERNEL) < 0)
+		return false;
+	for (i = 0; i < NR_SKBS; i++) {
+		skbs[i] = alloc_skb(64 + i, GFP_KERNEL);
+		if (!skbs[i])
+			goto free;
+		skb_put(skbs[i], 64 + i);
+	}
+
+	for (j = 0; j < ARRAY_SIZE(distances); j++) {
+		if (skb_array_produce_batched(&queue, skbs, NR_SKBS) != NR_SKBS)
+			goto free;
+		n = skb_array_consume_batched_prefetch(&queue, deq, NR_SKBS,
+						       distances[j]);
+		if (n != NR_SKBS)
+			goto free;
+		for (i = 0; i < n; i++) {
+			skb_array_prefetch_next(deq, i, n, distances[j]);
+			if (deq[i] != skbs[i] || deq[i]->len != 64 + i)
+				goto free;
+		}
+	}
+	result = true;
+free:
+	/* The queue does not own the skbs, thus empty it before freeing */
+	while (skb_array_consume(&queue))
+		;
+	for (i = 0; i < NR_SKBS && skbs[i]; i++)
+		kfree_skb(skbs[i]);
+	skb_array_cleanup(&queue);
+	return result;
+#undef NR_SKBS
+}
+
+/* Byte totals must follow what is produced and consumed, and the
+ * consume budget must bound the bytes handed out per call.
+ */
+static bool test_byte_accounting(void)
+{
+	static const int sizes[] = { 64, 1500, 256, 9000, 128, 576 };
+	struct sk_buff *skbs[ARRAY_SIZE(sizes)];
+	struct skb_array_bytes queue;
+	unsigned int bytes, total = 0;
+	bool result = false;
+	int i, n;
+
+	if (skb_array_bytes_init(&queue, 16, GFP_KERNEL) < 0)
+		return false;
+
+	/* Enqueue mixed-size skbs */
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		skbs[i] = alloc_skb(sizes[i], GFP_KERNEL);
+		if (!skbs[i])
+			goto out;
+		skb_put(skbs[i], sizes[i]);
+		if (skb_array_produce_bytes_bh(&queue, skbs[i]) < 0) {
+			kfree_skb(skbs[i]);
+			goto out;
+		}
+		total += sizes[i];
+	}
+	if (skb_array_bytes_queued(&queue) != total)
+		goto out;
+
+	/* Budget allows 64 + 1500, but not the following 256 */
+	n = skb_array_consume_bytes_bh(&queue, skbs, 16, 1600, &bytes);
+	if (n != 2 || bytes != 64 + 1500 || skbs[1]->len != 1500)
+		goto free;
+	total -= bytes;
+	for (i = 0; i < n; i++)
+		kfree_skb(skbs[i]);
+
+	/* First skb is always consumed, even if larger than budget */
+	n = skb_array_consume_bytes_bh(&queue, skbs, 16, 100, &bytes);
+	if (n != 1 || bytes != 256)
+		goto free;
+	total -= bytes;
+	kfree_skb(skbs[0]);
+
+	/* Limited by n, not budget */
+	n = skb_array_consume_bytes_bh(&queue, skbs, 2, UINT_MAX, &bytes);
+	if (n != 2 || bytes != 9000 + 128)
+		goto free;
+	total -= bytes;
+
+	if (skb_array_bytes_queued(&queue) != total)
+		goto free;
+	result = true;
+free:
+	for (i = 0; i < n; i++)
+		kfree_skb(skbs[i]);
+out:
+	/* The cleanup call should invoke kfree_skb() on the remaining */
+	skb_array_bytes_cleanup(&queue);
+	return result;
+}
+
+#define TEST_FUNC(func) 					\
+do {								\
+	if (!(func)) {						\
+		pr_info("FAILED - " #func "\n");		\
+		return -1;					\
+	} else {						\
+		if (verbose)					\
+			pr_info("PASSED - " #func "\n");	\
+		passed_count++;					\
+	}							\
+} while (0)
+
+int run_basic_tests(void)
+{
+	int passed_count = 0;
+
+	TEST_FUNC(test_produce_batched());
+	TEST_FUNC(test_consume_bulk());
+	TEST_FUNC(test_spsc_produce_consume());
+	TEST_FUNC(test_adaptive_batch());
+	TEST_FUNC(test_consume_batched_prefetch());
+	TEST_FUNC(test_byte_accounting());
+
+	return passed_count;
+}
+
+static int __init ptr_ring_ext_test_module_init(void)
+{
+	if (verbose)
+		pr_info("Loaded\n");
+
+	if (run_basic_tests() < 0)
+		return -ECANCELED;
+
+	return 0;
+}
+module_init(ptr_ring_ext_test_module_init);
+
+static void __exit ptr_ring_ext_test_module_exit(void)
+{
+	if (verbose)
+		pr_info("Unloaded\n");
+}
+module_exit(ptr_ring_ext_test_module_exit);
+
+MODULE_DESCRIPTION("Basic unit test of ptr_ring and skb_array extensions");
+MODULE_AUTHOR("Jesper Dangaard Brouer <netoptimizer@brouer.com>");
+MODULE_LICENSE("GPL");
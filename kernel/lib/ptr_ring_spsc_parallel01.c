@@ -0,0 +1,304 @@
+/*
+ * Benchmark module for linux/ptr_ring_spsc.h
+ *
+ * Quantify the spin_lock cost saved per element, when the locked
+ * ptr_ring API is replaced by the lockless SPSC variant.  Both the
+ * same CPU minimum overhead and the cross CPU case (like
+ * skb_array_parallel01.c) are measured, for the locked and lockless
+ * variant of the same queue.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/time_bench.h>
+#include <linux/mm.h> /* missing in ptr_ring.h on >= v4.16 */
+#include <linux/ptr_ring_spsc.h>
+
+static int verbose=1;
+
+/* Fake pointer value to enqueue */
+#define FAKE_PTR ((void *)(unsigned long)42)
+
+/* Select between the locked and lockless API, the compiler should
+ * optimize this out as the functions are __always_inline.
+ */
+static __always_inline int q_produce(struct ptr_ring_spsc *q, void *ptr,
+				     bool spsc)
+{
+	if (spsc)
+		return ptr_ring_spsc_produce(q, ptr);
+	return ptr_ring_produce(&q->ring, ptr);
+}
+
+static __always_inline void *q_consume(struct ptr_ring_spsc *q, bool spsc)
+{
+	if (spsc)
+		return ptr_ring_spsc_consume(q);
+	return ptr_ring_consume(&q->ring);
+}
+
+/* Simulating the most simple case: 1 enqueue + 1 dequeue on same CPU
+ *
+ *  Cost is enqueue+dequeue
+ */
+static __always_inline int __time_bench_one_enq_deq(
+	struct time_bench_record *rec, void *data, bool spsc)
+{
+	struct ptr_ring_spsc *q = data;
+	uint64_t loops_cnt = 0;
+	void *ptr;
+	int i;
+
+	if (q == NULL) {
+		pr_err("Need queue struct ptr as input\n");
+		return -1;
+	}
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+		if (q_produce(q, FAKE_PTR, spsc) < 0)
+			goto fail;
+		barrier(); /* compiler barrier */
+		ptr = q_consume(q, spsc);
+		if (ptr != FAKE_PTR)
+			goto fail;
+		loops_cnt++;
+	}
+	time_bench_stop(rec, loops_cnt);
+
+	return loops_cnt;
+fail:
+	return 0;
+}
+static int time_bench_locked_enq_deq(
+	struct time_bench_record *rec, void *data)
+{
+	return __time_bench_one_enq_deq(rec, data, false);
+}
+static int time_bench_spsc_enq_deq(
+	struct time_bench_record *rec, void *data)
+{
+	return __time_bench_one_enq_deq(rec, data, true);
+}
+
+/* Cross CPU benchmark, see skb_array_parallel01.c.  The enq/deq
+ * behavior is dependend on CPU id number, and only two CPUs are used
+ * as this is a Single-Producer/Single-Consumer queue.
+ */
+static __always_inline int __time_bench_CPU_enq_or_deq(
+	struct time_bench_record *rec, void *data, bool spsc)
+{
+	struct ptr_ring_spsc *q = data;
+	uint64_t loops_cnt = 0;
+	int i;
+
+	bool enq_CPU = false;
+
+	/* Split CPU between enq/deq based on even/odd */
+	if ((smp_processor_id() % 2)== 0)
+		enq_CPU = true;
+
+	/* Hack: use "step" to mark enq/deq, as "step" gets printed */
+	rec->step = enq_CPU;
+
+	if (q == NULL) {
+		pr_err("Need queue ptr as input\n");
+		return 0;
+	}
+	/* loop count is limited to 32-bit due to div_u64_rem() use */
+	if (((uint64_t)rec->loops * 2) >= ((1ULL<<32)-1)) {
+		pr_err("Loop cnt too big will overflow 32-bit\n");
+		return 0;
+	}
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+
+		if (enq_CPU) {
+			/* enqueue side */
+			if (q_produce(q, FAKE_PTR, spsc) < 0) {
+				pr_err("%s() WARN: enq fullq(CPU:%d) i:%d\n",
+				       __func__, smp_processor_id(), i);
+				goto finish_early;
+			}
+		} else {
+			/* dequeue side */
+			if (q_consume(q, spsc) == NULL) {
+				pr_err("%s() WARN: deq emptyq (CPU:%d) i:%d\n",
+				       __func__, smp_processor_id(), i);
+				goto finish_early;
+			}
+		}
+		loops_cnt++;
+		barrier(); /* compiler barrier */
+	}
+finish_early:
+	time_bench_stop(rec, loops_cnt);
+
+	return loops_cnt;
+}
+static int time_bench_locked_CPU_enq_or_deq(
+	struct time_bench_record *rec, void *data)
+{
+	return __time_bench_CPU_enq_or_deq(rec, data, false);
+}
+static int time_bench_spsc_CPU_enq_or_deq(
+	struct time_bench_record *rec, void *data)
+{
+	return __time_bench_CPU_enq_or_deq(rec, data, true);
+}
+
+int run_parallel(const char *desc, uint32_t loops, const cpumask_t *cpumask,
+		 int step, void *data,
+		 int (*func)(struct time_bench_record *record, void *data)
+	)
+{
+	struct time_bench_sync sync;
+	struct time_bench_cpu *cpu_tasks;
+	size_t size;
+
+	/* Allocate records for every CPU */
+	size = sizeof(*cpu_tasks) * num_possible_cpus();
+	cpu_tasks = kzalloc(size, GFP_KERNEL);
+
+	time_bench_run_concurrent(loops, step, data,
+				  cpumask, &sync, cpu_tasks, func);
+	time_bench_print_stats_cpumask(desc, cpu_tasks, cpumask);
+
+	kfree(cpu_tasks);
+	return 1;
+}
+
+/* Fake pointers must be removed before cleanup, as the destructor
+ * would otherwise be invoked on them.
+ */
+void helper_empty_queue(struct ptr_ring_spsc *q)
+{
+	while (ptr_ring_spsc_consume(q))
+		/* Emptying fake pointers */;
+}
+
+bool init_queue(struct ptr_ring_spsc *q, int q_size, int prefill)
+{
+	int result, i;
+
+	result = ptr_ring_spsc_init(q, q_size, GFP_KERNEL);
+	if (result < 0) {
+		pr_err("%s() err creating queue size:%d\n", __func__, q_size);
+		return false;
+	}
+	/* Prefill to keep distance between producer and consumer */
+	for (i = 0; i < prefill; i++) {
+		if (ptr_ring_spsc_produce(q, FAKE_PTR) < 0) {
+			pr_err("%s() err cannot prefill:%d sz:%d\n",
+			       __func__, prefill, q_size);
+			helper_empty_queue(q);
+			ptr_ring_spsc_cleanup(q, NULL);
+			return false;
+		}
+	}
+	return true;
+}
+
+void noinline run_bench_min_overhead(uint32_t loops, int q_size)
+{
+	struct ptr_ring_spsc *q;
+
+	q = kzalloc(sizeof(*q), GFP_KERNEL);
+	if (!q)
+		return;
+	if (!init_queue(q, q_size, 0))
+		goto fail;
+
+	time_bench_loop(loops, q_size, "ptr_ring_locked_min_overhead", q,
+			time_bench_locked_enq_deq);
+	time_bench_loop(loops, q_size, "ptr_ring_spsc_min_overhead", q,
+			time_bench_spsc_enq_deq);
+
+	helper_empty_queue(q);
+	ptr_ring_spsc_cleanup(q, NULL);
+fail:
+	kfree(q);
+}
+
+void noinline run_parallel_two_CPUs(uint32_t loops, int q_size, int prefill,
+				    bool spsc)
+{
+	struct ptr_ring_spsc *q;
+	cpumask_t cpumask;
+
+	q = kzalloc(sizeof(*q), GFP_KERNEL);
+	if (!q)
+		return;
+
+	/* Restrict the CPUs to run on */
+	cpumask_clear(&cpumask);
+	cpumask_set_cpu(0, &cpumask);
+	cpumask_set_cpu(1, &cpumask);
+
+	if (!init_queue(q, q_size, prefill))
+		goto fail;
+
+	if (spsc)
+		run_parallel("ptr_ring_spsc_parallel_two_CPUs",
+			     loops, &cpumask, 0, q,
+			     time_bench_spsc_CPU_enq_or_deq);
+	else
+		run_parallel("ptr_ring_locked_parallel_two_CPUs",
+			     loops, &cpumask, 0, q,
+			     time_bench_locked_CPU_enq_or_deq);
+
+	helper_empty_queue(q);
+	ptr_ring_spsc_cleanup(q, NULL);
+fail:
+	kfree(q);
+}
+
+int run_benchmark_tests(void)
+{
+	/* ADJUST: See skb_array_parallel01.c, if the CPUs catchup to
+	 * each-other, a WARNing is printed with completed interations.
+	 */
+	uint32_t loops = 200000;
+	int prefill = 32000;
+	int q_size = 64000;
+
+	if (verbose)
+		pr_info("For '*_min_overhead' step = queue_size"
+			", cost is enqueue+dequeue\n");
+	run_bench_min_overhead(10000000, 1000);
+
+	if (verbose)
+		pr_info("For '*_parallel_two_CPUs' step = enq(1)/deq(0)"
+			", cost is either enqueue or dequeue\n");
+	run_parallel_two_CPUs(loops, q_size, prefill, false);
+	run_parallel_two_CPUs(loops, q_size, prefill, true);
+
+	return 0;
+}
+
+static int __init ptr_ring_spsc_parallel01_module_init(void)
+{
+	if (verbose)
+		pr_info("Loaded\n");
+
+	if (run_benchmark_tests() < 0) {
+		return -ECANCELED;
+	}
+
+	return 0;
+}
+module_init(ptr_ring_spsc_parallel01_module_init);
+
+static void __exit ptr_ring_spsc_parallel01_module_exit(void)
+{
+	if (verbose)
+		pr_info("Unloaded\n");
+}
+module_exit(ptr_ring_spsc_parallel01_module_exit);
+
+MODULE_DESCRIPTION("Benchmark of lockless SPSC ptr_ring vs locked ptr_ring");
+MODULE_AUTHOR("Jesper Dangaard Brouer <netoptimizer@brouer.com>");
+MODULE_LICENSE("GPL");
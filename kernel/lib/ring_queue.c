@@ -91,6 +91,7 @@
 #include <linux/list.h>
 #include <linux/mm.h>
 #include <linux/cache.h> /* SMP_CACHE_BYTES */
+#include <linux/bitops.h> /* hweight32 */
 
 #include <linux/ring_queue.h>
 
@@ -120,6 +121,11 @@
  *    - RING_F_SC_DEQ: If this flag is set, the default behavior when
  *      using ``ring_queue_dequeue()`` or ``ring_queue_dequeue_bulk()``
  *      is "single-consumer". Otherwise, it is "multi-consumers".
+ *    - RING_F_MP_RTS_ENQ: If this flag is set, the default enqueue
+ *      behavior is "multi-producer" with relaxed tail sync (RTS).
+ *    - RING_F_MP_HTS_ENQ: If this flag is set, the default enqueue
+ *      behavior is "multi-producer" with head/tail sync (HTS).
+ *    Only one of the producer flags can be set.
  * @return
  *   On success, the pointer to the new allocated ring.
  *   NULL on error
@@ -142,6 +148,23 @@ ring_queue_create(unsigned int count, unsigned int flags)
 #endif
 	BUILD_BUG_ON((offsetof(struct ring_queue, prod) &
 		      CACHE_LINE_MASK) != 0);
+	/* Consumer reads prod.tail, regardless of producer sync mode */
+	BUILD_BUG_ON(offsetof(struct ring_queue, prod.tail) !=
+		     offsetof(struct ring_queue, prod.rts_tail.val.pos));
+	BUILD_BUG_ON(offsetof(struct ring_queue, prod.tail) !=
+		     offsetof(struct ring_queue, prod.hts.pos.tail));
+	BUILD_BUG_ON(offsetof(struct ring_queue, prod.head) !=
+		     offsetof(struct ring_queue, prod.hts.pos.head));
+	BUILD_BUG_ON((offsetof(struct ring_queue, prod.hts) &
+		      (sizeof(u64) - 1)) != 0);
+	BUILD_BUG_ON((offsetof(struct ring_queue, prod.rts_head) &
+		      (sizeof(u64) - 1)) != 0);
+
+	if (hweight32(flags & (RING_F_SP_ENQ | RING_F_MP_RTS_ENQ |
+			       RING_F_MP_HTS_ENQ)) > 1) {
+		pr_err("Conflicting producer flags:0x%x\n", flags);
+		return NULL;
+	}
 
 	/* count must be a power of 2 */
 	if ((!POWEROF2(count)) || (count > RING_QUEUE_SZ_MASK)) {
@@ -165,11 +188,21 @@ ring_queue_create(unsigned int count, unsigned int flags)
 	r->flags = flags;
 	r->prod.watermark = count;
 	r->prod.sp_enqueue = !!(flags & RING_F_SP_ENQ);
+	if (flags & RING_F_SP_ENQ)
+		r->prod.sync_type = RING_QUEUE_SYNC_ST;
+	else if (flags & RING_F_MP_RTS_ENQ)
+		r->prod.sync_type = RING_QUEUE_SYNC_MT_RTS;
+	else if (flags & RING_F_MP_HTS_ENQ)
+		r->prod.sync_type = RING_QUEUE_SYNC_MT_HTS;
+	else
+		r->prod.sync_type = RING_QUEUE_SYNC_MT;
+	r->prod.htd_max = count / 8;
 	r->cons.sc_dequeue = !!(flags & RING_F_SC_DEQ);
 	r->prod.size = r->cons.size = count;
 	r->prod.mask = r->cons.mask = count-1;
 	r->prod.head = r->cons.head = 0;
 	r->prod.tail = r->cons.tail = 0;
+	r->prod.rts_head.raw = 0;
 
 	return r;
 }
@@ -207,6 +240,23 @@ ring_queue_set_water_mark(struct ring_queue *r, unsigned count)
 	return 0;
 }
 
+/* Change the max head-tail distance, for RTS producer mode.  The
+ * *count* value must be greater than 0 and less than the ring size.
+ */
+int
+ring_queue_set_prod_htd_max(struct ring_queue *r, unsigned count)
+{
+	if (r->prod.sync_type != RING_QUEUE_SYNC_MT_RTS)
+		return -ENOTSUPP;
+
+	if (count == 0 || count >= r->prod.size)
+		return -EINVAL;
+
+	r->prod.htd_max = count;
+	return 0;
+}
+EXPORT_SYMBOL(ring_queue_set_prod_htd_max);
+
  //TODO: remove
 static int __init ring_queue_init(void)
 {
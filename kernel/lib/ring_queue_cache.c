@@ -0,0 +1,209 @@
+/*
+ * ring_queue_cache - per CPU object cache in-front of a ring_queue
+ *
+ * For licensing details see kernel-base/COPYING
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/export.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/ring_queue_cache.h>
+
+void ring_queue_cache_destroy(struct ring_queue_cache *rqc)
+{
+	void *elem = NULL;
+	int j;
+
+	if (rqc->percpu) {
+		for_each_possible_cpu(j) {
+			struct ring_queue_cache_percpu *cache =
+				per_cpu_ptr(rqc->percpu, j);
+
+			while (cache->len)
+				kmem_cache_free(rqc->kmem,
+						cache->objs[--cache->len]);
+		}
+		free_percpu(rqc->percpu);
+	}
+
+	if (rqc->ring) {
+		while (ring_queue_mc_dequeue(rqc->ring, &elem) == 0)
+			kmem_cache_free(rqc->kmem, elem);
+		BUG_ON(!ring_queue_empty(rqc->ring));
+		ring_queue_free(rqc->ring);
+	}
+
+	kfree(rqc);
+}
+EXPORT_SYMBOL(ring_queue_cache_destroy);
+
+/* Create a per CPU cache of "cache_size" objects, in-front of a
+ * shared ring of "ring_size" (power-of-2), prefilled with "prealloc"
+ * objects from "kmem".  The "flush_threshold" must be at-least
+ * cache_size (0 selects DPDK's default of 1.5 times cache_size).
+ */
+struct ring_queue_cache *
+ring_queue_cache_create(unsigned int cache_size, unsigned int flush_threshold,
+			unsigned int ring_size, unsigned int prealloc,
+			struct kmem_cache *kmem, gfp_t gfp_mask)
+{
+	struct ring_queue_cache *rqc;
+	size_t percpu_sz;
+	void *elem;
+	int i;
+
+	if (!flush_threshold)
+		flush_threshold = cache_size + cache_size / 2;
+
+	/* Validate constraints */
+	if (cache_size == 0 || flush_threshold < cache_size ||
+	    flush_threshold > RING_QUEUE_CACHE_MAX_SIZE) {
+		pr_err("%s() invalid cache size(%u) flush threshold(%u)\n",
+		       __func__, cache_size, flush_threshold);
+		return NULL;
+	}
+	if (!is_power_of_2(ring_size) || ring_size <= cache_size) {
+		pr_err("%s() ring size(%u) must be power-of-2 and > %u\n",
+		       __func__, ring_size, cache_size);
+		return NULL;
+	}
+	if (prealloc >= ring_size) {
+		pr_err("%s() prealloc(%u) req >= ring size(%u)\n",
+		       __func__, prealloc, ring_size);
+		return NULL;
+	}
+	if (!kmem) {
+		pr_err("%s() kmem_cache is a NULL ptr\n",  __func__);
+		return NULL;
+	}
+
+	rqc = kzalloc(sizeof(*rqc), gfp_mask);
+	if (!rqc)
+		return NULL;
+	rqc->kmem            = kmem;
+	rqc->gfp_mask        = gfp_mask;
+	rqc->size            = cache_size;
+	rqc->flush_threshold = flush_threshold;
+
+	/* MPMC (Multi-Producer-Multi-Consumer) ring */
+	rqc->ring = ring_queue_create(ring_size, 0);
+	if (!rqc->ring) {
+		pr_err("%s() failed to create shared ring(%u)\n",
+		       __func__, ring_size);
+		ring_queue_cache_destroy(rqc);
+		return NULL;
+	}
+
+	for (i = 0; i < prealloc; i++) {
+		elem = kmem_cache_alloc(rqc->kmem, gfp_mask);
+		if (!elem) {
+			pr_err("%s() kmem_cache out of memory?!\n",  __func__);
+			ring_queue_cache_destroy(rqc);
+			return NULL;
+		}
+		/* Could use the SP version given it is not visible yet */
+		BUG_ON(ring_queue_mp_enqueue(rqc->ring, elem) < 0);
+	}
+
+	/* Room for one free above flush_threshold before flushing */
+	percpu_sz = sizeof(struct ring_queue_cache_percpu) +
+		(flush_threshold + 1) * sizeof(void *);
+	rqc->percpu = __alloc_percpu(percpu_sz,
+				     __alignof__(struct ring_queue_cache_percpu));
+	if (!rqc->percpu) {
+		pr_err("%s() failed to alloc percpu\n", __func__);
+		ring_queue_cache_destroy(rqc);
+		return NULL;
+	}
+
+	return rqc;
+}
+EXPORT_SYMBOL(ring_queue_cache_create);
+
+/* This function is called when the local cache is empty.  Refill the
+ * local cache with a bulk from the shared ring, or if shared ring is
+ * empty, fallback to allocating a single element from SLAB.
+ *
+ * Caller must assure this is called in an preemptive safe context,
+ * due to ring_queue_mc_dequeue_burst() call.
+ */
+void *__ring_queue_cache_refill(struct ring_queue_cache *rqc,
+				struct ring_queue_cache_percpu *cache,
+				gfp_t gfp_mask)
+{
+	int num;
+
+	/* Costs atomic "cmpxchg", but amortize cost by bulk dequeue */
+	num = ring_queue_mc_dequeue_burst(rqc->ring, cache->objs, rqc->size);
+	if (likely(num > 0)) {
+		cache->len = num - 1;
+		return cache->objs[num - 1];
+	}
+
+	/* Cannot use SLAB that can sleep, see __qmempool_alloc_from_slab */
+#ifdef __GFP_WAIT
+	BUG_ON(gfp_mask & __GFP_WAIT);
+#else
+	BUG_ON(gfp_mask & __GFP_DIRECT_RECLAIM);
+#endif
+	return kmem_cache_alloc(rqc->kmem, gfp_mask);
+}
+EXPORT_SYMBOL(__ring_queue_cache_refill);
+
+/* This function is called when the local cache exceed flush_threshold.
+ * The objects above "size" are returned to the shared ring, and if
+ * the shared ring is full, the remaining is free'ed to SLAB.
+ *
+ * MUST be called from a preemptive safe context.
+ */
+void __ring_queue_cache_flush(struct ring_queue_cache *rqc,
+			      struct ring_queue_cache_percpu *cache)
+{
+	unsigned int n = cache->len - rqc->size;
+	void **objs = &cache->objs[rqc->size];
+	int num, i;
+
+	num = ring_queue_mp_enqueue_burst(rqc->ring, objs, n);
+	num &= RING_QUEUE_SZ_MASK; /* Don't care about watermark quota */
+
+	/* Shared ring full, free remaining objects for real */
+	for (i = num; i < n; i++)
+		kmem_cache_free(rqc->kmem, objs[i]);
+
+	cache->len = rqc->size;
+}
+EXPORT_SYMBOL(__ring_queue_cache_flush);
+
+/* API users can choose to use "__" prefixed versions for inlining */
+void *ring_queue_cache_alloc(struct ring_queue_cache *rqc, gfp_t gfp_mask)
+{
+	return __ring_queue_cache_alloc(rqc, gfp_mask);
+}
+EXPORT_SYMBOL(ring_queue_cache_alloc);
+
+void *ring_queue_cache_alloc_softirq(struct ring_queue_cache *rqc,
+				     gfp_t gfp_mask)
+{
+	return __ring_queue_cache_alloc_softirq(rqc, gfp_mask);
+}
+EXPORT_SYMBOL(ring_queue_cache_alloc_softirq);
+
+void ring_queue_cache_free(struct ring_queue_cache *rqc, void *elem)
+{
+	__ring_queue_cache_free(rqc, elem);
+}
+EXPORT_SYMBOL(ring_queue_cache_free);
+
+void ring_queue_cache_free_softirq(struct ring_queue_cache *rqc, void *elem)
+{
+	__ring_queue_cache_free_softirq(rqc, elem);
+}
+EXPORT_SYMBOL(ring_queue_cache_free_softirq);
+
+MODULE_DESCRIPTION("Per CPU object cache in-front of ring_queue");
+MODULE_AUTHOR("Jesper Dangaard Brouer");
+MODULE_LICENSE("GPL");
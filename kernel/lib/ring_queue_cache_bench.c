@@ -0,0 +1,241 @@
+/*
+ * Benchmark ring_queue_cache against qmempool on same alloc patterns
+ *
+ * Both are per CPU caches in-front of a shared MPMC queue, backed by
+ * a kmem_cache.  The ring_queue_cache use a LIFO array per CPU and a
+ * ring_queue as shared queue, while qmempool use alf_queue for both.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/time_bench.h>
+#include <linux/skbuff.h>
+
+#include <linux/ring_queue_cache.h>
+#include <linux/qmempool.h>
+
+static int verbose=1;
+
+static uint32_t cache_size = 32;
+module_param(cache_size, uint, 0);
+MODULE_PARM_DESC(cache_size, "Per CPU cache size (qmempool localq size)");
+
+static uint32_t flush_threshold = 0;
+module_param(flush_threshold, uint, 0);
+MODULE_PARM_DESC(flush_threshold, "ring_queue_cache flush threshold"
+		 " (default 0 = 1.5 x cache_size)");
+
+static uint32_t shared_size = 256;
+module_param(shared_size, uint, 0);
+MODULE_PARM_DESC(shared_size, "Shared queue size (power-of-2)");
+
+struct my_elem {
+	/* element used for benchmark testing, same as qmempool_bench */
+	struct sk_buff skb;
+};
+
+enum pool_type {
+	QMEMPOOL = 1,
+	RING_QUEUE_CACHE,
+};
+
+/* Abstract the two pool types, the compiler should optimize this out */
+struct bench_pool {
+	struct kmem_cache *slab;
+	struct qmempool *qmp;
+	struct ring_queue_cache *rqc;
+};
+
+static __always_inline bool bench_pool_create(struct bench_pool *p,
+					       enum pool_type type)
+{
+	memset(p, 0, sizeof(*p));
+	p->slab = kmem_cache_create("ring_queue_cache_bench",
+				    sizeof(struct my_elem),
+				    0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!p->slab)
+		return false;
+
+	if (type == QMEMPOOL)
+		p->qmp = qmempool_create(cache_size, shared_size, 0,
+					 p->slab, GFP_ATOMIC);
+	else
+		p->rqc = ring_queue_cache_create(cache_size, flush_threshold,
+						 shared_size, 0,
+						 p->slab, GFP_ATOMIC);
+	if (!p->qmp && !p->rqc) {
+		kmem_cache_destroy(p->slab);
+		return false;
+	}
+	return true;
+}
+
+static __always_inline void bench_pool_destroy(struct bench_pool *p)
+{
+	if (p->qmp)
+		qmempool_destroy(p->qmp);
+	if (p->rqc)
+		ring_queue_cache_destroy(p->rqc);
+	kmem_cache_destroy(p->slab);
+}
+
+static __always_inline void *bench_pool_alloc(struct bench_pool *p,
+					      enum pool_type type)
+{
+	if (type == QMEMPOOL)
+		return __qmempool_alloc(p->qmp, GFP_ATOMIC);
+	else
+		return __ring_queue_cache_alloc(p->rqc, GFP_ATOMIC);
+}
+
+static __always_inline void bench_pool_free(struct bench_pool *p,
+					    enum pool_type type, void *elem)
+{
+	if (type == QMEMPOOL)
+		__qmempool_free(p->qmp, elem);
+	else
+		__ring_queue_cache_free(p->rqc, elem);
+}
+
+static __always_inline int __benchmark_fastpath_reuse(
+	struct time_bench_record *rec, void *data, enum pool_type type)
+{
+	uint64_t loops_cnt = 0;
+	struct bench_pool pool;
+	struct my_elem *elem;
+	int i;
+
+	if (!bench_pool_create(&pool, type))
+		return 0;
+
+	/* "warm-up" */
+	elem = bench_pool_alloc(&pool, type);
+	if (elem)
+		bench_pool_free(&pool, type, elem);
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+		elem = bench_pool_alloc(&pool, type);
+		if (elem == NULL)
+			goto out;
+
+		barrier(); /* compiler barrier */
+
+		bench_pool_free(&pool, type, elem);
+		loops_cnt++;
+	}
+out:
+	time_bench_stop(rec, loops_cnt);
+	bench_pool_destroy(&pool);
+	return loops_cnt;
+}
+static int benchmark_qmempool_fastpath_reuse(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_fastpath_reuse(rec, data, QMEMPOOL);
+}
+static int benchmark_rqc_fastpath_reuse(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_fastpath_reuse(rec, data, RING_QUEUE_CACHE);
+}
+
+/* Same N-pattern as qmempool_bench, but N is given via rec->step.
+ * A large N causes traffic to the shared queue and SLAB.
+ */
+#define ARRAY_MAX_ELEMS 1024
+static struct my_elem *elems[ARRAY_MAX_ELEMS];
+
+static __always_inline int __benchmark_pattern(
+	struct time_bench_record *rec, void *data, enum pool_type type)
+{
+	uint64_t loops_cnt = 0;
+	struct bench_pool pool;
+	int elems_n = min_t(int, rec->step, ARRAY_MAX_ELEMS);
+	int i, n;
+
+	if (!bench_pool_create(&pool, type))
+		return 0;
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+
+		/* alloc N new elems */
+		for (n = 0; n < elems_n; n++) {
+			elems[n] = bench_pool_alloc(&pool, type);
+			barrier(); /* compiler barrier */
+		}
+
+		barrier(); /* compiler barrier */
+
+		/* free N elems */
+		for (n = 0; n < elems_n; n++) {
+			bench_pool_free(&pool, type, elems[n]);
+			barrier(); /* compiler barrier */
+			loops_cnt++;
+		}
+	}
+	time_bench_stop(rec, loops_cnt);
+
+	bench_pool_destroy(&pool);
+	return loops_cnt;
+}
+static int benchmark_qmempool_pattern(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_pattern(rec, data, QMEMPOOL);
+}
+static int benchmark_rqc_pattern(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_pattern(rec, data, RING_QUEUE_CACHE);
+}
+
+bool run_micro_benchmark_tests(void)
+{
+	uint32_t loops = 1000000;
+	int n;
+
+	pr_info("Measured cost of doing alloc+free"
+		" (cache_size:%u flush_threshold:%u shared_size:%u)\n",
+		cache_size, flush_threshold, shared_size);
+
+	time_bench_loop(loops*30, 0, "qmempool fastpath reuse", NULL,
+			benchmark_qmempool_fastpath_reuse);
+	time_bench_loop(loops*30, 0, "ring_queue_cache fastpath reuse", NULL,
+			benchmark_rqc_fastpath_reuse);
+
+	for (n = 16; n <= ARRAY_MAX_ELEMS; n *= 4) {
+		pr_info("N-pattern with %d elements\n", n);
+		time_bench_loop(loops*4/n, n, "qmempool N-pattern",
+				NULL, benchmark_qmempool_pattern);
+		time_bench_loop(loops*4/n, n, "ring_queue_cache N-pattern",
+				NULL, benchmark_rqc_pattern);
+	}
+	return true;
+}
+
+static int __init ring_queue_cache_bench_module_init(void)
+{
+	if (verbose)
+		pr_info("Loaded\n");
+
+	run_micro_benchmark_tests();
+
+	return 0;
+}
+module_init(ring_queue_cache_bench_module_init);
+
+static void __exit ring_queue_cache_bench_module_exit(void)
+{
+	if (verbose)
+		pr_info("Unloaded\n");
+}
+module_exit(ring_queue_cache_bench_module_exit);
+
+MODULE_DESCRIPTION("Benchmark ring_queue_cache against qmempool");
+MODULE_AUTHOR("Jesper Dangaard Brouer <netoptimizer@brouer.com>");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,388 @@
+/*
+ * Concurrency testing of ring_queue multi-producer sync modes
+ *
+ * This test tries to provoke concurrency errors with the ring_queue
+ * multi-producer enqueue, in the default mode, the relaxed tail sync
+ * (RTS) mode and the head/tail sync (HTS) mode.
+ *
+ * Multiple concurrent producers(enqueue) race against each-other
+ * while a single consumer(dequeue) is running concurrently.  The
+ * number of producers can exceed the number of CPUs, to simulate
+ * producers getting preempted (like on overcommitted vCPUs), which
+ * is the case RTS and HTS are designed for.
+ *
+ * Validation test: Producers will enqueue their id and a constantly
+ * increasing serial number into the queue.  The single consumer will
+ * dequeue and keep track of all producers serial number, and validate
+ * that this number is strictly increasing by one.  This validates no
+ * elements gets lost, due to incorrect concurrency handling.
+ *
+ * For licensing details see kernel-base/COPYING
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/ring_queue.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/time_bench.h>
+
+static int verbose=1;
+
+static int prod_mode = 0;
+module_param(prod_mode, int, 0);
+MODULE_PARM_DESC(prod_mode, "Producer sync mode 0=MP 1=MP_RTS 2=MP_HTS");
+
+/* Default 2x online CPUs, thus producers get preempted while holding
+ * a position in the ring (the case RTS and HTS are designed for).
+ */
+#define MAX_PRODUCERS	256
+static int nr_producers = 0;
+module_param(nr_producers, int, 0);
+MODULE_PARM_DESC(nr_producers, "Number of producer threads (default 2x online CPUs)");
+
+static struct completion dequeue_start;
+
+/* Struct hack to send data in the void ptr */
+struct my_data {
+	union {
+		struct {
+			u32 id;
+			u32 cnt;
+		};
+		struct {
+			void *raw;
+		};
+	};
+};
+
+struct my_producer {
+	struct task_struct *kthread;
+	struct my_data data;
+} ____cacheline_aligned_in_smp;
+
+static struct my_producer producers[MAX_PRODUCERS];
+
+struct my_consumer {
+	struct task_struct *kthread;
+	u32 id;
+	u32 prod_cnt[MAX_PRODUCERS];
+} ____cacheline_aligned_in_smp;
+static struct my_consumer consumer;
+
+/* Multi-Producer-Single-Consumer Queue */
+static struct ring_queue *mpsc;
+
+#define SLEEP_TIME_ENQ	0
+#define SLEEP_TIME_DEQ	1
+#define QUEUE_SIZE	2048
+#define PRODUCER_BULK	8
+#define CONSUMER_BULK	8
+
+/* See alf_queue_concurrency_test.c for the reasoning behind
+ * PRODUCER_ELEMS_ENQ being smaller than QUEUE_SIZE.
+ */
+#define PRODUCER_ELEMS_ENQ 1000
+
+#define CONSUMER_HIGH_DEQ_CNT min(QUEUE_SIZE * 2, \
+				  nr_producers * PRODUCER_ELEMS_ENQ)
+
+#ifndef U32_MAX
+#define U32_MAX                ((u32)~0U)
+#endif
+
+static const char *prod_mode_str[] = { "MP", "MP_RTS", "MP_HTS" };
+
+static noinline unsigned int
+ring_run_producer(struct ring_queue *q, struct my_producer *me)
+{
+	int i, j, n, total = 0;
+	void *objs[PRODUCER_BULK];
+	int elements = PRODUCER_ELEMS_ENQ;
+	int32_t loops = elements / PRODUCER_BULK;
+
+	for (j = 0; j < loops; j++) {
+
+		/* Transfer the data part of producer via the void ptr, and
+		 * send an increasing number for the consumer to validate
+		 */
+		for (i = 0; i < PRODUCER_BULK; i++, me->data.cnt++) {
+			objs[i] = me->data.raw;
+		}
+
+	retry:
+		/* Create time flags select the sync mode */
+		n = ring_queue_enqueue_bulk(q, objs, PRODUCER_BULK);
+		if (n == -ENOBUFS) {
+			if (kthread_should_stop()) {
+				/* scroll back counter */
+				me->data.cnt -= PRODUCER_BULK;
+				break;
+			}
+			/* Ring full, let the consumer (or a preempted
+			 * producer holding a reservation) run.
+			 */
+			cond_resched();
+			goto retry;
+		}
+		total += PRODUCER_BULK;
+	}
+
+	return total;
+}
+
+static noinline int ring_producer_thread(void *arg)
+{
+	struct my_producer *me = arg;
+	unsigned int cnt;
+
+	while (!kthread_should_stop()) {
+
+		/* For max race, wait for consumer to start dequeue */
+		wait_for_completion(&dequeue_start);
+
+		cnt = ring_run_producer(mpsc, me);
+
+		if (verbose >= 2) {
+			preempt_disable();
+			pr_info("Producer(%u) enq:%u cpu:%d sleep %d secs\n",
+				me->data.id, cnt, smp_processor_id(),
+				SLEEP_TIME_ENQ);
+			preempt_enable();
+		}
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_timeout(HZ * SLEEP_TIME_ENQ);
+	}
+
+	return 0;
+}
+
+static void bench_reset_record(struct time_bench_record *rec,
+			       uint32_t loops, int step)
+{
+	/* Setup time_bench record */
+	memset(rec, 0, sizeof(*rec)); /* zero func might not update all */
+	rec->version_abi = 1;
+	rec->loops = loops;
+	rec->step  = step;
+	rec->flags = (TIME_BENCH_LOOP|TIME_BENCH_TSC|TIME_BENCH_WALLCLOCK);
+}
+
+static void validate_elems(struct my_consumer *me, void **deq_objs, int n)
+{
+	struct my_data data;
+	u32 predict;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		data.raw = deq_objs[i];
+		/* Basic idea is to validate all producers counters
+		 * is increasing compared to last dequeued
+		 */
+		predict = me->prod_cnt[data.id] + 1;
+		if (predict != data.cnt) {
+			pr_err("ERROR: mode:%s id:%u predicted:%u but was:%u\n",
+			       prod_mode_str[prod_mode],
+			       data.id, predict, data.cnt);
+			BUG();
+		}
+		me->prod_cnt[data.id] = data.cnt;
+	}
+}
+
+static unsigned int
+ring_run_consumer(struct ring_queue *q, struct my_consumer *me,
+		  struct time_bench_record *rec)
+{
+	int j, n, total = 0;
+	void *deq_objs[CONSUMER_BULK];
+	int elements = 100000;
+	int32_t loops = elements / CONSUMER_BULK;
+
+	bench_reset_record(rec, loops, CONSUMER_BULK);
+
+	/* Signals all threads waiting on this completion */
+	complete_all(&dequeue_start); /* enqueues raceing with dequeue */
+
+	time_bench_start(rec);
+	for (j = 0; j < loops; j++) {
+
+		n = ring_queue_sc_dequeue_burst(q, deq_objs, CONSUMER_BULK);
+		if (n == 0)
+			break; /* empty queue */
+		total += n;
+
+		validate_elems(me, deq_objs, n);
+	}
+	time_bench_stop(rec, total);
+
+	return total;
+}
+
+static void bench_calc(struct time_bench_record *rec)
+{
+	/* Calculate stats */
+	time_bench_calc_stats(rec);
+
+	pr_info("Cost_Per_Dequeue(%s): %llu cycles(tsc) %llu.%03llu ns"
+		" (step:%d)"
+		" - (measurement period time:%llu.%09u sec time_interval:%llu)"
+		" - (invoke count:%llu tsc_interval:%llu)\n",
+		prod_mode_str[prod_mode], rec->tsc_cycles,
+		rec->ns_per_call_quotient, rec->ns_per_call_decimal, rec->step,
+		rec->time_sec, rec->time_sec_remainder, rec->time_interval,
+		rec->invoked_cnt, rec->tsc_interval);
+}
+
+static int ring_consumer_thread(void *arg)
+{
+	struct my_consumer *me = arg;
+	unsigned int cnt;
+	int min_bench_cnt = CONSUMER_HIGH_DEQ_CNT; /* Should be > QUEUE_SIZE */
+	struct time_bench_record rec;
+	int cpu;
+
+	while (!kthread_should_stop()) {
+
+		cnt = ring_run_consumer(mpsc, me, &rec);
+
+		preempt_disable();
+		cpu = smp_processor_id();
+		preempt_enable();
+		/* In case cnt is larger than queue size, congestion
+		 * occured and concurrent enqueuers and deqeue have
+		 * been running.
+		 */
+		if (cnt > min_bench_cnt) {
+			if (verbose >= 1)
+				pr_info("High dequeue cnt:%u cpu:%d\n",
+					cnt, cpu);
+			bench_calc(&rec);
+		}
+		if (verbose >= 2)
+			pr_info("Consumer(%u) deq:%u cpu:%d sleep %d secs"
+				" qsz:%u\n" ,
+				me->id, cnt, cpu, SLEEP_TIME_DEQ,
+				ring_queue_count(mpsc));
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_timeout(HZ * SLEEP_TIME_DEQ);
+	}
+
+	return 0;
+}
+
+static int __init ring_queue_concurrent_module_init(void)
+{
+	unsigned int flags = RING_F_SC_DEQ;
+	int i, err;
+
+	if (verbose)
+		pr_info("Loaded\n");
+
+	switch (prod_mode) {
+	case 0:
+		break;
+	case 1:
+		flags |= RING_F_MP_RTS_ENQ;
+		break;
+	case 2:
+		flags |= RING_F_MP_HTS_ENQ;
+		break;
+	default:
+		pr_err("Invalid prod_mode:%d\n", prod_mode);
+		return -EINVAL;
+	}
+	if (nr_producers <= 0)
+		nr_producers = min_t(int, 2 * num_online_cpus(), MAX_PRODUCERS);
+	if (nr_producers > MAX_PRODUCERS) {
+		pr_err("Invalid nr_producers:%d (max %d)\n",
+		       nr_producers, MAX_PRODUCERS);
+		return -EINVAL;
+	}
+	if (verbose)
+		pr_info("Producer mode:%s producers:%d online CPUs:%u\n",
+			prod_mode_str[prod_mode], nr_producers,
+			num_online_cpus());
+
+	mpsc = ring_queue_create(QUEUE_SIZE, flags);
+	if (!mpsc)
+		return -ENOMEM;
+
+	init_completion(&dequeue_start);
+
+	for (i = 0; i < nr_producers;  i++) {
+		consumer.prod_cnt[i] = U32_MAX;
+	}
+	consumer.kthread = kthread_run(ring_consumer_thread,
+				       &consumer,
+				       "ring_consumer");
+	if (IS_ERR(consumer.kthread)) {
+		err = PTR_ERR(consumer.kthread);
+		goto free_queue;
+	}
+
+	for (i = 0; i < nr_producers;  i++) {
+		producers[i].data.id  = i;
+		producers[i].data.cnt = 0;
+		producers[i].kthread = kthread_run(ring_producer_thread,
+						   &producers[i],
+						   "ring_producer_%u", i);
+		if (IS_ERR(producers[i].kthread)) {
+			err = PTR_ERR(producers[i].kthread);
+			goto stop_threads;
+		}
+	}
+
+	return 0;
+
+stop_threads:
+	pr_err("Failed to start producer thread %d\n", i);
+	while (--i >= 0)
+		kthread_stop(producers[i].kthread);
+	kthread_stop(consumer.kthread);
+free_queue:
+	ring_queue_free(mpsc);
+	return err;
+}
+module_init(ring_queue_concurrent_module_init);
+
+static unsigned int
+empty_queue(struct ring_queue *q)
+{
+	int j, n, total = 0;
+	void *deq_objs[CONSUMER_BULK];
+	unsigned int loops = 10000000;
+
+	for (j = 0; j < loops; j++) {
+		n = ring_queue_sc_dequeue_burst(q, deq_objs, CONSUMER_BULK);
+		if (n == 0)
+			break;
+		validate_elems(&consumer, deq_objs, n);
+		total += n;
+	}
+	return total;
+}
+
+static void __exit ring_queue_concurrent_module_exit(void)
+{
+	int i, n;
+
+	if (verbose)
+		pr_info("Unloaded\n");
+
+	for (i = 0; i < nr_producers;  i++) {
+		kthread_stop(producers[i].kthread);
+	}
+	kthread_stop(consumer.kthread);
+
+	n = empty_queue(mpsc);
+	if (verbose > 0)
+		pr_info("Remaining elements in queue:%d", n);
+	ring_queue_free(mpsc);
+}
+module_exit(ring_queue_concurrent_module_exit);
+
+MODULE_DESCRIPTION("Concurrency testing of ring_queue producer sync modes");
+MODULE_AUTHOR("Jesper Dangaard Brouer <netoptimizer@brouer.com>");
+MODULE_LICENSE("GPL");
@@ -168,6 +168,110 @@ fail:
 	return false;
 }
 
+static bool test_MP_sync_mode_add_and_remove_elems_BULK(unsigned int flags)
+{
+#define BULK 10
+	struct ring_queue *queue;
+	void *objs[BULK];
+	void *deq_objs[BULK];
+	unsigned int i, round;
+
+	queue = ring_queue_create(16, flags|RING_F_SC_DEQ);
+	if (queue == NULL)
+		return false;
+	/* fake init pointers to a number */
+	for (i = 0; i < BULK; i++)
+		objs[i] = (void *)(unsigned long)(i+20);
+	/* Several rounds to make head/tail wrap the ring */
+	for (round = 0; round < 5; round++) {
+		if (ring_queue_enqueue_bulk(queue, objs, BULK) < 0)
+			goto fail;
+		if (ring_queue_count(queue) != BULK)
+			goto fail;
+		/* Not enough room, must fail without enqueuing */
+		if (ring_queue_enqueue_bulk(queue, objs, BULK) != -ENOBUFS)
+			goto fail;
+		if (ring_queue_dequeue_bulk(queue, deq_objs, BULK) < 0)
+			goto fail;
+		for (i = 0; i < BULK; i++) {
+			if (objs[i] != deq_objs[i])
+				goto fail;
+		}
+		/* burst variant limited to free space (size-1) */
+		if (ring_queue_enqueue_burst(queue, objs, BULK) != BULK)
+			goto fail;
+		if (ring_queue_enqueue_burst(queue, objs, BULK) != 5)
+			goto fail;
+		if (ring_queue_dequeue_burst(queue, deq_objs, BULK) != BULK)
+			goto fail;
+		if (ring_queue_dequeue_burst(queue, deq_objs, BULK) != 5)
+			goto fail;
+	}
+	/* empty */
+	if (!ring_queue_empty(queue))
+		goto fail;
+	return ring_queue_free(queue);
+fail:
+	ring_queue_free(queue);
+	return false;
+}
+
+static bool test_zero_copy_wrap(unsigned int flags)
+{
+	struct ring_queue *queue;
+	struct ring_queue_zc_data zcd;
+	void *objs[BULK];
+	unsigned int i, round;
+	int n;
+
+	queue = ring_queue_create(16, flags|RING_F_SC_DEQ);
+	if (queue == NULL)
+		return false;
+	for (i = 0; i < BULK; i++)
+		objs[i] = (void *)(unsigned long)(i+20);
+	/* Rounds of 10 in a 16 ring, make regions wrap */
+	for (round = 0; round < 5; round++) {
+		n = ring_queue_enqueue_zc_bulk_start(queue, BULK, &zcd);
+		if (n != BULK)
+			goto fail;
+		for (i = 0; i < zcd.n1; i++)
+			zcd.ptr1[i] = objs[i];
+		for (; i < BULK; i++)
+			zcd.ptr2[i - zcd.n1] = objs[i];
+		ring_queue_enqueue_zc_finish(queue, BULK);
+		if (ring_queue_count(queue) != BULK)
+			goto fail;
+
+		n = ring_queue_dequeue_zc_burst_start(queue, BULK * 2, &zcd);
+		if (n != BULK)
+			goto fail;
+		for (i = 0; i < BULK; i++) {
+			void *obj = (i < zcd.n1) ? zcd.ptr1[i] :
+				zcd.ptr2[i - zcd.n1];
+			if (obj != objs[i])
+				goto fail;
+		}
+		ring_queue_dequeue_zc_finish(queue, BULK);
+	}
+	if (!ring_queue_empty(queue))
+		goto fail;
+	return ring_queue_free(queue);
+fail:
+	ring_queue_free(queue);
+	return false;
+}
+
+static bool test_detect_conflicting_prod_flags(void)
+{
+	struct ring_queue *queue;
+
+	queue = ring_queue_create(128, RING_F_MP_RTS_ENQ|RING_F_MP_HTS_ENQ);
+	if (queue == NULL)
+		return true;
+	ring_queue_free(queue);
+	return false;
+}
+
 #define TEST_FUNC(func) 					\
 do {								\
 	if (!(func)) {						\
@@ -188,6 +292,12 @@ int run_basic_tests(void)
 	TEST_FUNC(test_SPSC_add_and_remove_elem());
 	TEST_FUNC(test_SPSC_add_and_remove_elems_BULK());
 	TEST_FUNC(test_late_void_ptr_cast_BULK());
+	TEST_FUNC(test_MP_sync_mode_add_and_remove_elems_BULK(0));
+	TEST_FUNC(test_MP_sync_mode_add_and_remove_elems_BULK(RING_F_MP_RTS_ENQ));
+	TEST_FUNC(test_MP_sync_mode_add_and_remove_elems_BULK(RING_F_MP_HTS_ENQ));
+	TEST_FUNC(test_detect_conflicting_prod_flags());
+	TEST_FUNC(test_zero_copy_wrap(RING_F_SP_ENQ));
+	TEST_FUNC(test_zero_copy_wrap(RING_F_MP_HTS_ENQ));
 	return passed_count;
 }
 
@@ -434,6 +544,129 @@ fail:
 	return -1;
 }
 
+/** Pipeline of three rings, objects moving ring-to-ring **/
+#define CHAIN_RINGS 3
+
+struct ring_chain {
+	struct ring_queue *r[CHAIN_RINGS];
+};
+
+/* Move bulk objects through each ring of the chain via a caller array */
+static int time_chain_copy(struct time_bench_record *rec, void *data)
+{
+	struct ring_chain *chain = data;
+	void *objs[MAX_BULK];
+	uint64_t loops_cnt = 0;
+	int bulk = rec->step;
+	int i, j;
+
+	if (bulk > MAX_BULK)
+		bulk = MAX_BULK;
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+		for (j = 0; j < CHAIN_RINGS; j++) {
+			struct ring_queue *src = chain->r[j];
+			struct ring_queue *dst = chain->r[(j + 1) % CHAIN_RINGS];
+
+			if (ring_queue_sc_dequeue_bulk(src, objs, bulk) < 0)
+				goto fail;
+			if (ring_queue_sp_enqueue_bulk(dst, objs, bulk) < 0)
+				goto fail;
+			loops_cnt += bulk;
+		}
+	}
+	time_bench_stop(rec, loops_cnt);
+	return loops_cnt;
+fail:
+	return 0;
+}
+
+static __always_inline void **zc_slot(struct ring_queue_zc_data *zcd,
+				      unsigned int i)
+{
+	return (i < zcd->n1) ? &zcd->ptr1[i] : &zcd->ptr2[i - zcd->n1];
+}
+
+/* Move bulk objects through each ring of the chain, ring-to-ring */
+static int time_chain_zc(struct time_bench_record *rec, void *data)
+{
+	struct ring_chain *chain = data;
+	struct ring_queue_zc_data src_zcd, dst_zcd;
+	uint64_t loops_cnt = 0;
+	int bulk = rec->step;
+	unsigned int n;
+	int i, j;
+
+	if (bulk > MAX_BULK)
+		bulk = MAX_BULK;
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+		for (j = 0; j < CHAIN_RINGS; j++) {
+			struct ring_queue *src = chain->r[j];
+			struct ring_queue *dst = chain->r[(j + 1) % CHAIN_RINGS];
+
+			if (ring_queue_dequeue_zc_bulk_start(src, bulk,
+							     &src_zcd) < 0)
+				goto fail;
+			if (ring_queue_enqueue_zc_bulk_start(dst, bulk,
+							     &dst_zcd) < 0)
+				goto fail;
+			if (likely(!src_zcd.ptr2 && !dst_zcd.ptr2)) {
+				memcpy(dst_zcd.ptr1, src_zcd.ptr1,
+				       bulk * sizeof(void *));
+			} else {
+				for (n = 0; n < bulk; n++)
+					*zc_slot(&dst_zcd, n) =
+						*zc_slot(&src_zcd, n);
+			}
+			ring_queue_enqueue_zc_finish(dst, bulk);
+			ring_queue_dequeue_zc_finish(src, bulk);
+			loops_cnt += bulk;
+		}
+	}
+	time_bench_stop(rec, loops_cnt);
+	return loops_cnt;
+fail:
+	return 0;
+}
+
+static void run_timing_chain(uint32_t loops, int ring_size)
+{
+	struct ring_chain chain;
+	void *objs[MAX_BULK];
+	int i, bulk;
+
+	for (i = 0; i < MAX_BULK; i++)
+		objs[i] = (void *)(unsigned long)(i+20);
+
+	for (i = 0; i < CHAIN_RINGS; i++) {
+		chain.r[i] = ring_queue_create(ring_size,
+					       RING_F_SP_ENQ|RING_F_SC_DEQ);
+		if (!chain.r[i])
+			goto out;
+		/* Prefill, so every ring in the chain have objects */
+		if (ring_queue_sp_enqueue_bulk(chain.r[i], objs, MAX_BULK) < 0) {
+			i++;
+			goto out;
+		}
+	}
+
+	for (bulk = 2; bulk <= MAX_BULK; bulk *= 2) {
+		pr_info("*** Timing ring chain with BULK=%d ***\n", bulk);
+		time_bench_loop(loops/CHAIN_RINGS, bulk, "chain_copy", &chain,
+				time_chain_copy);
+		time_bench_loop(loops/CHAIN_RINGS, bulk, "chain_zc", &chain,
+				time_chain_zc);
+	}
+out:
+	while (--i >= 0)
+		ring_queue_free(chain.r[i]);
+}
+
 /** measuring doubly linked list **/
 
 struct my_list_elem {
@@ -713,12 +946,18 @@ static int time_bench_kmalloc_test2(
 void run_timing_bulksize(int bulk, uint32_t loops,
 			struct ring_queue *MPMC,
 			struct ring_queue *SPSC,
-			struct ring_queue *MPSC)
+			struct ring_queue *MPSC,
+			struct ring_queue *RTS,
+			struct ring_queue *HTS)
 {
 	pr_info("*** Timing with BULK=%d ***\n", bulk);
 	time_bench_loop(loops, bulk, "MPMC", MPMC, time_BULK_enqueue_dequeue);
 	time_bench_loop(loops, bulk, "SPSC", SPSC, time_BULK_enqueue_dequeue);
 	time_bench_loop(loops, bulk, "MPSC", MPSC, time_BULK_enqueue_dequeue);
+	time_bench_loop(loops, bulk, "MPSC-RTS", RTS,
+			time_BULK_enqueue_dequeue);
+	time_bench_loop(loops, bulk, "MPSC-HTS", HTS,
+			time_BULK_enqueue_dequeue);
 }
 
 int run_timing_tests(void)
@@ -728,6 +967,8 @@ int run_timing_tests(void)
 	struct ring_queue *MPMC;
 	struct ring_queue *SPSC;
 	struct ring_queue *MPSC;
+	struct ring_queue *RTS;
+	struct ring_queue *HTS;
 	uint32_t loops = 10000000;
 
 	time_bench_loop(loops*1000, 0, "for_loop", NULL, time_bench_for_loop);
@@ -760,6 +1001,8 @@ int run_timing_tests(void)
 	MPMC = ring_queue_create(ring_size, 0);
 	SPSC = ring_queue_create(ring_size, RING_F_SP_ENQ|RING_F_SC_DEQ);
 	MPSC = ring_queue_create(ring_size, RING_F_SC_DEQ);
+	RTS  = ring_queue_create(ring_size, RING_F_MP_RTS_ENQ|RING_F_SC_DEQ);
+	HTS  = ring_queue_create(ring_size, RING_F_MP_HTS_ENQ|RING_F_SC_DEQ);
 
 	time_bench_loop(loops, 0, "MPMC", MPMC,
 			time_bench_single_enqueue_dequeue);
@@ -767,6 +1010,10 @@ int run_timing_tests(void)
 			time_bench_single_enqueue_dequeue);
 	time_bench_loop(loops, 0, "MPSC", MPSC,
 			time_bench_single_enqueue_dequeue);
+	time_bench_loop(loops, 0, "MPSC-RTS", RTS,
+			time_bench_single_enqueue_dequeue);
+	time_bench_loop(loops, 0, "MPSC-HTS", HTS,
+			time_bench_single_enqueue_dequeue);
 
 	time_bench_loop(loops/100, 128, "MPMC-m", MPMC,
 			time_multi_enqueue_dequeue);
@@ -775,15 +1022,19 @@ int run_timing_tests(void)
 	time_bench_loop(loops/100, 128, "MPSC-m", MPSC,
 			time_multi_enqueue_dequeue);
 
-	run_timing_bulksize( 2, loops, MPMC, SPSC, MPSC);
-	run_timing_bulksize( 4, loops, MPMC, SPSC, MPSC);
-	run_timing_bulksize( 8, loops, MPMC, SPSC, MPSC);
-	run_timing_bulksize(16, loops, MPMC, SPSC, MPSC);
-	run_timing_bulksize(32, loops, MPMC, SPSC, MPSC);
+	run_timing_bulksize( 2, loops, MPMC, SPSC, MPSC, RTS, HTS);
+	run_timing_bulksize( 4, loops, MPMC, SPSC, MPSC, RTS, HTS);
+	run_timing_bulksize( 8, loops, MPMC, SPSC, MPSC, RTS, HTS);
+	run_timing_bulksize(16, loops, MPMC, SPSC, MPSC, RTS, HTS);
+	run_timing_bulksize(32, loops, MPMC, SPSC, MPSC, RTS, HTS);
+
+	run_timing_chain(loops, ring_size);
 
 	ring_queue_free(MPMC);
 	ring_queue_free(SPSC);
 	ring_queue_free(MPSC);
+	ring_queue_free(RTS);
+	ring_queue_free(HTS);
 	return passed_count;
 }
 
@@ -802,8 +1053,8 @@ static int __init ring_queue_module_init(void)
 
 	if (verbose)
 		pr_info("Loaded\n");
-//	if (run_basic_tests() < 0)
-//		return -ECANCELED;
+	if (run_basic_tests() < 0)
+		return -ECANCELED;
 
 	if (run_timing_tests() < 0) {
 		return -ECANCELED;
@@ -6,7 +6,7 @@
 #include <linux/module.h>
 #include <linux/time_bench.h>
 #include <linux/mm.h> /* missing in ptr_ring.h on >= v4.16 */
-#include <linux/skb_array.h>
+#include <linux/skb_array_ext.h>
 
 static int verbose=1;
 
@@ -141,6 +141,306 @@ out:
 	kfree(queue);
 }
 
+/* Compare enqueuing a bulk of "step" objects, via either individual
+ * produce calls (one lock + smp_wmb per object) or a single batched
+ * produce call.  The dequeue side use skb_array_consume_batched().
+ *
+ *  Cost is enqueue+dequeue per object
+ */
+#define BULK_MAX 64
+static __always_inline int __time_bench_bulk_enq_deq(
+	struct time_bench_record *rec, void *data, bool batched)
+{
+	struct skb_array *queue = (struct skb_array*)data;
+	struct sk_buff *skbs[BULK_MAX], *deq[BULK_MAX];
+	int bulk = min_t(int, rec->step, BULK_MAX);
+	uint64_t loops_cnt = 0;
+	int i, j, n;
+
+	if (queue == NULL) {
+		pr_err("Need queue struct ptr as input\n");
+		return -1;
+	}
+
+	/* Fake pointer values to enqueue */
+	for (j = 0; j < bulk; j++)
+		skbs[j] = (struct sk_buff *)(unsigned long)(42 + j);
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+
+		if (batched) {
+			if (skb_array_produce_batched(queue, skbs, bulk) != bulk)
+				goto fail;
+		} else {
+			for (j = 0; j < bulk; j++)
+				if (skb_array_produce(queue, skbs[j]) < 0)
+					goto fail;
+		}
+		barrier(); /* compiler barrier */
+
+		n = skb_array_consume_batched(queue, deq, bulk);
+		if (n != bulk || deq[bulk - 1] != skbs[bulk - 1])
+			goto fail;
+		loops_cnt += bulk;
+	}
+	time_bench_stop(rec, loops_cnt);
+
+	return loops_cnt;
+fail:
+	return 0;
+}
+static int time_bench_bulk_enq_single(
+	struct time_bench_record *rec, void *data)
+{
+	return __time_bench_bulk_enq_deq(rec, data, false);
+}
+static int time_bench_bulk_enq_batched(
+	struct time_bench_record *rec, void *data)
+{
+	return __time_bench_bulk_enq_deq(rec, data, true);
+}
+
+/* Compare dequeuing a bulk of "step" objects, via either individual
+ * consume calls, a single (upstream) consume_batched call, or a single
+ * one pass consume_bulk call.  The enqueue side use
+ * skb_array_produce_batched().
+ *
+ *  Cost is enqueue+dequeue per object
+ */
+enum deq_type {
+	DEQ_SINGLE = 1,
+	DEQ_BATCHED,
+	DEQ_BULK,
+};
+
+static __always_inline int __time_bench_bulk_deq(
+	struct time_bench_record *rec, void *data, enum deq_type type)
+{
+	struct skb_array *queue = (struct skb_array*)data;
+	struct sk_buff *skbs[BULK_MAX], *deq[BULK_MAX];
+	int bulk = min_t(int, rec->step, BULK_MAX);
+	uint64_t loops_cnt = 0;
+	int i, j, n;
+
+	if (queue == NULL) {
+		pr_err("Need queue struct ptr as input\n");
+		return -1;
+	}
+
+	/* Fake pointer values to enqueue */
+	for (j = 0; j < bulk; j++)
+		skbs[j] = (struct sk_buff *)(unsigned long)(42 + j);
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+
+		if (skb_array_produce_batched(queue, skbs, bulk) != bulk)
+			goto fail;
+		barrier(); /* compiler barrier */
+
+		if (type == DEQ_BATCHED) {
+			n = skb_array_consume_batched(queue, deq, bulk);
+		} else if (type == DEQ_BULK) {
+			n = skb_array_consume_bulk(queue, deq, bulk);
+		} else {
+			for (n = 0; n < bulk; n++)
+				if (!(deq[n] = skb_array_consume(queue)))
+					break;
+		}
+		if (n != bulk || deq[bulk - 1] != skbs[bulk - 1])
+			goto fail;
+		loops_cnt += bulk;
+	}
+	time_bench_stop(rec, loops_cnt);
+
+	return loops_cnt;
+fail:
+	return 0;
+}
+static int time_bench_bulk_deq_single(
+	struct time_bench_record *rec, void *data)
+{
+	return __time_bench_bulk_deq(rec, data, DEQ_SINGLE);
+}
+static int time_bench_bulk_deq_batched(
+	struct time_bench_record *rec, void *data)
+{
+	return __time_bench_bulk_deq(rec, data, DEQ_BATCHED);
+}
+static int time_bench_bulk_deq_bulk(
+	struct time_bench_record *rec, void *data)
+{
+	return __time_bench_bulk_deq(rec, data, DEQ_BULK);
+}
+
+void noinline run_bench_consume_batched(uint32_t loops, int q_size, int bulk)
+{
+	struct skb_array *queue;
+	int result;
+
+	queue = kzalloc(sizeof(*queue), GFP_KERNEL);
+
+	result = skb_array_init(queue, q_size, GFP_KERNEL);
+	if (result < 0) {
+		pr_err("%s() err creating skb_array queue size:%d\n",
+		       __func__, q_size);
+		return;
+	}
+
+	time_bench_loop(loops / bulk, bulk, "skb_array_consume_single", queue,
+			time_bench_bulk_deq_single);
+	time_bench_loop(loops / bulk, bulk, "skb_array_consume_batched", queue,
+			time_bench_bulk_deq_batched);
+	time_bench_loop(loops / bulk, bulk, "skb_array_consume_bulk", queue,
+			time_bench_bulk_deq_bulk);
+
+	helper_empty_queue(queue);
+	skb_array_cleanup(queue);
+	kfree(queue);
+}
+
+void noinline run_bench_produce_batched(uint32_t loops, int q_size, int bulk)
+{
+	struct skb_array *queue;
+	int result;
+
+	queue = kzalloc(sizeof(*queue), GFP_KERNEL);
+
+	result = skb_array_init(queue, q_size, GFP_KERNEL);
+	if (result < 0) {
+		pr_err("%s() err creating skb_array queue size:%d\n",
+		       __func__, q_size);
+		return;
+	}
+
+	time_bench_loop(loops / bulk, bulk, "skb_array_produce_single", queue,
+			time_bench_bulk_enq_single);
+	time_bench_loop(loops / bulk, bulk, "skb_array_produce_batched", queue,
+			time_bench_bulk_enq_batched);
+
+	helper_empty_queue(queue);
+	skb_array_cleanup(queue);
+	kfree(queue);
+}
+
+/* Mixed-size real skb workload, for measuring the byte accounting
+ * overhead and the latency bound given by a byte budget.  Each loop
+ * enqueue a bulk of skbs, and dequeue them until the queue is empty.
+ * The "max_call_bytes" is the most bytes handed to the consumer in a
+ * single dequeue call, which is what bounds latency.
+ */
+#define MIXED_SKBS 64
+static const int mixed_sizes[] = { 64, 1500, 128, 576, 64, 9000, 256, 1500 };
+static struct sk_buff *mixed_skbs[MIXED_SKBS];
+static unsigned int byte_budget;
+
+static __always_inline int __time_bench_mixed_skb(
+	struct time_bench_record *rec, void *data, bool accounted)
+{
+	struct skb_array_bytes *queue = (struct skb_array_bytes*)data;
+	unsigned int bytes, max_call_bytes = 0;
+	struct sk_buff *deq[MIXED_SKBS];
+	uint64_t loops_cnt = 0, calls = 0;
+	int i, j, n;
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+
+		for (j = 0; j < MIXED_SKBS; j++) {
+			if (accounted)
+				n = skb_array_produce_bytes(queue,
+							    mixed_skbs[j]);
+			else
+				n = skb_array_produce(&queue->a, mixed_skbs[j]);
+			if (n < 0)
+				goto fail;
+		}
+		barrier(); /* compiler barrier */
+
+		for (j = 0; j < MIXED_SKBS; j += n) {
+			if (accounted) {
+				n = skb_array_consume_bytes(queue, deq,
+							    MIXED_SKBS,
+							    byte_budget,
+							    &bytes);
+				max_call_bytes = max(max_call_bytes, bytes);
+			} else {
+				n = skb_array_consume_batched(&queue->a, deq,
+							      MIXED_SKBS);
+			}
+			if (n == 0)
+				goto fail;
+			calls++;
+		}
+		loops_cnt += MIXED_SKBS;
+	}
+	time_bench_stop(rec, loops_cnt);
+
+	if (accounted)
+		pr_info("%s(budget:%u): avg skbs per call:%llu"
+			" max bytes per call:%u\n", __func__, byte_budget,
+			div64_u64(loops_cnt, calls), max_call_bytes);
+	return loops_cnt;
+fail:
+	return 0;
+}
+static int time_bench_mixed_skb_plain(
+	struct time_bench_record *rec, void *data)
+{
+	return __time_bench_mixed_skb(rec, data, false);
+}
+static int time_bench_mixed_skb_bytes(
+	struct time_bench_record *rec, void *data)
+{
+	return __time_bench_mixed_skb(rec, data, true);
+}
+
+void noinline run_bench_mixed_skb_bytes(uint32_t loops)
+{
+	static const unsigned int budgets[] = { UINT_MAX, 16384, 4096 };
+	struct skb_array_bytes *queue;
+	int i, len;
+
+	queue = kzalloc(sizeof(*queue), GFP_KERNEL);
+	if (!queue)
+		return;
+	if (skb_array_bytes_init(queue, MIXED_SKBS * 2, GFP_KERNEL) < 0)
+		goto out;
+
+	for (i = 0; i < MIXED_SKBS; i++) {
+		len = mixed_sizes[i % ARRAY_SIZE(mixed_sizes)];
+		mixed_skbs[i] = alloc_skb(len, GFP_KERNEL);
+		if (!mixed_skbs[i])
+			goto free;
+		skb_put(mixed_skbs[i], len);
+	}
+
+	time_bench_loop(loops / MIXED_SKBS, MIXED_SKBS,
+			"skb_array_mixed_skb_plain", queue,
+			time_bench_mixed_skb_plain);
+	for (i = 0; i < ARRAY_SIZE(budgets); i++) {
+		byte_budget = budgets[i];
+		time_bench_loop(loops / MIXED_SKBS, MIXED_SKBS,
+				"skb_array_mixed_skb_bytes", queue,
+				time_bench_mixed_skb_bytes);
+	}
+
+	/* Queue only holds skbs owned by mixed_skbs[] */
+	helper_empty_queue(&queue->a);
+free:
+	for (i = 0; i < MIXED_SKBS && mixed_skbs[i]; i++) {
+		kfree_skb(mixed_skbs[i]);
+		mixed_skbs[i] = NULL;
+	}
+	skb_array_bytes_cleanup(queue);
+out:
+	kfree(queue);
+}
+
 int run_benchmark_tests(void)
 {
 	uint32_t loops = 10000000;
@@ -162,6 +462,27 @@ int run_benchmark_tests(void)
 			", cost is enqueue+dequeue\n");
 	run_bench_prefillq(loops, 1000, 64);
 
+	if (verbose)
+		pr_info("For 'skb_array_produce_*' step = bulk size"
+			", cost is enqueue+dequeue per object\n");
+	run_bench_produce_batched(loops, 1000, 8);
+	run_bench_produce_batched(loops, 1000, 16);
+	run_bench_produce_batched(loops, 1000, 32);
+	run_bench_produce_batched(loops, 1000, 64);
+
+	if (verbose)
+		pr_info("For 'skb_array_consume_*' step = bulk size"
+			", cost is enqueue+dequeue per object\n");
+	run_bench_consume_batched(loops, 1000, 8);
+	run_bench_consume_batched(loops, 1000, 16);
+	run_bench_consume_batched(loops, 1000, 32);
+	run_bench_consume_batched(loops, 1000, 64);
+
+	if (verbose)
+		pr_info("For 'skb_array_mixed_skb_*' step = skbs per loop"
+			", cost is enqueue+dequeue per skb\n");
+	run_bench_mixed_skb_bytes(loops);
+
 	return 0;
 }
 
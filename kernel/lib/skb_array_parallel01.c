@@ -6,7 +6,8 @@
 #include <linux/module.h>
 #include <linux/time_bench.h>
 #include <linux/mm.h> /* missing in ptr_ring.h on >= v4.16 */
-#include <linux/skb_array.h>
+#include <linux/skb_array_ext.h>
+#include <linux/ptr_ring_ext.h>
 
 static int verbose=1;
 
@@ -15,6 +16,14 @@ static int parallel_cpus = 4;
 module_param(parallel_cpus, uint, 0);
 MODULE_PARM_DESC(parallel_cpus, "Number of parallel CPUs (default 4)");
 
+static int prefetch_distance = 4;
+module_param(prefetch_distance, uint, 0);
+MODULE_PARM_DESC(prefetch_distance, "Prefetch distance for cold skb bench");
+
+static int sweep = 1;
+module_param(sweep, uint, 0);
+MODULE_PARM_DESC(sweep, "Run adaptive batch sweep (ring sizes and speed ratios)");
+
 /* This is the main benchmark function.
  *
  *  lib/time_bench.c:time_bench_run_concurrent() sync concurrent execution
@@ -81,6 +90,239 @@ finish_early:
 	return loops_cnt;
 }
 
+/* Same as time_bench_CPU_enq_or_deq, but the dequeue side use
+ * the one pass skb_array_consume_bulk() with a bulk size of "deq_bulk".
+ */
+#define DEQ_BULK_MAX 64
+static int deq_bulk = 8;
+
+static int time_bench_CPU_enq_or_deq_batched(
+	struct time_bench_record *rec, void *data)
+{
+	struct skb_array *queue = (struct skb_array*)data;
+	struct sk_buff *skb, *deq[DEQ_BULK_MAX];
+	int bulk = min_t(int, deq_bulk, DEQ_BULK_MAX);
+	uint64_t loops_cnt = 0;
+	int i, n;
+
+	bool enq_CPU = false;
+
+	/* Split CPU between enq/deq based on even/odd */
+	if ((smp_processor_id() % 2)== 0)
+		enq_CPU = true;
+
+	/* Hack: use "step" to mark enq/deq, as "step" gets printed */
+	rec->step = enq_CPU;
+
+	/* Fake pointer value to enqueue */
+	skb = (struct sk_buff *)(unsigned long)42;
+
+	if (queue == NULL) {
+		pr_err("Need queue ptr as input\n");
+		return 0;
+	}
+	/* loop count is limited to 32-bit due to div_u64_rem() use */
+	if (((uint64_t)rec->loops * 2) >= ((1ULL<<32)-1)) {
+		pr_err("Loop cnt too big will overflow 32-bit\n");
+		return 0;
+	}
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; ) {
+
+		if (enq_CPU) {
+			/* enqueue side */
+			if (skb_array_produce(queue, skb) < 0) {
+				pr_err("%s() WARN: enq fullq(CPU:%d) i:%d\n",
+				       __func__, smp_processor_id(), i);
+				goto finish_early;
+			}
+			n = 1;
+		} else {
+			/* dequeue side */
+			n = skb_array_consume_bulk(queue, deq, bulk);
+			if (n == 0) {
+				pr_err("%s() WARN: deq emptyq (CPU:%d) i:%d\n",
+				       __func__, smp_processor_id(), i);
+				goto finish_early;
+			}
+		}
+		i += n;
+		loops_cnt += n;
+		barrier(); /* compiler barrier */
+	}
+finish_early:
+	time_bench_stop(rec, loops_cnt);
+
+	return loops_cnt;
+}
+
+/* Sweep benchmark for the adaptive consumer batch size.  The producer
+ * and consumer speed ratio is simulated by spinning "work" loops per
+ * element, and full/empty queue is retried instead of stopping, as
+ * running near-full or near-empty is the point of this test.  The
+ * queue is a ptr_ring_ext (see linux/ptr_ring_ext.h), with fake
+ * pointers.
+ */
+static int sweep_prod_work;
+static int sweep_cons_work;
+
+static __always_inline void sweep_work(int work)
+{
+	int i;
+
+	for (i = 0; i < work; i++)
+		cpu_relax();
+}
+
+static int time_bench_CPU_sweep(
+	struct time_bench_record *rec, void *data)
+{
+	struct ptr_ring_ext *queue = (struct ptr_ring_ext*)data;
+	uint64_t retries = 0, max_retries;
+	uint64_t loops_cnt = 0;
+	void *ptr;
+	int i;
+
+	bool enq_CPU = false;
+
+	/* Split CPU between enq/deq based on even/odd */
+	if ((smp_processor_id() % 2)== 0)
+		enq_CPU = true;
+
+	/* Hack: use "step" to mark enq/deq, as "step" gets printed */
+	rec->step = enq_CPU;
+
+	/* Fake pointer value to enqueue */
+	ptr = (void *)(unsigned long)42;
+
+	if (queue == NULL) {
+		pr_err("Need queue ptr as input\n");
+		return 0;
+	}
+	max_retries = (uint64_t)rec->loops * 1000;
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+
+		if (enq_CPU) {
+			sweep_work(sweep_prod_work);
+			while (ptr_ring_ext_produce(queue, ptr) < 0) {
+				if (++retries > max_retries)
+					goto finish_early;
+				cpu_relax();
+			}
+		} else {
+			while (ptr_ring_ext_consume(queue) == NULL) {
+				if (++retries > max_retries)
+					goto finish_early;
+				cpu_relax();
+			}
+			sweep_work(sweep_cons_work);
+		}
+		loops_cnt++;
+		barrier(); /* compiler barrier */
+	}
+finish_early:
+	time_bench_stop(rec, loops_cnt);
+	if (loops_cnt != rec->loops)
+		pr_err("%s() WARN: CPU:%d gave up after %llu retries\n",
+		       __func__, smp_processor_id(), retries);
+
+	return loops_cnt;
+}
+
+/* Benchmark with real cold skbs, comparing consume_batched with and
+ * without prefetching.  The producer CPU writes to the skb struct and
+ * linear data before enqueuing (making them cold on the consumer CPU),
+ * and the consumer reads skb->len and the packet headers.
+ *
+ * The skbs are recycled from a pool larger than the queue, thus the
+ * producer never touches an skb the consumer can still be processing.
+ */
+#define COLD_SKB_QUEUE_SZ	1024
+#define COLD_SKB_POOL_SZ	(COLD_SKB_QUEUE_SZ * 4)
+#define COLD_SKB_BULK		16
+#define COLD_SKB_LEN		64
+
+struct cold_skb_data {
+	struct skb_array *queue;
+	struct sk_buff **pool;
+	int distance;
+	u64 sum; /* consumer result, avoid optimizing reads away */
+};
+
+static int time_bench_CPU_cold_skb(
+	struct time_bench_record *rec, void *data)
+{
+	struct cold_skb_data *d = data;
+	struct sk_buff *skbs[COLD_SKB_BULK];
+	uint64_t retries = 0, max_retries;
+	uint64_t loops_cnt = 0;
+	struct sk_buff *skb;
+	u64 sum = 0;
+	int i, j, n;
+
+	bool enq_CPU = false;
+
+	/* Split CPU between enq/deq based on even/odd */
+	if ((smp_processor_id() % 2)== 0)
+		enq_CPU = true;
+
+	/* Hack: use "step" to mark enq/deq, as "step" gets printed */
+	rec->step = enq_CPU;
+
+	max_retries = (uint64_t)rec->loops * 1000;
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; ) {
+
+		if (enq_CPU) {
+			skb = d->pool[i % COLD_SKB_POOL_SZ];
+			/* Simulate RX: write headers and skb fields */
+			memset(skb->data, i, ETH_HLEN);
+			skb->len = COLD_SKB_LEN + (i & 0xF);
+			while (skb_array_produce(d->queue, skb) < 0) {
+				if (++retries > max_retries)
+					goto finish_early;
+				cpu_relax();
+			}
+			n = 1;
+		} else {
+			n = min_t(int, COLD_SKB_BULK, rec->loops - i);
+			n = skb_array_consume_batched_prefetch(
+				d->queue, skbs, n, d->distance);
+			if (n == 0) {
+				if (++retries > max_retries)
+					goto finish_early;
+				cpu_relax();
+				continue;
+			}
+			for (j = 0; j < n; j++) {
+				skb_array_prefetch_next(skbs, j, n,
+							d->distance);
+				skb = skbs[j];
+				sum += skb->len + skb->data[0] +
+					skb->data[ETH_HLEN - 1];
+			}
+		}
+		i += n;
+		loops_cnt += n;
+		barrier(); /* compiler barrier */
+	}
+finish_early:
+	time_bench_stop(rec, loops_cnt);
+	if (loops_cnt != rec->loops)
+		pr_err("%s() WARN: CPU:%d gave up after %llu retries\n",
+		       __func__, smp_processor_id(), retries);
+	if (!enq_CPU)
+		d->sum = sum;
+
+	return loops_cnt;
+}
 
 int run_parallel(const char *desc, uint32_t loops, const cpumask_t *cpumask,
 		 int step, void *data,
@@ -209,6 +451,136 @@ fail:
 	kfree(queue);
 }
 
+void noinline run_parallel_two_CPUs_batched(uint32_t loops, int q_size,
+					    int prefill, int bulk)
+{
+	struct skb_array *queue;
+	cpumask_t cpumask;
+
+	queue = kzalloc(sizeof(*queue), GFP_KERNEL);
+
+	/* Restrict the CPUs to run on
+	 */
+	cpumask_clear(&cpumask);
+	cpumask_set_cpu(0, &cpumask);
+	cpumask_set_cpu(1, &cpumask);
+
+	if (!init_queue(queue, q_size, prefill))
+	    goto fail;
+
+	if (verbose)
+		pr_info("Dequeue CPU use consume_bulk bulk:%d\n", bulk);
+	deq_bulk = bulk;
+	run_parallel("skb_array_parallel_two_CPUs_batched",
+		     loops, &cpumask, 0, queue,
+		     time_bench_CPU_enq_or_deq_batched);
+
+	helper_empty_queue(queue); /* dequeue fake pointers before cleanup */
+	skb_array_cleanup(queue);
+fail:
+	kfree(queue);
+}
+void noinline run_sweep_adaptive_batch(uint32_t loops, int q_size,
+				       int prod_work, int cons_work,
+				       bool adaptive)
+{
+	struct ptr_ring_ext *queue;
+	cpumask_t cpumask;
+
+	queue = kzalloc(sizeof(*queue), GFP_KERNEL);
+	if (!queue)
+		return;
+
+	cpumask_clear(&cpumask);
+	cpumask_set_cpu(0, &cpumask);
+	cpumask_set_cpu(1, &cpumask);
+
+	if (ptr_ring_ext_init(queue, q_size, GFP_KERNEL) < 0) {
+		pr_err("%s() err creating ptr_ring_ext queue size:%d\n",
+		       __func__, q_size);
+		goto fail;
+	}
+	ptr_ring_ext_set_batch_adaptive(queue, adaptive);
+
+	sweep_prod_work = prod_work;
+	sweep_cons_work = cons_work;
+	pr_info("Sweep q_size:%d prod_work:%d cons_work:%d adaptive:%d"
+		" batch:%d\n", q_size, prod_work, cons_work, adaptive,
+		queue->batch_base);
+	run_parallel("ptr_ring_ext_sweep_batch",
+		     loops, &cpumask, 0, queue,
+		     time_bench_CPU_sweep);
+	if (adaptive)
+		pr_info(" - adaptive batch:%d (max:%d) grow:%lu shrink:%lu"
+			" stalls:%lu\n", queue->ring.batch, queue->batch_max,
+			queue->batch_stats.grow, queue->batch_stats.shrink,
+			queue->batch_stats.stalls);
+
+	/* Only fake pointers, no destructor */
+	ptr_ring_ext_cleanup(queue, NULL);
+fail:
+	kfree(queue);
+}
+
+void noinline run_sweep(uint32_t loops)
+{
+	static const int q_sizes[] = { 64, 512, 4096 };
+	/* Producer/consumer work loops, simulating speed ratios */
+	static const int work[][2] = { {0, 0}, {0, 50}, {50, 0} };
+	int i, j;
+
+	if (!sweep)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(q_sizes); i++) {
+		for (j = 0; j < ARRAY_SIZE(work); j++) {
+			run_sweep_adaptive_batch(loops, q_sizes[i],
+						 work[j][0], work[j][1], false);
+			run_sweep_adaptive_batch(loops, q_sizes[i],
+						 work[j][0], work[j][1], true);
+		}
+	}
+}
+
+void noinline run_parallel_cold_skb(uint32_t loops, int distance)
+{
+	struct cold_skb_data d = { .distance = distance };
+	cpumask_t cpumask;
+	int i;
+
+	d.queue = kzalloc(sizeof(*d.queue), GFP_KERNEL);
+	d.pool = kcalloc(COLD_SKB_POOL_SZ, sizeof(*d.pool), GFP_KERNEL);
+	if (!d.queue || !d.pool)
+		goto out;
+	for (i = 0; i < COLD_SKB_POOL_SZ; i++) {
+		d.pool[i] = alloc_skb(COLD_SKB_LEN + NET_SKB_PAD, GFP_KERNEL);
+		if (!d.pool[i])
+			goto free_pool;
+		skb_reserve(d.pool[i], NET_SKB_PAD);
+	}
+	if (skb_array_init(d.queue, COLD_SKB_QUEUE_SZ, GFP_KERNEL) < 0)
+		goto free_pool;
+
+	cpumask_clear(&cpumask);
+	cpumask_set_cpu(0, &cpumask);
+	cpumask_set_cpu(1, &cpumask);
+
+	pr_info("Cold skbs prefetch distance:%d bulk:%d\n",
+		distance, COLD_SKB_BULK);
+	run_parallel("skb_array_parallel_cold_skb",
+		     loops, &cpumask, 0, &d,
+		     time_bench_CPU_cold_skb);
+
+	/* The skbs are owned by the pool, not the queue */
+	helper_empty_queue(d.queue);
+	skb_array_cleanup(d.queue);
+free_pool:
+	for (i = 0; i < COLD_SKB_POOL_SZ && d.pool[i]; i++)
+		kfree_skb(d.pool[i]);
+out:
+	kfree(d.pool);
+	kfree(d.queue);
+}
 
 int run_benchmark_tests(void)
 {
@@ -238,6 +610,17 @@ int run_benchmark_tests(void)
 
 	run_parallel_many_CPUs(loops, q_size, prefill);
 
+	run_parallel_two_CPUs_batched(loops, q_size, prefill, 8);
+	run_parallel_two_CPUs_batched(loops, q_size, prefill, 16);
+	run_parallel_two_CPUs_batched(loops, q_size, prefill, 32);
+	run_parallel_two_CPUs_batched(loops, q_size, prefill, 64);
+
+	run_sweep(loops);
+
+	run_parallel_cold_skb(loops, 0);
+	if (prefetch_distance)
+		run_parallel_cold_skb(loops, prefetch_distance);
+
 	return 0;
 }
 
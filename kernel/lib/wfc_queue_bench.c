@@ -0,0 +1,319 @@
+/*
+ * Benchmark module for linux/wfc_queue.h
+ *
+ * Many-producer/one-consumer (MPSC) load, like the page_pool return
+ * path where remote CPUs return objects to the owner CPU.  Compare the
+ * wfc_queue wait-free enqueue, consumed either one node at a time or
+ * via splice of the entire queue, against alf_queue (where producers
+ * wait on preceding producers to update the tail) and ptr_ring (where
+ * producers serialize on the producer_lock).
+ *
+ * The consumer runs on the first CPU in the mask, and all remaining
+ * CPUs are producers.  The producer cost is per enqueue, and the
+ * consumer cost is per dequeued element (including waiting for the
+ * producers).
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/time_bench.h>
+#include <linux/wfc_queue.h>
+#include <linux/alf_queue.h>
+#include <linux/ptr_ring.h>
+
+static int verbose=1;
+
+static int parallel_cpus = 4;
+module_param(parallel_cpus, uint, 0);
+MODULE_PARM_DESC(parallel_cpus, "Number of parallel CPUs, one consumer"
+		 " and remaining producers (default 4)");
+
+static uint32_t loops = 100000;
+module_param(loops, uint, 0);
+MODULE_PARM_DESC(loops, "Elements enqueued per producer");
+
+#define QUEUE_SIZE	4096 /* for the bounded alf_queue and ptr_ring */
+#define DEQ_BULK	16
+
+enum mpsc_type {
+	WFCQ_DEQUEUE,
+	WFCQ_SPLICE,
+	ALF_QUEUE,
+	PTR_RING,
+};
+static const char *mpsc_type_str[] = {
+	"wfcq_dequeue", "wfcq_splice", "alf_queue", "ptr_ring"
+};
+
+struct mpsc_bench {
+	enum mpsc_type type;
+	int consumer_cpu;
+	int nr_producers;
+	/* wfcq nodes per producer CPU, not reused during a run */
+	struct wfcq_node **nodes;
+	struct wfcq_head head ____cacheline_aligned_in_smp;
+	struct wfcq_tail tail ____cacheline_aligned_in_smp;
+	struct alf_queue *alf;
+	struct ptr_ring ring;
+};
+
+static __always_inline bool producer(struct mpsc_bench *b, int i, void *obj,
+				     uint64_t *retries, uint64_t max_retries)
+{
+	switch (b->type) {
+	case WFCQ_DEQUEUE:
+	case WFCQ_SPLICE:
+		/* Wait-free, and unbounded as nodes are embedded */
+		wfcq_enqueue(&b->head, &b->tail,
+			     &b->nodes[smp_processor_id()][i]);
+		return true;
+	case ALF_QUEUE:
+		while (alf_mp_enqueue(b->alf, &obj, 1) != 1) {
+			if (++(*retries) > max_retries)
+				return false;
+			cpu_relax();
+		}
+		return true;
+	case PTR_RING:
+		while (ptr_ring_produce(&b->ring, obj) < 0) {
+			if (++(*retries) > max_retries)
+				return false;
+			cpu_relax();
+		}
+		return true;
+	}
+	return false;
+}
+
+static __always_inline int consumer(struct mpsc_bench *b,
+				    struct wfcq_head *local_head,
+				    struct wfcq_tail *local_tail)
+{
+	void *objs[DEQ_BULK];
+	struct wfcq_node *node, *n;
+	int cnt = 0;
+
+	switch (b->type) {
+	case WFCQ_DEQUEUE:
+		return __wfcq_dequeue(&b->head, &b->tail) ? 1 : 0;
+	case WFCQ_SPLICE:
+		/* Grab the entire queue in O(1), and then walk it */
+		if (__wfcq_splice(local_head, local_tail,
+				  &b->head, &b->tail) == WFCQ_RET_SRC_EMPTY)
+			return 0;
+		__wfcq_for_each_safe(local_head, local_tail, node, n)
+			cnt++;
+		wfcq_init(local_head, local_tail);
+		return cnt;
+	case ALF_QUEUE:
+		return alf_sc_dequeue(b->alf, objs, DEQ_BULK);
+	case PTR_RING:
+		return ptr_ring_consume_batched(&b->ring, objs, DEQ_BULK);
+	}
+	return 0;
+}
+
+static int time_bench_mpsc(struct time_bench_record *rec, void *data)
+{
+	struct mpsc_bench *b = data;
+	struct wfcq_head local_head;
+	struct wfcq_tail local_tail;
+	uint64_t retries = 0, max_retries;
+	uint64_t loops_cnt = 0, total;
+	void *obj = (void *)(unsigned long)(rec->cpu + 1);
+	bool is_consumer = (rec->cpu == b->consumer_cpu);
+	int i, n;
+
+	/* Hack: use "step" to mark producer(1)/consumer(0) */
+	rec->step = !is_consumer;
+	max_retries = (uint64_t)rec->loops * 1000 * b->nr_producers;
+
+	if (is_consumer) {
+		wfcq_init(&local_head, &local_tail);
+		total = (uint64_t)rec->loops * b->nr_producers;
+
+		time_bench_start(rec);
+		while (loops_cnt < total) {
+			n = consumer(b, &local_head, &local_tail);
+			if (n == 0) {
+				if (++retries > max_retries)
+					break;
+				cpu_relax();
+				continue;
+			}
+			loops_cnt += n;
+		}
+		time_bench_stop(rec, loops_cnt);
+	} else {
+		time_bench_start(rec);
+		for (i = 0; i < rec->loops; i++) {
+			if (!producer(b, i, obj, &retries, max_retries))
+				break;
+			loops_cnt++;
+		}
+		time_bench_stop(rec, loops_cnt);
+	}
+	if (retries > max_retries)
+		pr_err("%s() WARN: CPU:%d gave up after %llu retries\n",
+		       __func__, rec->cpu, retries);
+
+	return loops_cnt;
+}
+
+int run_parallel(const char *desc, uint32_t loops, const cpumask_t *cpumask,
+		 int step, void *data,
+		 int (*func)(struct time_bench_record *record, void *data)
+	)
+{
+	struct time_bench_sync sync;
+	struct time_bench_cpu *cpu_tasks;
+	size_t size;
+
+	/* Allocate records for every CPU */
+	size = sizeof(*cpu_tasks) * num_possible_cpus();
+	cpu_tasks = kzalloc(size, GFP_KERNEL);
+
+	time_bench_run_concurrent(loops, step, data,
+				  cpumask, &sync, cpu_tasks, func);
+	time_bench_print_stats_cpumask(desc, cpu_tasks, cpumask);
+
+	kfree(cpu_tasks);
+	return 1;
+}
+
+static void free_nodes(struct mpsc_bench *b)
+{
+	int cpu;
+
+	if (!b->nodes)
+		return;
+	for_each_possible_cpu(cpu)
+		vfree(b->nodes[cpu]);
+	kfree(b->nodes);
+	b->nodes = NULL;
+}
+
+static bool alloc_nodes(struct mpsc_bench *b, const cpumask_t *cpumask,
+			uint32_t loops)
+{
+	int cpu, i;
+
+	b->nodes = kcalloc(nr_cpu_ids, sizeof(*b->nodes), GFP_KERNEL);
+	if (!b->nodes)
+		return false;
+	for_each_cpu(cpu, cpumask) {
+		if (cpu == b->consumer_cpu)
+			continue;
+		b->nodes[cpu] = vzalloc(sizeof(struct wfcq_node) * loops);
+		if (!b->nodes[cpu])
+			goto fail;
+		for (i = 0; i < loops; i++)
+			wfcq_node_init(&b->nodes[cpu][i]);
+	}
+	return true;
+fail:
+	free_nodes(b);
+	return false;
+}
+
+void noinline run_bench_mpsc(enum mpsc_type type, uint32_t loops,
+			     const cpumask_t *cpumask)
+{
+	struct mpsc_bench *b;
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return;
+	b->type = type;
+	b->consumer_cpu = cpumask_first(cpumask);
+	b->nr_producers = cpumask_weight(cpumask) - 1;
+
+	switch (type) {
+	case WFCQ_DEQUEUE:
+	case WFCQ_SPLICE:
+		wfcq_init(&b->head, &b->tail);
+		if (!alloc_nodes(b, cpumask, loops))
+			goto out;
+		break;
+	case ALF_QUEUE:
+		b->alf = alf_queue_alloc(QUEUE_SIZE, GFP_KERNEL);
+		if (IS_ERR_OR_NULL(b->alf))
+			goto out;
+		break;
+	case PTR_RING:
+		if (ptr_ring_init(&b->ring, QUEUE_SIZE, GFP_KERNEL) < 0)
+			goto out;
+		break;
+	}
+
+	run_parallel(mpsc_type_str[type], loops, cpumask, 0, b,
+		     time_bench_mpsc);
+
+	switch (type) {
+	case WFCQ_DEQUEUE:
+	case WFCQ_SPLICE:
+		free_nodes(b);
+		break;
+	case ALF_QUEUE:
+		alf_queue_free(b->alf);
+		break;
+	case PTR_RING:
+		/* Fake pointers left on early abort, no destructor */
+		ptr_ring_cleanup(&b->ring, NULL);
+		break;
+	}
+out:
+	kfree(b);
+}
+
+int run_benchmark_tests(void)
+{
+	cpumask_t cpumask;
+	int i;
+
+	if (parallel_cpus < 2 || parallel_cpus > num_online_cpus()) {
+		pr_err("Need 2 to %d parallel_cpus, got %d\n",
+		       num_online_cpus(), parallel_cpus);
+		return -EINVAL;
+	}
+	cpumask_clear(&cpumask);
+	for (i = 0; i < parallel_cpus; i++)
+		cpumask_set_cpu(i, &cpumask);
+
+	if (verbose)
+		pr_info("MPSC with %d producers, step = producer(1)/consumer(0)"
+			", cost per enqueue or dequeued element\n",
+			parallel_cpus - 1);
+
+	run_bench_mpsc(WFCQ_DEQUEUE, loops, &cpumask);
+	run_bench_mpsc(WFCQ_SPLICE,  loops, &cpumask);
+	run_bench_mpsc(ALF_QUEUE,    loops, &cpumask);
+	run_bench_mpsc(PTR_RING,     loops, &cpumask);
+
+	return 0;
+}
+
+static int __init wfc_queue_bench_module_init(void)
+{
+	if (verbose)
+		pr_info("Loaded\n");
+
+	if (run_benchmark_tests() < 0)
+		return -ECANCELED;
+
+	return 0;
+}
+module_init(wfc_queue_bench_module_init);
+
+static void __exit wfc_queue_bench_module_exit(void)
+{
+	if (verbose)
+		pr_info("Unloaded\n");
+}
+module_exit(wfc_queue_bench_module_exit);
+
+MODULE_DESCRIPTION("Benchmark wfc_queue MPSC against alf_queue and ptr_ring");
+MODULE_AUTHOR("Jesper Dangaard Brouer <netoptimizer@brouer.com>");
+MODULE_LICENSE("GPL");
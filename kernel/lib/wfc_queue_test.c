@@ -0,0 +1,212 @@
+/*
+ * Test module for linux/wfc_queue.h usage
+ *  Concurrent Queue with Wait-Free Enqueue/Busy-Waiting Dequeue
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/wfc_queue.h>
+
+static int verbose=1;
+
+struct my_elem {
+	int val;
+	struct wfcq_node node;
+};
+
+#define NR_ELEMS 16
+static struct my_elem elems[NR_ELEMS];
+
+static void init_elems(void)
+{
+	int i;
+
+	for (i = 0; i < NR_ELEMS; i++) {
+		elems[i].val = i;
+		wfcq_node_init(&elems[i].node);
+	}
+}
+
+/*** Basic functionality true/false test functions ***/
+
+static bool test_init_and_empty(void)
+{
+	struct wfcq_head head;
+	struct wfcq_tail tail;
+
+	wfcq_init(&head, &tail);
+	if (!wfcq_empty(&head, &tail))
+		return false;
+	if (__wfcq_dequeue(&head, &tail) != NULL)
+		return false;
+	if (__wfcq_first(&head, &tail) != NULL)
+		return false;
+	return true;
+}
+
+static bool test_enqueue_and_dequeue_fifo(void)
+{
+	struct wfcq_head head;
+	struct wfcq_tail tail;
+	struct wfcq_node *node;
+	int i;
+
+	init_elems();
+	wfcq_init(&head, &tail);
+
+	/* Enqueue return false if queue was empty */
+	if (wfcq_enqueue(&head, &tail, &elems[0].node))
+		return false;
+	for (i = 1; i < NR_ELEMS; i++)
+		if (!wfcq_enqueue(&head, &tail, &elems[i].node))
+			return false;
+
+	/* Dequeue must preserve FIFO order */
+	for (i = 0; i < NR_ELEMS; i++) {
+		node = __wfcq_dequeue(&head, &tail);
+		if (!node)
+			return false;
+		if (container_of(node, struct my_elem, node)->val != i)
+			return false;
+	}
+	if (__wfcq_dequeue(&head, &tail) != NULL)
+		return false;
+	return wfcq_empty(&head, &tail);
+}
+
+/* Dequeue the last node, concurrent enqueue-free, must leave the tail
+ * pointing at the head node, such that the queue can be reused.
+ */
+static bool test_dequeue_last_and_reuse(void)
+{
+	struct wfcq_head head;
+	struct wfcq_tail tail;
+	int i;
+
+	init_elems();
+	wfcq_init(&head, &tail);
+
+	for (i = 0; i < 3; i++) {
+		wfcq_node_init(&elems[0].node);
+		wfcq_enqueue(&head, &tail, &elems[0].node);
+		if (__wfcq_dequeue(&head, &tail) != &elems[0].node)
+			return false;
+		if (tail.p != &head.node)
+			return false;
+	}
+	return wfcq_empty(&head, &tail);
+}
+
+static bool test_splice(void)
+{
+	struct wfcq_head src_head, dst_head;
+	struct wfcq_tail src_tail, dst_tail;
+	struct wfcq_node *node;
+	enum wfcq_ret ret;
+	int i = 0;
+
+	init_elems();
+	wfcq_init(&src_head, &src_tail);
+	wfcq_init(&dst_head, &dst_tail);
+
+	/* Splice of empty source */
+	ret = __wfcq_splice(&dst_head, &dst_tail, &src_head, &src_tail);
+	if (ret != WFCQ_RET_SRC_EMPTY)
+		return false;
+
+	for (i = 0; i < NR_ELEMS / 2; i++)
+		wfcq_enqueue(&src_head, &src_tail, &elems[i].node);
+	ret = __wfcq_splice(&dst_head, &dst_tail, &src_head, &src_tail);
+	if (ret != WFCQ_RET_DEST_EMPTY)
+		return false;
+	if (!wfcq_empty(&src_head, &src_tail))
+		return false;
+
+	/* Source queue must be reusable after splice */
+	for (; i < NR_ELEMS; i++)
+		wfcq_enqueue(&src_head, &src_tail, &elems[i].node);
+	ret = __wfcq_splice(&dst_head, &dst_tail, &src_head, &src_tail);
+	if (ret != WFCQ_RET_DEST_NON_EMPTY)
+		return false;
+
+	/* Iterate: all elements in FIFO order */
+	i = 0;
+	__wfcq_for_each(&dst_head, &dst_tail, node) {
+		if (container_of(node, struct my_elem, node)->val != i)
+			return false;
+		i++;
+	}
+	return i == NR_ELEMS;
+}
+
+static bool test_for_each_safe_dequeue(void)
+{
+	struct wfcq_head head;
+	struct wfcq_tail tail;
+	struct wfcq_node *node, *n;
+	int i;
+
+	init_elems();
+	wfcq_init(&head, &tail);
+	for (i = 0; i < NR_ELEMS; i++)
+		wfcq_enqueue(&head, &tail, &elems[i].node);
+
+	/* Safe iteration allows the current node to be reused */
+	i = 0;
+	__wfcq_for_each_safe(&head, &tail, node, n) {
+		if (container_of(node, struct my_elem, node)->val != i)
+			return false;
+		wfcq_node_init(node);
+		i++;
+	}
+	return i == NR_ELEMS;
+}
+
+#define TEST_FUNC(func) 					\
+do {								\
+	if (!(func)) {						\
+		pr_info("FAILED - " #func "\n");		\
+		return -1;					\
+	} else {						\
+		if (verbose)					\
+			pr_info("PASSED - " #func "\n");	\
+		passed_count++;					\
+	}							\
+} while (0)
+
+int run_basic_tests(void)
+{
+	int passed_count = 0;
+
+	TEST_FUNC(test_init_and_empty());
+	TEST_FUNC(test_enqueue_and_dequeue_fifo());
+	TEST_FUNC(test_dequeue_last_and_reuse());
+	TEST_FUNC(test_splice());
+	TEST_FUNC(test_for_each_safe_dequeue());
+
+	return passed_count;
+}
+
+static int __init wfc_queue_test_module_init(void)
+{
+	if (verbose)
+		pr_info("Loaded\n");
+
+	if (run_basic_tests() < 0)
+		return -ECANCELED;
+
+	return 0;
+}
+module_init(wfc_queue_test_module_init);
+
+static void __exit wfc_queue_test_module_exit(void)
+{
+	if (verbose)
+		pr_info("Unloaded\n");
+}
+module_exit(wfc_queue_test_module_exit);
+
+MODULE_DESCRIPTION("Basic unit test of wfc_queue API");
+MODULE_AUTHOR("Jesper Dangaard Brouer <netoptimizer@brouer.com>");
+MODULE_LICENSE("GPL");
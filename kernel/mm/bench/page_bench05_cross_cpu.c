@@ -13,7 +13,7 @@
 #include <linux/spinlock.h>
 #include <linux/mm.h>
 #include <linux/list.h>
-#include <linux/ptr_ring.h>
+#include <linux/ptr_ring_batch.h>
 
 static int verbose=1;
 
@@ -35,6 +35,7 @@ enum benchmark_bit {
 	bit_run_bench_cross_cpu_page_alloc_put,
 	bit_run_bench_cross_cpu_page_experiment1,
 	bit_run_bench_cross_cpu_page_experiment3,
+	bit_run_bench_cross_cpu_page_alloc_put_batched,
 };
 #define bit(b)	(1 << (b))
 #define run_or_return(b) do { if (!(run_flags & (bit(b)))) return; } while (0)
@@ -52,6 +53,11 @@ static int repeat = 1;
 module_param(repeat, uint, 0);
 MODULE_PARM_DESC(repeat, "Repeating test N times (only for some tests)");
 
+#define BULK_MAX 64
+static int bulk = 16;
+module_param(bulk, uint, 0);
+MODULE_PARM_DESC(bulk, "Bulk size for batched produce/consume test");
+
 /* Most simple case for comparison */
 static int time_single_cpu_page_alloc_put(
 	struct time_bench_record *rec, void *data)
@@ -224,6 +230,92 @@ finish_early:
 	return loops_cnt;
 }
 
+/* Same as time_cross_cpu_page_alloc_put, but the enqueue side use
+ * ptr_ring_produce_batched(), taking the producer lock and doing the
+ * smp_wmb() once per bulk, and the dequeue side ptr_ring_consume_batched().
+ */
+static int time_cross_cpu_page_alloc_put_batched(
+	struct time_bench_record *rec, void *data)
+{
+	struct ptr_ring *queue = (struct ptr_ring*)data;
+	gfp_t gfp_mask = (GFP_ATOMIC | ___GFP_NORETRY);
+	struct page *pages[BULK_MAX];
+	uint64_t loops_cnt = 0;
+	int i, j, n;
+
+	bool enq_CPU = false;
+
+	/* Split CPU between enq/deq based on even/odd */
+	if ((smp_processor_id() % 2)== 0)
+		enq_CPU = true;
+
+	if (page_order) /* set: __GFP_COMP for compound pages */
+		gfp_mask |= __GFP_COMP;
+
+	/* Hack: use "step" to mark enq/deq, as "step" gets printed */
+	rec->step = enq_CPU;
+
+	if (queue == NULL) {
+		pr_err("Need queue ptr as input\n");
+		return 0;
+	}
+	/* loop count is limited to 32-bit due to div_u64_rem() use */
+	if (((uint64_t)rec->loops * 2) >= ((1ULL<<32)-1)) {
+		pr_err("Loop cnt too big will overflow 32-bit\n");
+		return 0;
+	}
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i += bulk) {
+
+		if (enq_CPU) {
+			/* enqueue side */
+			for (j = 0; j < bulk; j++) {
+				pages[j] = alloc_pages(gfp_mask, page_order);
+				/* NULL is an empty slot in ptr_ring */
+				if (!pages[j])
+					break;
+			}
+			if (j < bulk) {
+				pr_err("%s() WARN: alloc_pages failed(CPU:%d) i:%d\n",
+				       __func__, smp_processor_id(), i);
+				while (j--)
+					put_page(pages[j]);
+				goto finish_early;
+			}
+			n = ptr_ring_produce_batched(queue, (void **)pages,
+						     bulk);
+			if (n < bulk) {
+				pr_err("%s() WARN: enq fullq(CPU:%d) i:%d\n",
+				       __func__, smp_processor_id(), i);
+				for (j = n; j < bulk; j++)
+					put_page(pages[j]);
+				loops_cnt += n;
+				goto finish_early;
+			}
+		} else {
+			/* dequeue side */
+			n = ptr_ring_consume_batched(queue, (void **)pages,
+						     bulk);
+			for (j = 0; j < n; j++)
+				put_page(pages[j]);
+			if (n < bulk) {
+				pr_err("%s() WARN: deq emptyq (CPU:%d) i:%d\n",
+				       __func__, smp_processor_id(), i);
+				loops_cnt += n;
+				goto finish_early;
+			}
+		}
+		loops_cnt += bulk;
+		barrier(); /* compiler barrier */
+	}
+finish_early:
+	time_bench_stop(rec, loops_cnt);
+
+	return loops_cnt;
+}
+
 static int time_cross_cpu_page_experiment1(
 	struct time_bench_record *rec, void *data)
 {
@@ -569,6 +661,34 @@ fail:
 	kfree(queue);
 }
 
+void noinline run_bench_cross_cpu_page_alloc_put_batched(
+	uint32_t loops, int q_size, int prefill)
+{
+	struct ptr_ring *queue;
+	cpumask_t cpumask;
+
+	run_or_return(bit_run_bench_cross_cpu_page_alloc_put_batched);
+
+	queue = kzalloc(sizeof(*queue), GFP_KERNEL);
+
+	/* Restrict the CPUs to run on
+	 */
+	cpumask_clear(&cpumask);
+	cpumask_set_cpu(0, &cpumask);
+	cpumask_set_cpu(1, &cpumask);
+
+	if (!init_queue(queue, q_size, prefill, false, false))
+	    goto fail;
+
+	run_parallel("cross_cpu_page_alloc_put_batched",
+		     loops, &cpumask, 0, queue,
+		     time_cross_cpu_page_alloc_put_batched);
+
+fail:
+	ptr_ring_cleanup(queue, destructor_put_page);
+	kfree(queue);
+}
+
 void noinline run_bench_cross_cpu_page_experiment1(
 	uint32_t loops, int q_size, int prefill)
 {
@@ -672,6 +792,7 @@ int run_timing_tests(void)
 	_repeat = repeat;
 	while (repeat--)
 		run_bench_cross_cpu_page_alloc_put(loops, q_size, prefill);
+	run_bench_cross_cpu_page_alloc_put_batched(loops, q_size, prefill);
 
 	run_bench_cross_cpu_page_experiment1(loops, q_size, prefill);
 	prefill = 3200;
@@ -686,6 +807,11 @@ static int __init page_bench05_module_init(void)
 	if (verbose)
 		pr_info("Loaded (using page_order:%d)\n", page_order);
 
+	if (bulk == 0 || bulk > BULK_MAX) {
+		pr_err("Module param bulk(%d) must be 1-%d\n", bulk, BULK_MAX);
+		return -EINVAL;
+	}
+
 	if (run_timing_tests() < 0) {
 		return -ECANCELED;
 	}
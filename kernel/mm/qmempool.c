@@ -13,27 +13,57 @@
 #include <linux/percpu.h>
 #include <linux/qmempool.h>
 #include <linux/log2.h>
+#include <linux/cpu.h>
+#include <linux/cpuhotplug.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 /* Due to hotplug CPU support, we need access to all qmempools
- * in-order to cleanup elements in localq for the CPU going offline.
- *
- * TODO: implement HOTPLUG_CPU
-#ifdef CONFIG_HOTPLUG_CPU
-static LIST_HEAD(qmempool_list);
-static DEFINE_SPINLOCK(qmempool_list_lock);
-#endif
+ * in-order to cleanup elements in localq for the CPU going offline,
+ * and to allocate a localq for a CPU coming online.
  */
+static LIST_HEAD(qmempool_list);
+static DEFINE_MUTEX(qmempool_list_lock);
+static enum cpuhp_state qmempool_cpuhp_state;
+static struct dentry *qmempool_debugfs_dir;
+static atomic_t qmempool_ids = ATOMIC_INIT(0);
 
 void qmempool_destroy(struct qmempool *pool)
 {
 	void *elem = NULL;
-	int j;
+	int j, nid;
+
+	/* Waits for readers of the statistics file */
+	debugfs_remove(pool->debugfs);
+
+	/* Stop CPU hotplug callbacks from touching the pool */
+	mutex_lock(&qmempool_list_lock);
+	list_del_init(&pool->list);
+	mutex_unlock(&qmempool_list_lock);
+
+	/* Stop reclaim, the decay work is self re-arming, and queue the
+	 * per CPU work, thus cancel in that order.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	if (pool->shrinker)
+		shrinker_free(pool->shrinker);
+#else
+	if (pool->shrinker_registered)
+		unregister_shrinker(&pool->shrinker);
+#endif
+	cancel_delayed_work_sync(&pool->decay_work);
 
 	if (pool->percpu) {
 		for_each_possible_cpu(j) {
 			struct qmempool_percpu *cpu =
 				per_cpu_ptr(pool->percpu, j);
 
+			cancel_work_sync(&cpu->decay_work);
+			if (!cpu->localq)
+				continue;
 			while (alf_mc_dequeue(cpu->localq, &elem, 1) == 1)
 				kmem_cache_free(pool->kmem, elem);
 			BUG_ON(!alf_queue_empty(cpu->localq));
@@ -43,22 +73,420 @@ void qmempool_destroy(struct qmempool *pool)
 	}
 
 	if (pool->sharedq) {
-		while (alf_mc_dequeue(pool->sharedq, &elem, 1) == 1)
-			kmem_cache_free(pool->kmem, elem);
-		BUG_ON(!alf_queue_empty(pool->sharedq));
-		alf_queue_free(pool->sharedq);
+		for_each_node(nid) {
+			struct alf_queue *sharedq = pool->sharedq[nid];
+
+			if (IS_ERR_OR_NULL(sharedq))
+				continue;
+			while (alf_mc_dequeue(sharedq, &elem, 1) == 1)
+				kmem_cache_free(pool->kmem, elem);
+			BUG_ON(!alf_queue_empty(sharedq));
+			alf_queue_free(sharedq);
+		}
+		kfree(pool->sharedq);
 	}
+	kfree(pool->sharedq_idle);
 
 	kfree(pool);
 }
 EXPORT_SYMBOL(qmempool_destroy);
 
-struct qmempool *
-qmempool_create(uint32_t localq_sz, uint32_t sharedq_sz, uint32_t prealloc,
-		struct kmem_cache *kmem, gfp_t gfp_mask)
+static int qmempool_localq_alloc(struct qmempool *pool, unsigned int cpu,
+				 gfp_t gfp_mask)
+{
+	struct qmempool_percpu *c = per_cpu_ptr(pool->percpu, cpu);
+	struct alf_queue *localq;
+
+	if (c->localq) /* Still there if CPU online was aborted */
+		return 0;
+
+	localq = alf_queue_alloc(pool->localq_sz, gfp_mask);
+	if (IS_ERR_OR_NULL(localq))
+		return -ENOMEM;
+	c->bulk    = QMEMPOOL_BULK; /* localq_sz is at least a bulk */
+	c->depth   = pool->localq_sz;
+	c->refills = 0;
+	c->flushes = 0;
+	c->window_start = jiffies;
+	c->localq = localq;
+	return 0;
+}
+
+/* Reclaim handling
+ *
+ * Nothing else would return cached elements to SLAB, thus the pool can
+ * keep sharedq_sz (per node) + ncpus * localq_sz elements forever.
+ *
+ * A shrinker releases elements from the sharedq's under memory
+ * pressure.  The localq's cannot be accessed safely from a remote
+ * CPU, thus a periodic decay work detects idle queues (by comparing
+ * queue index snapshots, to avoid any fastpath cost), and queue work
+ * on the CPUs with an idle localq, which moves half of the elements
+ * to sharedq.  Idle sharedq's are halved by freeing to SLAB.
+ */
+#define QMEMPOOL_DECAY_INTERVAL (2 * HZ)
+
+/* Detect queue activity since last snapshot */
+static bool qmempool_queue_idle(struct alf_queue *q,
+				struct qmempool_snap *snap)
+{
+	u32 p_tail = READ_ONCE(q->producer.tail);
+	u32 c_head = READ_ONCE(q->consumer.head);
+	bool idle = (p_tail == snap->p_tail && c_head == snap->c_head);
+
+	snap->p_tail = p_tail;
+	snap->c_head = c_head;
+	return idle;
+}
+
+/* Protect pool internal access (outside the alloc/free API) against
+ * the pool users on this CPU, which run in softirq, or also hardirq
+ * for irqsafe pools.
+ */
+static unsigned long qmempool_protect(struct qmempool *pool)
+{
+	unsigned long flags = 0;
+
+	if (pool->irqsafe)
+		local_irq_save(flags);
+	else
+		local_bh_disable();
+	return flags;
+}
+
+static void qmempool_unprotect(struct qmempool *pool, unsigned long flags)
+{
+	if (pool->irqsafe)
+		local_irq_restore(flags);
+	else
+		local_bh_enable();
+}
+
+/* The SLAB bulk API must be called with IRQs enabled, but irqsafe
+ * pools run their slowpaths (and qmempool_protect() sections) with
+ * IRQs disabled.  Thus, irqsafe pools fall back to the single element
+ * SLAB API.
+ */
+static void qmempool_slab_free_bulk(struct qmempool *pool, int n,
+				    void **elems)
+{
+	int i;
+
+	if (!pool->irqsafe) {
+		kmem_cache_free_bulk(pool->kmem, n, elems);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		kmem_cache_free(pool->kmem, elems[i]);
+}
+
+/* Returns number of elements allocated, less than n if SLAB depleted */
+static int qmempool_slab_alloc_bulk(struct qmempool *pool, gfp_t gfp_mask,
+				    int nid, int n, void **elems)
+{
+	int i;
+
+	if (!pool->irqsafe)
+		return kmem_cache_alloc_bulk(pool->kmem, gfp_mask, n, elems);
+	for (i = 0; i < n; i++) {
+		elems[i] = kmem_cache_alloc_node(pool->kmem, gfp_mask, nid);
+		if (!elems[i])
+			break;
+	}
+	return i;
+}
+
+/* Free up to nr elements from sharedq of node nid to SLAB */
+static unsigned long qmempool_sharedq_shrink(struct qmempool *pool, int nid,
+					     unsigned long nr)
+{
+	void *elems[QMEMPOOL_BULK]; /* on stack variable */
+	unsigned long freed = 0, flags;
+	int num;
+
+	while (freed < nr) {
+		/* The sharedq is also accessed from softirq on this CPU */
+		flags = qmempool_protect(pool);
+		num = alf_mc_dequeue(pool->sharedq[nid], elems,
+				     min_t(unsigned long, nr - freed,
+					   QMEMPOOL_BULK));
+		qmempool_unprotect(pool, flags);
+		if (num <= 0)
+			break;
+		/* Process context with IRQs enabled again (decay work or
+		 * shrinker), thus the SLAB bulk API is fine for any pool.
+		 */
+		kmem_cache_free_bulk(pool->kmem, num, elems);
+		freed += num;
+	}
+	return freed;
+}
+
+/* Runs on the CPU owning localq, and disabling BH (or IRQs) protects
+ * against the softirq (or hardirq) users of localq.
+ */
+static void qmempool_localq_decay_work(struct work_struct *work)
+{
+	struct qmempool_percpu *c =
+		container_of(work, struct qmempool_percpu, decay_work);
+	struct qmempool *pool = c->pool;
+	void *elems[QMEMPOOL_BULK]; /* on stack variable */
+	struct alf_queue *sharedq;
+	int n, num, num_enq;
+	unsigned long flags;
+
+	flags = qmempool_protect(pool);
+	/* Work can run on another CPU, if its CPU went offline */
+	if (c != this_cpu_ptr(pool->percpu) || !c->localq)
+		goto out;
+
+	sharedq = pool->sharedq[numa_mem_id()];
+	n = (alf_queue_count(c->localq) + 1) / 2;
+	while (n > 0) {
+		num = alf_sc_dequeue(c->localq, elems, min(n, QMEMPOOL_BULK));
+		if (num <= 0)
+			break;
+		num_enq = alf_mp_enqueue_variable(sharedq, elems, num);
+		if (num_enq < num)
+			qmempool_slab_free_bulk(pool, num - num_enq,
+						&elems[num_enq]);
+		n -= num;
+	}
+	/* Also decay the adaptive sizing */
+	if (pool->adaptive)
+		c->depth = max(c->depth / 2, c->bulk);
+	qmempool_queue_idle(c->localq, &c->idle);
+out:
+	qmempool_unprotect(pool, flags);
+}
+
+static void qmempool_decay_work(struct work_struct *work)
+{
+	struct qmempool *pool =
+		container_of(to_delayed_work(work), struct qmempool,
+			     decay_work);
+	struct alf_queue *sharedq;
+	int cpu, nid;
+
+	cpus_read_lock();
+	for_each_online_cpu(cpu) {
+		struct qmempool_percpu *c = per_cpu_ptr(pool->percpu, cpu);
+
+		if (c->localq && qmempool_queue_idle(c->localq, &c->idle) &&
+		    !alf_queue_empty(c->localq))
+			schedule_work_on(cpu, &c->decay_work);
+	}
+	cpus_read_unlock();
+
+	for_each_node(nid) {
+		sharedq = pool->sharedq[nid];
+		if (qmempool_queue_idle(sharedq, &pool->sharedq_idle[nid]))
+			qmempool_sharedq_shrink(pool, nid,
+					(alf_queue_count(sharedq) + 1) / 2);
+	}
+
+	schedule_delayed_work(&pool->decay_work, QMEMPOOL_DECAY_INTERVAL);
+}
+
+/* Shrinker API compat.  Since v6.7 shrinkers are allocated via
+ * shrinker_alloc(), and carry a private_data pointer.  Older kernels
+ * embed the shrinker in the pool, see qmempool_shrinker_alloc().
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct qmempool *qmempool_from_shrinker(struct shrinker *shrink)
+{
+	return shrink->private_data;
+}
+#else
+static struct qmempool *qmempool_from_shrinker(struct shrinker *shrink)
+{
+	return container_of(shrink, struct qmempool, shrinker);
+}
+#endif
+
+static unsigned long qmempool_shrink_count(struct shrinker *shrink,
+					   struct shrink_control *sc)
+{
+	struct qmempool *pool = qmempool_from_shrinker(shrink);
+	unsigned long count = 0;
+	int nid;
+
+	for_each_node(nid)
+		count += alf_queue_count(pool->sharedq[nid]);
+
+	return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long qmempool_shrink_scan(struct shrinker *shrink,
+					  struct shrink_control *sc)
+{
+	struct qmempool *pool = qmempool_from_shrinker(shrink);
+	unsigned long freed = 0;
+	int nid;
+
+	for_each_node(nid) {
+		freed += qmempool_sharedq_shrink(pool, nid,
+						 sc->nr_to_scan - freed);
+		if (freed >= sc->nr_to_scan)
+			break;
+	}
+
+	/* Idle CPUs can hold elements in localq, decay them now */
+	mod_delayed_work(system_wq, &pool->decay_work, 0);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+/* Shrinker setup, before v6.7 the shrinker is embedded in the pool,
+ * and register_shrinker() takes a name since v6.0.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static int qmempool_shrinker_alloc(struct qmempool *pool)
+{
+	pool->shrinker = shrinker_alloc(0, "qmempool");
+	if (!pool->shrinker)
+		return -ENOMEM;
+	pool->shrinker->count_objects = qmempool_shrink_count;
+	pool->shrinker->scan_objects  = qmempool_shrink_scan;
+	pool->shrinker->private_data  = pool;
+	return 0;
+}
+
+static int qmempool_shrinker_register(struct qmempool *pool)
+{
+	shrinker_register(pool->shrinker);
+	return 0;
+}
+#else
+static int qmempool_shrinker_alloc(struct qmempool *pool)
+{
+	pool->shrinker.count_objects = qmempool_shrink_count;
+	pool->shrinker.scan_objects  = qmempool_shrink_scan;
+	pool->shrinker.seeks         = DEFAULT_SEEKS;
+	return 0;
+}
+
+static int qmempool_shrinker_register(struct qmempool *pool)
+{
+	int err;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	err = register_shrinker(&pool->shrinker, "qmempool");
+#else
+	err = register_shrinker(&pool->shrinker);
+#endif
+	if (!err)
+		pool->shrinker_registered = true;
+	return err;
+}
+#endif
+
+/* Statistics, exported per pool via debugfs as qmempool/poolN
+ *
+ * The per CPU counters are read without synchronization, thus the
+ * numbers are approximate while the pool is in use.  The queue
+ * occupancy is read under qmempool_list_lock, which keeps CPU hotplug
+ * from freeing a localq under us.  The cmpxchg failures (retries) are
+ * counted by the sharedq itself, see alf_actor_retry().
+ */
+static unsigned int qmempool_hit_pct(unsigned long hit, unsigned long miss)
+{
+	if (hit + miss == 0)
+		return 0;
+	return div64_u64((u64)hit * 100, (u64)hit + miss);
+}
+
+static int qmempool_stats_show(struct seq_file *m, void *v)
+{
+	struct qmempool *pool = m->private;
+	struct qmempool_stats sum = {};
+	int j, nid;
+
+	mutex_lock(&qmempool_list_lock);
+	seq_printf(m, "localq_sz:%u numa:%d adaptive:%d\n",
+		   pool->localq_sz, pool->numa, pool->adaptive);
+
+	seq_printf(m, "%4s %6s %5s %4s %12s %12s %4s %12s %12s %4s"
+		   " %10s %10s %10s %10s %10s\n", "cpu", "localq", "depth",
+		   "bulk", "alloc_hit", "alloc_miss", "hit%", "free_hit",
+		   "free_miss", "hit%", "refill", "flush", "slab_alloc",
+		   "slab_free", "remote");
+	for_each_possible_cpu(j) {
+		struct qmempool_percpu *cpu = per_cpu_ptr(pool->percpu, j);
+		struct qmempool_stats st = cpu->stat;
+
+		sum.alloc_hit  += st.alloc_hit;
+		sum.alloc_miss += st.alloc_miss;
+		sum.free_hit   += st.free_hit;
+		sum.free_miss  += st.free_miss;
+		sum.refill     += st.refill;
+		sum.flush      += st.flush;
+		sum.slab_alloc += st.slab_alloc;
+		sum.slab_free  += st.slab_free;
+		sum.remote     += st.remote;
+
+		if (!cpu->localq)
+			continue;
+		seq_printf(m, "%4d %6u %5u %4u %12lu %12lu %4u %12lu %12lu %4u"
+			   " %10lu %10lu %10lu %10lu %10lu\n",
+			   j, alf_queue_count(cpu->localq), cpu->depth,
+			   cpu->bulk, st.alloc_hit, st.alloc_miss,
+			   qmempool_hit_pct(st.alloc_hit, st.alloc_miss),
+			   st.free_hit, st.free_miss,
+			   qmempool_hit_pct(st.free_hit, st.free_miss),
+			   st.refill, st.flush, st.slab_alloc,
+			   st.slab_free, st.remote);
+	}
+	seq_printf(m, "%4s %6s %5s %4s %12lu %12lu %4u %12lu %12lu %4u"
+		   " %10lu %10lu %10lu %10lu %10lu\n",
+		   "all", "-", "-", "-", sum.alloc_hit, sum.alloc_miss,
+		   qmempool_hit_pct(sum.alloc_hit, sum.alloc_miss),
+		   sum.free_hit, sum.free_miss,
+		   qmempool_hit_pct(sum.free_hit, sum.free_miss),
+		   sum.refill, sum.flush, sum.slab_alloc,
+		   sum.slab_free, sum.remote);
+
+	seq_printf(m, "%4s %8s %8s %12s %12s\n", "node", "sharedq",
+		   "size", "enq_retries", "deq_retries");
+	for_each_node(nid) {
+		struct alf_queue *sharedq = pool->sharedq[nid];
+
+		seq_printf(m, "%4d %8u %8u %12u %12u\n", nid,
+			   alf_queue_count(sharedq), sharedq->size,
+			   READ_ONCE(sharedq->producer.retries),
+			   READ_ONCE(sharedq->consumer.retries));
+	}
+	mutex_unlock(&qmempool_list_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(qmempool_stats);
+
+/* Elements entering the pool from SLAB are constructed once, by the
+ * optional ctor.  The optional reset callback is applied on every
+ * alloc (lazily, instead of on free), as the element is about to be
+ * touched by the caller anyhow.  A reset also runs after the ctor,
+ * for elements handed out directly from SLAB.
+ */
+static inline void qmempool_ctor_bulk(struct qmempool *pool, void **elems,
+				      int n)
+{
+	int i;
+
+	if (!pool->ctor)
+		return;
+	for (i = 0; i < n; i++)
+		pool->ctor(elems[i]);
+}
+
+static struct qmempool *
+__qmempool_create(uint32_t localq_sz, uint32_t sharedq_sz, uint32_t prealloc,
+		  struct kmem_cache *kmem, gfp_t gfp_mask,
+		  void (*ctor)(void *elem), void (*reset)(void *elem),
+		  bool irqsafe)
 {
 	struct qmempool *pool;
-	int i, j, num;
+	int i, j, nid, num;
+	char name[16];
 	void *elem;
 
 	/* Validate constraints, e.g. due to bulking */
@@ -94,29 +522,58 @@ qmempool_create(uint32_t localq_sz, uint32_t sharedq_sz, uint32_t prealloc,
 	pool = kzalloc(sizeof(*pool), gfp_mask);
 	if (!pool)
 		return NULL;
-	pool->kmem     = kmem;
-	pool->gfp_mask = gfp_mask;
-
-	/* MPMC (Multi-Producer-Multi-Consumer) queue */
-	pool->sharedq = alf_queue_alloc(sharedq_sz, gfp_mask);
-	if (IS_ERR_OR_NULL(pool->sharedq)) {
-		pr_err("%s() failed to create shared queue(%d) ERR_PTR:0x%p\n",
-		       __func__, sharedq_sz, pool->sharedq);
+	INIT_LIST_HEAD(&pool->list);
+	INIT_DELAYED_WORK(&pool->decay_work, qmempool_decay_work);
+	pool->kmem      = kmem;
+	pool->gfp_mask  = gfp_mask;
+	pool->localq_sz = localq_sz;
+
+	pool->numa     = num_node_state(N_MEMORY) > 1;
+	pool->adaptive = true;
+	pool->prefetch = true;
+	pool->ctor     = ctor;
+	pool->reset    = reset;
+	pool->irqsafe  = irqsafe;
+
+	/* MPMC (Multi-Producer-Multi-Consumer) queue per NUMA node */
+	pool->sharedq = kcalloc(nr_node_ids, sizeof(*pool->sharedq), gfp_mask);
+	if (!pool->sharedq) {
 		qmempool_destroy(pool);
 		return NULL;
 	}
-
-	pool->prealloc = prealloc;
-	for (i = 0; i < prealloc; i++) {
-		elem = kmem_cache_alloc(pool->kmem, gfp_mask);
-		if (!elem) {
-			pr_err("%s() kmem_cache out of memory?!\n",  __func__);
+	for_each_node(nid) {
+		pool->sharedq[nid] = alf_queue_alloc(sharedq_sz, gfp_mask);
+		if (IS_ERR_OR_NULL(pool->sharedq[nid])) {
+			pr_err("%s() failed to create shared queue(%d) node:%d"
+			       " ERR_PTR:0x%p\n", __func__, sharedq_sz, nid,
+			       pool->sharedq[nid]);
 			qmempool_destroy(pool);
 			return NULL;
 		}
-		/* Could use the SP version given it is not visible yet */
-		num = alf_mp_enqueue(pool->sharedq, &elem, 1);
-		BUG_ON(num <= 0);
+	}
+
+	/* Prealloc per node, on nodes having memory */
+	pool->prealloc = prealloc;
+	for_each_node_state(nid, N_MEMORY) {
+		for (i = 0; i < prealloc; i++) {
+			elem = kmem_cache_alloc_node(pool->kmem, gfp_mask, nid);
+			if (!elem) {
+				pr_err("%s() kmem_cache out of memory?!\n",
+				       __func__);
+				qmempool_destroy(pool);
+				return NULL;
+			}
+			qmempool_ctor_bulk(pool, &elem, 1);
+			/* Slab can fallback to another node, keep elem
+			 * on its home node.  Could use the SP version
+			 * given it is not visible yet.
+			 */
+			num = alf_mp_enqueue(
+				pool->sharedq[qmempool_elem_node(elem)],
+				&elem, 1);
+			if (num <= 0)
+				kmem_cache_free(pool->kmem, elem);
+		}
 	}
 
 	pool->percpu = alloc_percpu(struct qmempool_percpu);
@@ -125,157 +582,305 @@ qmempool_create(uint32_t localq_sz, uint32_t sharedq_sz, uint32_t prealloc,
 		qmempool_destroy(pool);
 		return NULL;
 	}
-
-	/* SPSC (Single-Consumer-Single-Producer) queue per CPU */
 	for_each_possible_cpu(j) {
 		struct qmempool_percpu *cpu = per_cpu_ptr(pool->percpu, j);
 
-		cpu->localq = alf_queue_alloc(localq_sz, gfp_mask);
-		if (IS_ERR_OR_NULL(cpu->localq)) {
+		cpu->pool = pool;
+		INIT_WORK(&cpu->decay_work, qmempool_localq_decay_work);
+	}
+
+	pool->sharedq_idle = kcalloc(nr_node_ids, sizeof(*pool->sharedq_idle),
+				     gfp_mask);
+	if (!pool->sharedq_idle) {
+		qmempool_destroy(pool);
+		return NULL;
+	}
+	if (qmempool_shrinker_alloc(pool)) {
+		pr_err("%s() failed to alloc shrinker\n", __func__);
+		qmempool_destroy(pool);
+		return NULL;
+	}
+
+	/* SPSC (Single-Consumer-Single-Producer) queue per online CPU,
+	 * CPUs coming online later get their localq via CPU hotplug.
+	 */
+	cpus_read_lock();
+	for_each_online_cpu(j) {
+		if (qmempool_localq_alloc(pool, j, gfp_mask)) {
 			pr_err("%s() failed alloc localq(sz:%d) on cpu:%d\n",
 			       __func__, localq_sz, j);
+			cpus_read_unlock();
 			qmempool_destroy(pool);
 			return NULL;
 		}
 	}
+	mutex_lock(&qmempool_list_lock);
+	list_add(&pool->list, &qmempool_list);
+	mutex_unlock(&qmempool_list_lock);
+	cpus_read_unlock();
 
+	if (qmempool_shrinker_register(pool)) {
+		pr_err("%s() failed to register shrinker\n", __func__);
+		qmempool_destroy(pool);
+		return NULL;
+	}
+	schedule_delayed_work(&pool->decay_work, QMEMPOOL_DECAY_INTERVAL);
+
+	snprintf(name, sizeof(name), "pool%d",
+		 atomic_inc_return(&qmempool_ids));
+	pool->debugfs = debugfs_create_file(name, 0444, qmempool_debugfs_dir,
+					    pool, &qmempool_stats_fops);
 	return pool;
 }
+
+struct qmempool *
+qmempool_create(uint32_t localq_sz, uint32_t sharedq_sz, uint32_t prealloc,
+		struct kmem_cache *kmem, gfp_t gfp_mask)
+{
+	return __qmempool_create(localq_sz, sharedq_sz, prealloc, kmem,
+				 gfp_mask, NULL, NULL, false);
+}
 EXPORT_SYMBOL(qmempool_create);
 
+struct qmempool *
+qmempool_create_ctor(uint32_t localq_sz, uint32_t sharedq_sz,
+		     uint32_t prealloc, struct kmem_cache *kmem,
+		     gfp_t gfp_mask, void (*ctor)(void *elem),
+		     void (*reset)(void *elem))
+{
+	return __qmempool_create(localq_sz, sharedq_sz, prealloc, kmem,
+				 gfp_mask, ctor, reset, false);
+}
+EXPORT_SYMBOL(qmempool_create_ctor);
+
+/* A hardirq-safe pool, which MUST only be accessed via the "_irq"
+ * alloc/free API, see qmempool.h.
+ */
+struct qmempool *
+qmempool_create_irqsafe(uint32_t localq_sz, uint32_t sharedq_sz,
+			uint32_t prealloc, struct kmem_cache *kmem,
+			gfp_t gfp_mask)
+{
+	return __qmempool_create(localq_sz, sharedq_sz, prealloc, kmem,
+				 gfp_mask, NULL, NULL, true);
+}
+EXPORT_SYMBOL(qmempool_create_irqsafe);
+
 /* Element handling
  */
 
-/* This function is called when sharedq runs-out of elements.
- * Thus, sharedq needs to be refilled (enq) with elems from slab.
+/* Adaptive per CPU sizing, driven by the observed slowpath events.
  *
- * Caller must assure this is called in an preemptive safe context due
- * to alf_mp_enqueue() call.
+ * Every QMEMPOOL_ADAPT_EVENTS slowpath events (localq refills and
+ * flushes), the bulk size and localq depth is adjusted:
+ *  - Events are rare (window longer than a second): shrink, as a
+ *    big localq only hoards memory.
+ *  - Both refills and flushes: the alloc/free bursts are larger than
+ *    what localq absorbs, and it thrash sharedq: grow.
+ *  - Only refills or only flushes: a one directional flow (alloc and
+ *    free on different CPUs), caching cannot help, but a larger bulk
+ *    amortize the sharedq cmpxchg better: grow bulk only.
  */
-void *__qmempool_alloc_from_slab(struct qmempool *pool, gfp_t gfp_mask)
+#define QMEMPOOL_ADAPT_EVENTS 16
+
+static void __qmempool_adapt(struct qmempool *pool,
+			     struct qmempool_percpu *cpu)
 {
-	void *elems[QMEMPOOL_BULK]; /* on stack variable */
-	void *elem;
-	int num, i, j;
+	unsigned int bulk_max = min_t(unsigned int, QMEMPOOL_BULK_MAX,
+				      pool->localq_sz);
+	unsigned long now = jiffies;
 
-	/* Cannot use SLAB that can sleep if (gfp_mask & __GFP_WAIT),
-	 * else preemption disable/enable scheme becomes too complicated
-	 */
+	if (cpu->refills + cpu->flushes < QMEMPOOL_ADAPT_EVENTS)
+		return;
+
+	if (time_after(now, cpu->window_start + HZ)) {
+		cpu->bulk  = max_t(unsigned int, cpu->bulk / 2,
+				   QMEMPOOL_BULK_MIN);
+		cpu->depth = max(cpu->depth / 2, cpu->bulk);
+	} else if (cpu->refills && cpu->flushes) {
+		cpu->bulk  = min(cpu->bulk * 2, bulk_max);
+		cpu->depth = min(cpu->depth * 2, pool->localq_sz);
+	} else {
+		cpu->bulk  = min(cpu->bulk * 2, bulk_max);
+	}
+	/* Localq must hold at least a bulk */
+	cpu->depth = max(cpu->depth, cpu->bulk);
+
+	cpu->refills = 0;
+	cpu->flushes = 0;
+	cpu->window_start = now;
+}
+
+/* Called when sharedq is full.  Free the "elems" given, to SLAB, and
+ * make room in sharedq for next round.
+ */
+static void __qmempool_free_to_slab(struct qmempool *pool, void **elems,
+				    int n, struct alf_queue *sharedq)
+{
+	void *flush[QMEMPOOL_BULK]; /* on stack variable */
+	int num, i;
+
+	/* free these elements for real */
+	qmempool_slab_free_bulk(pool, n, elems);
+
+	/* Make room in sharedq for next round */
+	for (i = 0; i < QMEMPOOL_REFILL_MULTIPLIER; i++) {
+		num = alf_mc_dequeue(sharedq, flush, QMEMPOOL_BULK);
+		if (num > 0)
+			qmempool_slab_free_bulk(pool, num, flush);
+	}
+}
+
+/* Cannot use SLAB that can sleep if (gfp_mask & __GFP_WAIT),
+ * else preemption disable/enable scheme becomes too complicated
+ */
+static inline void __qmempool_check_gfp(gfp_t gfp_mask)
+{
 #ifdef __GFP_WAIT
 	BUG_ON(gfp_mask & __GFP_WAIT);
 #else
 	/* 71baba4b92d ("mm, page_alloc: rename __GFP_WAIT to __GFP_RECLAIM") */
 	BUG_ON(gfp_mask & __GFP_DIRECT_RECLAIM);
 #endif
+}
+
+/* This function is called when sharedq runs-out of elements.
+ * Thus, sharedq needs to be refilled (enq) with elems from slab.
+ *
+ * Several CPUs can run out and refill sharedq concurrently, thus
+ * sharedq can become full while refilling.  Elements not fitting in
+ * sharedq are used for refilling the (empty) localq, and the rest is
+ * returned to SLAB.  The first element is handed out directly.
+ *
+ * Caller must assure this is called in an preemptive safe context due
+ * to alf_mp_enqueue() call.
+ */
+static void *__qmempool_alloc_from_slab(struct qmempool *pool, gfp_t gfp_mask,
+					int nid, struct qmempool_percpu *cpu)
+{
+	struct alf_queue *sharedq = pool->sharedq[nid];
+	struct alf_queue *localq = cpu->localq;
+	void *elems[QMEMPOOL_BULK_MAX]; /* on stack variable */
+	void *elem;
+	int num, num_enq, space, i;
+
+	__qmempool_check_gfp(gfp_mask);
+	cpu->stat.slab_alloc++;
 
-	elem = kmem_cache_alloc(pool->kmem, gfp_mask);
+	/* Refill from node local memory */
+	elem = kmem_cache_alloc_node(pool->kmem, gfp_mask, nid);
 	if (elem == NULL) /* slab depleted, no reason to call below allocs */
 		return NULL;
+	qmempool_ctor_bulk(pool, &elem, 1);
 
-	/* SLAB considerations, we need a kmem_cache interface that
-	 * supports allocating a bulk of elements.
+	/* Refill sharedq via the SLAB bulk API.  The bulk API allocates
+	 * from the local node, which is the node (nid) being refilled.
 	 */
-
 	for (i = 0; i < QMEMPOOL_REFILL_MULTIPLIER; i++) {
-		for (j = 0; j < QMEMPOOL_BULK; j++) {
-			elems[j] = kmem_cache_alloc(pool->kmem, gfp_mask);
-			/* Handle if slab gives us NULL elem */
-			if (elems[j] == NULL) {
-				pr_err("%s() ARGH - slab returned NULL",
-				       __func__);
-				num = alf_mp_enqueue(pool->sharedq, elems, j-1);
-				BUG_ON(num == 0); //FIXME handle
-				return elem;
-			}
+		num = qmempool_slab_alloc_bulk(pool, gfp_mask, nid,
+					       cpu->bulk, elems);
+		if (unlikely(num <= 0)) /* slab depleted */
+			break;
+		qmempool_ctor_bulk(pool, elems, num);
+
+		num_enq = alf_mp_enqueue_variable(sharedq, elems, num);
+		if (likely(num_enq == num)) {
+			if (unlikely(num < cpu->bulk))
+				break; /* partial success, slab depleted */
+			continue;
 		}
-		num = alf_mp_enqueue(pool->sharedq, elems, QMEMPOOL_BULK);
-		/* FIXME: There is a theoretical chance that multiple
-		 * CPU enter here, refilling sharedq at the same time,
-		 * thus we must handle "full" situation, for now die
-		 * hard so someone will need to fix this.
+
+		/* Concurrent refill filled up sharedq.  Overflow goes
+		 * to localq (we are the only producer), rest to SLAB.
 		 */
-		BUG_ON(num == 0); /* sharedq should have room */
+		num -= num_enq;
+		space = min(alf_queue_avail_space(localq), num);
+		if (space > 0 &&
+		    alf_sp_enqueue(localq, &elems[num_enq], space) == space) {
+			num_enq += space;
+			num -= space;
+		}
+		if (num > 0) {
+			cpu->stat.slab_free += num;
+			qmempool_slab_free_bulk(pool, num, &elems[num_enq]);
+		}
+		break;
 	}
 
-	/* What about refilling localq here? (else it will happen on
-	 * next cycle, and will cost an extra cmpxchg).
-	 */
 	return elem;
 }
 
 /* This function is called when the localq runs out-of elements.
- * Thus, localq is refilled (enq) with elements (deq) from sharedq.
+ * Thus, localq is refilled (enq) with elements (deq) from the sharedq
+ * of the local NUMA node.
  *
  * Caller must assure this is called in an preemptive safe context due
  * to alf_mp_dequeue() call.
  */
 void *__qmempool_alloc_from_sharedq(struct qmempool *pool, gfp_t gfp_mask,
-				    struct alf_queue *localq)
+				    struct qmempool_percpu *cpu)
 {
-	void *elems[QMEMPOOL_BULK]; /* on stack variable */
+	struct alf_queue *localq = cpu->localq;
+	void *elems[QMEMPOOL_BULK_MAX]; /* on stack variable */
+	int nid = numa_mem_id();
 	void *elem;
 	int num;
 
+	cpu->stat.alloc_miss++;
+	if (pool->adaptive) {
+		cpu->refills++;
+		__qmempool_adapt(pool, cpu);
+	}
+
 	/* Costs atomic "cmpxchg", but amortize cost by bulk dequeue */
-	num = alf_mc_dequeue(pool->sharedq, elems, QMEMPOOL_BULK);
+	num = alf_mc_dequeue(pool->sharedq[nid], elems, cpu->bulk);
 	if (likely(num > 0)) {
-		/* Consider prefetching data part of elements here, it
-		 * should be an optimal place to hide memory prefetching.
-		 * Especially given the localq is known to be an empty FIFO
-		 * which guarantees the order objs are accessed in.
+		cpu->stat.refill++;
+		/* The localq is known to be an empty FIFO, thus elems[1]
+		 * is the next element handed out.  The fastpath takes
+		 * care of prefetching the following ones.
 		 */
 		elem = elems[0]; /* extract one element */
+		if (pool->prefetch && num > 1)
+			prefetchw(elems[1]);
 		if (num > 1) {
-			num = alf_sp_enqueue(localq, &elems[1], num-1);
 			/* Refill localq, should be empty, must succeed */
-			BUG_ON(num == 0);
+			if (WARN_ON_ONCE(alf_sp_enqueue(localq, &elems[1],
+							num-1) != num-1))
+				qmempool_slab_free_bulk(pool, num-1, &elems[1]);
 		}
 		return elem;
 	}
 	/* Use slab if sharedq runs out of elements */
-	elem = __qmempool_alloc_from_slab(pool, gfp_mask);
+	elem = __qmempool_alloc_from_slab(pool, gfp_mask, nid, cpu);
 	return elem;
 }
 EXPORT_SYMBOL(__qmempool_alloc_from_sharedq);
 
-/* Called when sharedq is full. Thus also make room in sharedq,
- * besides also freeing the "elems" given.
- */
-bool __qmempool_free_to_slab(struct qmempool *pool, void **elems, int n)
-{
-	int num, i, j;
-	/* SLAB considerations, we could use kmem_cache interface that
-	 * supports returning a bulk of elements.
-	 */
-
-	/* free these elements for real */
-	for (i = 0; i < n; i++)
-		kmem_cache_free(pool->kmem, elems[i]);
-
-	/* Make room in sharedq for next round */
-	for (i = 0; i < QMEMPOOL_REFILL_MULTIPLIER; i++) {
-		num = alf_mc_dequeue(pool->sharedq, elems, QMEMPOOL_BULK);
-		for (j = 0; j < num; j++)
-			kmem_cache_free(pool->kmem, elems[j]);
-	}
-	return true;
-}
-
-/* This function is called when the localq is full. Thus, elements
- * from localq needs to be (dequeued) and returned (enqueued) to
- * sharedq (or if shared is full, need to be free'ed to slab)
+/* This function is called when the localq is full (reached its
+ * depth). Thus, elements from localq needs to be (dequeued) and
+ * returned (enqueued) to sharedq (or if shared is full, need to be
+ * free'ed to slab)
  *
  * MUST be called from a preemptive safe context.
  */
 void __qmempool_free_to_sharedq(void *elem, struct qmempool *pool,
-				struct alf_queue *localq)
+				struct qmempool_percpu *cpu)
 {
-	void *elems[QMEMPOOL_BULK]; /* on stack variable */
+	struct alf_queue *sharedq = pool->sharedq[numa_mem_id()];
+	void *elems[QMEMPOOL_BULK_MAX]; /* on stack variable */
 	int num_enq, num_deq;
 
+	cpu->stat.free_miss++;
+	cpu->stat.flush++;
+	if (pool->adaptive) {
+		cpu->flushes++;
+		__qmempool_adapt(pool, cpu);
+	}
+
 	elems[0] = elem;
 	/* Make room in localq */
-	num_deq = alf_sc_dequeue(localq, &elems[1], QMEMPOOL_BULK-1);
+	num_deq = alf_sc_dequeue(cpu->localq, &elems[1], cpu->bulk - 1);
 	if (unlikely(num_deq == 0))
 		goto failed;
 	num_deq++; /* count first 'elem' */
@@ -283,19 +888,16 @@ void __qmempool_free_to_sharedq(void *elem, struct qmempool *pool,
 	/* Successful dequeued 'num_deq' elements from localq, "free"
 	 * these elems by enqueuing to sharedq
 	 */
-	num_enq = alf_mp_enqueue(pool->sharedq, elems, num_deq);
+	num_enq = alf_mp_enqueue_variable(sharedq, elems, num_deq);
 	if (likely(num_enq == num_deq)) /* Success enqueued to sharedq */
 		return;
 
-	/* If sharedq is full (num_enq == 0) dequeue elements will be
+	/* If sharedq is full, the elements that did not fit are
 	 * returned directly to the SLAB allocator.
-	 *
-	 * Note: This usage of alf_queue API depend on enqueue is
-	 * fixed, by only enqueueing if all elements could fit, this
-	 * is an API that might change.
 	 */
-
-	__qmempool_free_to_slab(pool, elems, num_deq);
+	cpu->stat.slab_free += num_deq - num_enq;
+	__qmempool_free_to_slab(pool, &elems[num_enq], num_deq - num_enq,
+				sharedq);
 	return;
 failed:
 	/* dequeing from a full localq should always be possible */
@@ -303,6 +905,159 @@ failed:
 }
 EXPORT_SYMBOL(__qmempool_free_to_sharedq);
 
+/* Free of an element belonging to a remote NUMA node (nid).  Return
+ * it to the sharedq of its home node, or to SLAB if that is full.
+ *
+ * MUST be called from a preemptive safe context.
+ */
+void __qmempool_free_remote(void *elem, struct qmempool *pool, int nid)
+{
+	this_cpu_ptr(pool->percpu)->stat.remote++;
+	if (alf_mp_enqueue(pool->sharedq[nid], &elem, 1) != 1)
+		kmem_cache_free(pool->kmem, elem);
+}
+EXPORT_SYMBOL(__qmempool_free_remote);
+
+/* Bulk alloc slowpath, called when localq could not deliver all
+ * 'n' elements.  The remaining elements are dequeued from sharedq
+ * directly into the callers array, amortizing a single cmpxchg over
+ * the whole request, without going through localq.  What sharedq
+ * cannot deliver is allocated via the SLAB bulk API.
+ *
+ * Returns number of elements stored in ptrs, which is less than 'n'
+ * when SLAB is depleted.
+ *
+ * MUST be called from a preemptive safe context.
+ */
+int __qmempool_alloc_bulk_from_sharedq(struct qmempool *pool, gfp_t gfp_mask,
+				       struct qmempool_percpu *cpu,
+				       int n, void **ptrs)
+{
+	int num;
+
+	cpu->stat.refill++;
+	num = alf_mc_dequeue(pool->sharedq[numa_mem_id()], ptrs, n);
+	if (likely(num == n))
+		return n;
+
+	__qmempool_check_gfp(gfp_mask);
+	cpu->stat.slab_alloc++;
+	n = num + qmempool_slab_alloc_bulk(pool, gfp_mask, numa_mem_id(),
+					   n - num, &ptrs[num]);
+	qmempool_ctor_bulk(pool, &ptrs[num], n - num);
+	return n;
+}
+EXPORT_SYMBOL(__qmempool_alloc_bulk_from_sharedq);
+
+/* Bulk free slowpath, called when the 'n' elements did not fit into
+ * localq, or the pool spans several NUMA nodes.  Remote node elements
+ * are returned to their home node, and the local elements are
+ * enqueued to localq if it has room, else to sharedq in one go.  The
+ * elements not fitting in sharedq are returned to SLAB.
+ *
+ * The content of the ptrs array is modified.
+ *
+ * MUST be called from a preemptive safe context.
+ */
+void __qmempool_free_bulk_to_sharedq(struct qmempool *pool,
+				     struct qmempool_percpu *cpu,
+				     int n, void **ptrs)
+{
+	int nid = numa_mem_id();
+	struct alf_queue *sharedq = pool->sharedq[nid];
+	int num_enq, i, j, elem_nid;
+
+	if (pool->numa) {
+		/* Compact array to the local node elements */
+		for (i = 0, j = 0; i < n; i++) {
+			elem_nid = qmempool_elem_node(ptrs[i]);
+			if (unlikely(elem_nid != nid))
+				__qmempool_free_remote(ptrs[i], pool, elem_nid);
+			else
+				ptrs[j++] = ptrs[i];
+		}
+		n = j;
+		if (n == 0)
+			return;
+		if (alf_queue_count(cpu->localq) + n <= cpu->depth &&
+		    alf_sp_enqueue(cpu->localq, ptrs, n) == n) {
+			cpu->stat.free_hit += n;
+			return;
+		}
+	}
+
+	cpu->stat.free_miss += n;
+	cpu->stat.flush++;
+	num_enq = alf_mp_enqueue_variable(sharedq, ptrs, n);
+	if (likely(num_enq == n))
+		return;
+	cpu->stat.slab_free += n - num_enq;
+	__qmempool_free_to_slab(pool, &ptrs[num_enq], n - num_enq, sharedq);
+}
+EXPORT_SYMBOL(__qmempool_free_bulk_to_sharedq);
+
+/* CPU hotplug handling
+ *
+ * Both callbacks run on a control CPU, while the CPU in question is
+ * not running (before online, or after it died).  Thus, nobody else
+ * is accessing its localq.
+ */
+
+/* Drain localq of a dead CPU into sharedq of its node (or SLAB if
+ * full), and release the localq.
+ */
+static void qmempool_localq_drain(struct qmempool *pool, unsigned int cpu)
+{
+	struct qmempool_percpu *c = per_cpu_ptr(pool->percpu, cpu);
+	struct alf_queue *sharedq = pool->sharedq[cpu_to_mem(cpu)];
+	struct alf_queue *localq = c->localq;
+	void *elems[QMEMPOOL_BULK]; /* on stack variable */
+	unsigned long flags;
+	int num, i;
+
+	if (!localq)
+		return;
+	c->localq = NULL;
+
+	/* The sharedq is also accessed from softirq on this CPU */
+	flags = qmempool_protect(pool);
+	while ((num = alf_mc_dequeue(localq, elems, QMEMPOOL_BULK)) > 0) {
+		if (alf_mp_enqueue(sharedq, elems, num) == num)
+			continue;
+		for (i = 0; i < num; i++)
+			kmem_cache_free(pool->kmem, elems[i]);
+	}
+	qmempool_unprotect(pool, flags);
+
+	alf_queue_free(localq);
+}
+
+static int qmempool_cpu_prepare(unsigned int cpu)
+{
+	struct qmempool *pool;
+	int ret = 0;
+
+	mutex_lock(&qmempool_list_lock);
+	list_for_each_entry(pool, &qmempool_list, list) {
+		ret = qmempool_localq_alloc(pool, cpu, GFP_KERNEL);
+		if (ret)
+			break;
+	}
+	mutex_unlock(&qmempool_list_lock);
+	return ret;
+}
+
+static int qmempool_cpu_dead(unsigned int cpu)
+{
+	struct qmempool *pool;
+
+	mutex_lock(&qmempool_list_lock);
+	list_for_each_entry(pool, &qmempool_list, list)
+		qmempool_localq_drain(pool, cpu);
+	mutex_unlock(&qmempool_list_lock);
+	return 0;
+}
+
 /* API users can choose to use "__" prefixed versions for inlining */
 void *qmempool_alloc(struct qmempool *pool, gfp_t gfp_mask)
 {
@@ -328,6 +1083,57 @@ void qmempool_free_softirq(struct qmempool *pool, void *elem)
 }
 EXPORT_SYMBOL(qmempool_free_softirq);
 
+int qmempool_alloc_bulk(struct qmempool *pool, gfp_t gfp_mask, int n,
+			void **ptrs)
+{
+	return __qmempool_alloc_bulk(pool, gfp_mask, n, ptrs);
+}
+EXPORT_SYMBOL(qmempool_alloc_bulk);
+
+void qmempool_free_bulk(struct qmempool *pool, int n, void **ptrs)
+{
+	__qmempool_free_bulk(pool, n, ptrs);
+}
+EXPORT_SYMBOL(qmempool_free_bulk);
+
+void *qmempool_alloc_irq(struct qmempool *pool, gfp_t gfp_mask)
+{
+	return __qmempool_alloc_irq(pool, gfp_mask);
+}
+EXPORT_SYMBOL(qmempool_alloc_irq);
+
+void qmempool_free_irq(struct qmempool *pool, void *elem)
+{
+	__qmempool_free_irq(pool, elem);
+}
+EXPORT_SYMBOL(qmempool_free_irq);
+
+static int __init qmempool_module_init(void)
+{
+	int ret;
+
+	qmempool_debugfs_dir = debugfs_create_dir("qmempool", NULL);
+
+	ret = cpuhp_setup_state_nocalls(CPUHP_BP_PREPARE_DYN,
+					"mm/qmempool:prepare",
+					qmempool_cpu_prepare,
+					qmempool_cpu_dead);
+	if (ret < 0) {
+		debugfs_remove_recursive(qmempool_debugfs_dir);
+		return ret;
+	}
+	qmempool_cpuhp_state = ret;
+	return 0;
+}
+module_init(qmempool_module_init);
+
+static void __exit qmempool_module_exit(void)
+{
+	cpuhp_remove_state_nocalls(qmempool_cpuhp_state);
+	debugfs_remove_recursive(qmempool_debugfs_dir);
+}
+module_exit(qmempool_module_exit);
+
 MODULE_DESCRIPTION("Quick queue based mempool (qmempool)");
 MODULE_AUTHOR("Jesper Dangaard Brouer <netoptimizer@brouer.com>");
 MODULE_LICENSE("GPL");
@@ -22,10 +22,17 @@ static void print_qstats(struct qmempool *pool,
 	preempt_disable();
 	cpu = this_cpu_ptr(pool->percpu);
 	localq_sz  = alf_queue_count(cpu->localq);
-	sharedq_sz = alf_queue_count(pool->sharedq);
-	if (verbose >= 2)
+	sharedq_sz = alf_queue_count(pool->sharedq[numa_mem_id()]);
+	if (verbose >= 2) {
 		pr_info("%s() qstats localq:%d sharedq:%d (%s)\n", func,
 			localq_sz, sharedq_sz, msg);
+		pr_info("%s() alloc hit:%lu miss:%lu free hit:%lu miss:%lu"
+			" refill:%lu flush:%lu slab alloc:%lu free:%lu\n",
+			func, cpu->stat.alloc_hit, cpu->stat.alloc_miss,
+			cpu->stat.free_hit, cpu->stat.free_miss,
+			cpu->stat.refill, cpu->stat.flush,
+			cpu->stat.slab_alloc, cpu->stat.slab_free);
+	}
 	preempt_enable();
 }
 
@@ -41,8 +48,20 @@ enum behavior_type {
 	NORMAL_INLINE,
 	SOFTIRQ,
 	SOFTIRQ_INLINE,
+	HARDIRQ, /* irqsafe pool, local IRQ disable */
 };
 
+static struct qmempool *bench_pool_create(
+	uint32_t localq_sz, uint32_t sharedq_sz, uint32_t prealloc,
+	struct kmem_cache *slab, enum behavior_type type)
+{
+	if (type == HARDIRQ)
+		return qmempool_create_irqsafe(localq_sz, sharedq_sz,
+					       prealloc, slab, GFP_ATOMIC);
+	return qmempool_create(localq_sz, sharedq_sz, prealloc, slab,
+			       GFP_ATOMIC);
+}
+
 /* For comparison benchmark against the fastpath of the
  * slab/kmem_cache allocator
  */
@@ -91,17 +110,24 @@ static __always_inline int __benchmark_qmempool_fastpath_reuse(
 	slab = kmem_cache_create("qmempool_test4", sizeof(struct my_elem),
 				 0, SLAB_HWCACHE_ALIGN, NULL);
 
-	pool = qmempool_create(32, 128, 16, slab, GFP_ATOMIC);
+	pool = bench_pool_create(32, 128, 16, slab, type);
 	if (pool == NULL) {
 		kmem_cache_destroy(slab);
 		return false;
 	}
 
-	// "warm-up"
-	elem  = qmempool_alloc(pool, GFP_ATOMIC);
-	elem2 = qmempool_alloc(pool, GFP_ATOMIC);
-	qmempool_free(pool, elem);
-	qmempool_free(pool, elem2);
+	// "warm-up", an irqsafe pool must only use the "_irq" API
+	if (type == HARDIRQ) {
+		elem  = qmempool_alloc_irq(pool, GFP_ATOMIC);
+		elem2 = qmempool_alloc_irq(pool, GFP_ATOMIC);
+		qmempool_free_irq(pool, elem);
+		qmempool_free_irq(pool, elem2);
+	} else {
+		elem  = qmempool_alloc(pool, GFP_ATOMIC);
+		elem2 = qmempool_alloc(pool, GFP_ATOMIC);
+		qmempool_free(pool, elem);
+		qmempool_free(pool, elem2);
+	}
 
 	time_bench_start(rec);
 	/** Loop to measure **/
@@ -116,6 +142,8 @@ static __always_inline int __benchmark_qmempool_fastpath_reuse(
 			elem = qmempool_alloc_softirq(pool, GFP_ATOMIC);
 		} else if (type == SOFTIRQ_INLINE) {
 			elem = __qmempool_alloc_softirq(pool, GFP_ATOMIC);
+		} else if (type == HARDIRQ) {
+			elem = qmempool_alloc_irq(pool, GFP_ATOMIC);
 		} else {
 			BUILD_BUG();
 		}
@@ -133,6 +161,8 @@ static __always_inline int __benchmark_qmempool_fastpath_reuse(
 			qmempool_free_softirq(pool, elem);
 		} else if (type == SOFTIRQ_INLINE) {
 			__qmempool_free_softirq(pool, elem);
+		} else if (type == HARDIRQ) {
+			qmempool_free_irq(pool, elem);
 		} else {
 			BUILD_BUG();
 		}
@@ -166,6 +196,11 @@ int benchmark_qmempool_fastpath_reuse_softirq_inline(
 {
 	return __benchmark_qmempool_fastpath_reuse(rec, data, SOFTIRQ_INLINE);
 }
+int benchmark_qmempool_fastpath_reuse_hardirq(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_qmempool_fastpath_reuse(rec, data, HARDIRQ);
+}
 
 /* Keeping elements in a simple array to avoid too much interference
  * with test */
@@ -227,7 +262,7 @@ static __always_inline int __benchmark_qmempool_pattern(
 	if (!slab)
 		return 0;
 	//pool = qmempool_create(32, 128, 0, slab, GFP_ATOMIC);
-	pool = qmempool_create(32, 256, 0, slab, GFP_ATOMIC);
+	pool = bench_pool_create(32, 256, 0, slab, type);
 	//pool = qmempool_create(32, 1024, 0, slab, GFP_ATOMIC);
 	if (pool == NULL) {
 		kmem_cache_destroy(slab);
@@ -250,6 +285,8 @@ static __always_inline int __benchmark_qmempool_pattern(
 			} else if (type == SOFTIRQ_INLINE) {
 				elems[n] =
 				__qmempool_alloc_softirq(pool, GFP_ATOMIC);
+			} else if (type == HARDIRQ) {
+				elems[n] = qmempool_alloc_irq(pool, GFP_ATOMIC);
 			} else {
 				BUILD_BUG();
 			}
@@ -268,6 +305,8 @@ static __always_inline int __benchmark_qmempool_pattern(
 				qmempool_free_softirq(pool, elems[n]);
 			} else if (type == SOFTIRQ_INLINE) {
 				__qmempool_free_softirq(pool, elems[n]);
+			} else if (type == HARDIRQ) {
+				qmempool_free_irq(pool, elems[n]);
 			} else {
 				BUILD_BUG();
 			}
@@ -304,7 +343,307 @@ int benchmark_qmempool_pattern_softirq_inline(
 {
 	return __benchmark_qmempool_pattern(rec, data, SOFTIRQ_INLINE);
 }
+int benchmark_qmempool_pattern_hardirq(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_qmempool_pattern(rec, data, HARDIRQ);
+}
+
+/* Same N-pattern, but via the bulk API, in chunks of "step" elements.
+ * Compare against "qmempool N-pattern" doing N single calls.
+ */
+static int benchmark_qmempool_pattern_bulk(
+	struct time_bench_record *rec, void *data)
+{
+	uint64_t loops_cnt = 0;
+	int bulk = rec->step;
+	int i, n;
+	struct kmem_cache *slab;
+	struct qmempool *pool;
+
+	if (bulk <= 0 || bulk > ARRAY_MAX_ELEMS ||
+	    ARRAY_MAX_ELEMS % bulk) {
+		pr_err("%s() invalid bulk size:%d\n", __func__, bulk);
+		return 0;
+	}
+
+	slab = kmem_cache_create("qmempool_test", sizeof(*elems[0]),
+				 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!slab)
+		return 0;
+	pool = qmempool_create(32, 256, 0, slab, GFP_ATOMIC);
+	if (pool == NULL) {
+		kmem_cache_destroy(slab);
+		return 0;
+	}
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+
+		/* alloc N new elems */
+		for (n = 0; n < ARRAY_MAX_ELEMS; n += bulk) {
+			if (qmempool_alloc_bulk(pool, GFP_ATOMIC, bulk,
+						(void **)&elems[n]) != bulk)
+				goto out;
+			barrier(); /* compiler barrier */
+		}
+
+		barrier(); /* compiler barrier */
+
+		/* free N elems */
+		for (n = 0; n < ARRAY_MAX_ELEMS; n += bulk) {
+			qmempool_free_bulk(pool, bulk, (void **)&elems[n]);
+			barrier(); /* compiler barrier */
+			loops_cnt += bulk;
+		}
+	}
+out:
+	time_bench_stop(rec, loops_cnt);
+
+	print_qstats(pool, __func__, "ZZZ");
+
+	/* cleanup */
+	qmempool_destroy(pool);
+	kmem_cache_destroy(slab);
+	return loops_cnt;
+}
+
+/* Isolate the slow-path cost when the pool runs dry.  The pool queues
+ * are minimal, and the N-pattern exceed them, thus the majority of
+ * allocs refill from SLAB, and the frees flush back to SLAB.
+ * Compare against "kmem alloc+free N-pattern".
+ */
+static int benchmark_qmempool_slowpath(
+	struct time_bench_record *rec, void *data)
+{
+	uint64_t loops_cnt = 0;
+	int i, n;
+	struct kmem_cache *slab;
+	struct qmempool *pool;
+
+	slab = kmem_cache_create("qmempool_test", sizeof(*elems[0]),
+				 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!slab)
+		return 0;
+	pool = qmempool_create(QMEMPOOL_BULK,
+			       QMEMPOOL_BULK * QMEMPOOL_REFILL_MULTIPLIER,
+			       0, slab, GFP_ATOMIC);
+	if (pool == NULL) {
+		kmem_cache_destroy(slab);
+		return 0;
+	}
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+
+		/* alloc N new elems */
+		for (n = 0; n < ARRAY_MAX_ELEMS; n++) {
+			elems[n] = qmempool_alloc(pool, GFP_ATOMIC);
+			if (elems[n] == NULL) {
+				while (n--)
+					qmempool_free(pool, elems[n]);
+				goto out;
+			}
+		}
+
+		barrier(); /* compiler barrier */
+
+		/* free N elems */
+		for (n = 0; n < ARRAY_MAX_ELEMS; n++) {
+			qmempool_free(pool, elems[n]);
+			loops_cnt++;
+		}
+	}
+out:
+	time_bench_stop(rec, loops_cnt);
+
+	print_qstats(pool, __func__, "slowpath");
+
+	/* cleanup */
+	qmempool_destroy(pool);
+	kmem_cache_destroy(slab);
+	return loops_cnt;
+}
+
+
+/* Bursty alloc/free pattern, with burst sizes varying between smaller
+ * and larger than the localq.  A fixed bulk/depth setting either
+ * thrash sharedq (large bursts) or hoards memory in localq (small
+ * bursts).  Compare a fixed setting against the adaptive sizing.
+ */
+static const int burst_sizes[] = { 4, ARRAY_MAX_ELEMS, 32, 128, 8,
+				   ARRAY_MAX_ELEMS };
+
+static __always_inline int __benchmark_qmempool_burst(
+	struct time_bench_record *rec, void *data, bool adaptive)
+{
+	uint64_t loops_cnt = 0;
+	struct qmempool_percpu *cpu;
+	struct kmem_cache *slab;
+	struct qmempool *pool;
+	int i, n, burst;
+
+	slab = kmem_cache_create("qmempool_test", sizeof(*elems[0]),
+				 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!slab)
+		return 0;
+	pool = qmempool_create(64, 1024, 0, slab, GFP_ATOMIC);
+	if (pool == NULL) {
+		kmem_cache_destroy(slab);
+		return 0;
+	}
+	pool->adaptive = adaptive;
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+		burst = burst_sizes[i % ARRAY_SIZE(burst_sizes)];
+
+		for (n = 0; n < burst; n++) {
+			elems[n] = qmempool_alloc(pool, GFP_ATOMIC);
+			if (elems[n] == NULL) {
+				while (n--)
+					qmempool_free(pool, elems[n]);
+				goto out;
+			}
+		}
+
+		barrier(); /* compiler barrier */
+
+		for (n = 0; n < burst; n++) {
+			qmempool_free(pool, elems[n]);
+			loops_cnt++;
+		}
+	}
+out:
+	time_bench_stop(rec, loops_cnt);
+
+	preempt_disable();
+	cpu = this_cpu_ptr(pool->percpu);
+	if (verbose)
+		pr_info("%s() adaptive:%d bulk:%u depth:%u localq:%d\n",
+			__func__, adaptive, cpu->bulk, cpu->depth,
+			alf_queue_count(cpu->localq));
+	preempt_enable();
+
+	/* cleanup */
+	qmempool_destroy(pool);
+	kmem_cache_destroy(slab);
+	return loops_cnt;
+}
+int benchmark_qmempool_burst_fixed(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_qmempool_burst(rec, data, false);
+}
+int benchmark_qmempool_burst_adaptive(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_qmempool_burst(rec, data, true);
+}
+
+/* First-touch cost of a freshly allocated element.  The working set
+ * (FIRST_TOUCH_ELEMS elements of sizeof(struct my_elem)) is larger
+ * than the L2 cache, thus every element is cache cold when handed out
+ * again, and the first write to it is a cache-miss.  Compare the
+ * prefetch of the next localq element, off vs. on.  With a reset
+ * callback (like the skb header clearing in __alloc_skb) the miss
+ * moves into qmempool_alloc(), where prefetch can hide it.
+ *
+ * The miss count itself can be observed via e.g.:
+ *  perf stat -e cache-misses:k insmod mm/qmempool_bench.ko
+ */
+#define FIRST_TOUCH_ELEMS 8192
+static struct my_elem *touch_elems[FIRST_TOUCH_ELEMS];
+
+static void my_elem_ctor(void *elem)
+{
+	memset(elem, 0, sizeof(struct my_elem));
+}
 
+static void my_elem_reset(void *elem)
+{
+	memset(elem, 0, offsetof(struct sk_buff, tail));
+}
+
+static __always_inline int __benchmark_qmempool_first_touch(
+	struct time_bench_record *rec, void *data, bool prefetch, bool reset)
+{
+	uint64_t loops_cnt = 0;
+	struct kmem_cache *slab;
+	struct qmempool *pool;
+	int i, n;
+
+	slab = kmem_cache_create("qmempool_test", sizeof(struct my_elem),
+				 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!slab)
+		return 0;
+	/* All elements fit in localq, exercising the fastpath */
+	pool = qmempool_create_ctor(FIRST_TOUCH_ELEMS, FIRST_TOUCH_ELEMS,
+				    0, slab, GFP_ATOMIC,
+				    reset ? my_elem_ctor : NULL,
+				    reset ? my_elem_reset : NULL);
+	if (pool == NULL) {
+		kmem_cache_destroy(slab);
+		return 0;
+	}
+	pool->adaptive = false;
+	pool->prefetch = prefetch;
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+
+		for (n = 0; n < FIRST_TOUCH_ELEMS; n++) {
+			touch_elems[n] = qmempool_alloc(pool, GFP_ATOMIC);
+			if (touch_elems[n] == NULL) {
+				while (n--)
+					qmempool_free(pool, touch_elems[n]);
+				goto out;
+			}
+			/* First touch, write to the first cache line */
+			WRITE_ONCE(touch_elems[n]->skb.next, NULL);
+		}
+
+		barrier(); /* compiler barrier */
+
+		for (n = 0; n < FIRST_TOUCH_ELEMS; n++) {
+			qmempool_free(pool, touch_elems[n]);
+			loops_cnt++;
+		}
+	}
+out:
+	time_bench_stop(rec, loops_cnt);
+
+	print_qstats(pool, __func__, "ZZZ");
+
+	/* cleanup */
+	qmempool_destroy(pool);
+	kmem_cache_destroy(slab);
+	return loops_cnt;
+}
+int benchmark_qmempool_first_touch(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_qmempool_first_touch(rec, data, false, false);
+}
+int benchmark_qmempool_first_touch_prefetch(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_qmempool_first_touch(rec, data, true, false);
+}
+int benchmark_qmempool_first_touch_reset(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_qmempool_first_touch(rec, data, false, true);
+}
+int benchmark_qmempool_first_touch_reset_prefetch(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_qmempool_first_touch(rec, data, true, true);
+}
 
 bool run_micro_benchmark_tests(void)
 {
@@ -330,6 +669,8 @@ bool run_micro_benchmark_tests(void)
 			benchmark_qmempool_fastpath_reuse_softirq);
 	time_bench_loop(loops*30, 0, "qmempool fastpath SOFTIRQ+inline", NULL,
 			benchmark_qmempool_fastpath_reuse_softirq_inline);
+	time_bench_loop(loops*30, 0, "qmempool fastpath HARDIRQ", NULL,
+			benchmark_qmempool_fastpath_reuse_hardirq);
 
 	pr_info("N-pattern with %d elements\n", ARRAY_MAX_ELEMS);
 
@@ -349,6 +690,39 @@ bool run_micro_benchmark_tests(void)
 			NULL, benchmark_qmempool_pattern_softirq);
 	time_bench_loop(loops/10, 0, "qmempool N-pattern softirq+inline",
 			NULL, benchmark_qmempool_pattern_softirq_inline);
+	time_bench_loop(loops/10, 0, "qmempool N-pattern hardirq",
+			NULL, benchmark_qmempool_pattern_hardirq);
+
+	/* Bulk API, step is the bulk size */
+	time_bench_loop(loops/10, 8, "qmempool N-pattern bulk",
+			NULL, benchmark_qmempool_pattern_bulk);
+	time_bench_loop(loops/10, 16, "qmempool N-pattern bulk",
+			NULL, benchmark_qmempool_pattern_bulk);
+	time_bench_loop(loops/10, 64, "qmempool N-pattern bulk",
+			NULL, benchmark_qmempool_pattern_bulk);
+	time_bench_loop(loops/10, ARRAY_MAX_ELEMS, "qmempool N-pattern bulk",
+			NULL, benchmark_qmempool_pattern_bulk);
+
+	/* Pool running dry, SLAB refill and flush via bulk API */
+	time_bench_loop(loops/10, 0, "qmempool N-pattern slowpath",
+			NULL, benchmark_qmempool_slowpath);
+
+	/* Bursty pattern, fixed vs. adaptive bulk and localq depth */
+	time_bench_loop(loops/10, 0, "qmempool burst fixed",
+			NULL, benchmark_qmempool_burst_fixed);
+	time_bench_loop(loops/10, 0, "qmempool burst adaptive",
+			NULL, benchmark_qmempool_burst_adaptive);
+
+	/* Cold elements, first-touch cost with and without prefetch */
+	pr_info("First-touch with %d elements\n", FIRST_TOUCH_ELEMS);
+	time_bench_loop(loops/1000, 0, "qmempool first-touch",
+			NULL, benchmark_qmempool_first_touch);
+	time_bench_loop(loops/1000, 0, "qmempool first-touch prefetch",
+			NULL, benchmark_qmempool_first_touch_prefetch);
+	time_bench_loop(loops/1000, 0, "qmempool first-touch reset",
+			NULL, benchmark_qmempool_first_touch_reset);
+	time_bench_loop(loops/1000, 0, "qmempool first-touch reset+prefetch",
+			NULL, benchmark_qmempool_first_touch_reset_prefetch);
 
 	return true;
 }
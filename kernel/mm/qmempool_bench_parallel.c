@@ -34,6 +34,7 @@ enum benchmark_bit {
 	bit_run_bench_fastpath_qmempool,
 	bit_run_bench_N_pattern_slab,
 	bit_run_bench_N_pattern_qmempool,
+	bit_run_bench_cross_node_qmempool,
 };
 #define bit(b)	(1 << (b))
 #define run_or_return(b) do { if (!(run_flags & (bit(b)))) return; } while (0)
@@ -47,7 +48,7 @@ static void print_qstats(struct qmempool *pool,
 	preempt_disable();
 	cpu = this_cpu_ptr(pool->percpu);
 	localq_sz  = alf_queue_count(cpu->localq);
-	sharedq_sz = alf_queue_count(pool->sharedq);
+	sharedq_sz = alf_queue_count(pool->sharedq[numa_mem_id()]);
 	if (verbose >= 2)
 		pr_info("%s() qstats localq:%d sharedq:%d (%s)\n", func,
 			localq_sz, sharedq_sz, msg);
@@ -300,6 +301,72 @@ int benchmark_qmempool_pattern_softirq_inline(
 	return __benchmark_qmempool_pattern(rec, data, SOFTIRQ_INLINE);
 }
 
+/* Cross NUMA node pattern: two CPUs on different nodes, each allocate
+ * elements and hand them over to the other CPU, which free them.
+ * Without NUMA awareness the remote elements end up in the localq of
+ * the freeing CPU, and are handed out by its next allocations.
+ *
+ * Counts allocations returning memory from a remote node (misses).
+ */
+#define XNODE_BULK 16
+
+struct xnode_bench {
+	struct qmempool *pool;
+	int cpu[2];
+	struct alf_queue *xfer[2]; /* handover queue, consumed by cpu[i] */
+	atomic64_t allocs;
+	atomic64_t misses;
+};
+
+static int benchmark_qmempool_cross_node(
+	struct time_bench_record *rec, void *data)
+{
+	struct xnode_bench *x = data;
+	void *elems[XNODE_BULK];
+	uint64_t loops_cnt = 0, misses = 0;
+	int me = (rec->cpu == x->cpu[0]) ? 0 : 1;
+	int node = cpu_to_mem(rec->cpu);
+	int i, n, num;
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+
+		for (n = 0; n < XNODE_BULK; n++) {
+			elems[n] = qmempool_alloc(x->pool, GFP_ATOMIC);
+			if (elems[n] == NULL) {
+				while (n--)
+					qmempool_free(x->pool, elems[n]);
+				goto out;
+			}
+			if (qmempool_elem_node(elems[n]) != node)
+				misses++;
+		}
+		loops_cnt += XNODE_BULK;
+
+		/* Hand over to other node, free locally if it lags behind */
+		preempt_disable();
+		num = alf_sp_enqueue(x->xfer[!me], elems, XNODE_BULK);
+		preempt_enable();
+		if (num != XNODE_BULK) {
+			for (n = 0; n < XNODE_BULK; n++)
+				qmempool_free(x->pool, elems[n]);
+		}
+
+		/* Free elements allocated on the other node */
+		preempt_disable();
+		num = alf_sc_dequeue(x->xfer[me], elems, XNODE_BULK);
+		preempt_enable();
+		for (n = 0; n < num; n++)
+			qmempool_free(x->pool, elems[n]);
+	}
+out:
+	time_bench_stop(rec, loops_cnt);
+	atomic64_add(loops_cnt, &x->allocs);
+	atomic64_add(misses, &x->misses);
+	return loops_cnt;
+}
+
 int run_parallel(const char *desc, uint32_t loops, const cpumask_t *cpumask,
 		 int step, void *data,
 		 int (*func)(struct time_bench_record *record, void *data)
@@ -436,6 +503,102 @@ void noinline run_bench_N_pattern_qmempool(uint32_t loops, cpumask_t cpumask)
 	kmem_cache_destroy(slab);
 }
 
+static void run_cross_node(const char *desc, uint32_t loops,
+			   struct xnode_bench *x, struct kmem_cache *slab,
+			   bool numa)
+{
+	cpumask_t cpumask;
+	void *elem;
+	int i;
+
+	atomic64_set(&x->allocs, 0);
+	atomic64_set(&x->misses, 0);
+
+	x->pool = qmempool_create(64, 1024, 0, slab, GFP_ATOMIC);
+	if (x->pool == NULL)
+		return;
+	/* Baseline: disable routing elements back to their home node */
+	x->pool->numa = numa;
+
+	cpumask_clear(&cpumask);
+	for (i = 0; i < 2; i++)
+		cpumask_set_cpu(x->cpu[i], &cpumask);
+
+	run_parallel(desc, loops, &cpumask, 0, x,
+		     benchmark_qmempool_cross_node);
+
+	pr_info("%s: remote node allocs %lld of %lld\n", desc,
+		(long long)atomic64_read(&x->misses),
+		(long long)atomic64_read(&x->allocs));
+
+	/* Return in-flight elements before destroying pool */
+	for (i = 0; i < 2; i++) {
+		while (alf_mc_dequeue(x->xfer[i], &elem, 1) == 1)
+			qmempool_free(x->pool, elem);
+	}
+	qmempool_destroy(x->pool);
+}
+
+void noinline run_bench_cross_node_qmempool(uint32_t loops)
+{
+	struct xnode_bench *x;
+	struct kmem_cache *slab;
+	int cpu, node0;
+
+	run_or_return(bit_run_bench_cross_node_qmempool);
+
+	if (num_node_state(N_MEMORY) < 2) {
+		pr_info("Skip cross node bench, need two NUMA nodes\n");
+		return;
+	}
+
+	x = kzalloc(sizeof(*x), GFP_KERNEL);
+	if (!x)
+		return;
+
+	/* One CPU on first node, and one on another node */
+	x->cpu[0] = cpumask_first(cpu_online_mask);
+	node0 = cpu_to_mem(x->cpu[0]);
+	x->cpu[1] = -1;
+	for_each_online_cpu(cpu) {
+		if (cpu_to_mem(cpu) != node0) {
+			x->cpu[1] = cpu;
+			break;
+		}
+	}
+	if (x->cpu[1] < 0) {
+		pr_info("Skip cross node bench, no online CPU on 2nd node\n");
+		goto out;
+	}
+
+	for (cpu = 0; cpu < 2; cpu++) {
+		x->xfer[cpu] = alf_queue_alloc(1024, GFP_KERNEL);
+		if (IS_ERR_OR_NULL(x->xfer[cpu]))
+			goto out_queues;
+	}
+
+	slab = kmem_cache_create("qmempool_xnode", sizeof(struct my_elem),
+				 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!slab)
+		goto out_queues;
+
+	pr_info("Cross node pattern CPU:%d(node:%d) <-> CPU:%d(node:%d)\n",
+		x->cpu[0], node0, x->cpu[1], cpu_to_mem(x->cpu[1]));
+	run_cross_node("qmempool_cross_node_numa_unaware", loops, x, slab,
+		       false);
+	run_cross_node("qmempool_cross_node_numa_aware", loops, x, slab,
+		       true);
+
+	kmem_cache_destroy(slab);
+out_queues:
+	for (cpu = 0; cpu < 2; cpu++) {
+		if (!IS_ERR_OR_NULL(x->xfer[cpu]))
+			alf_queue_free(x->xfer[cpu]);
+	}
+out:
+	kfree(x);
+}
+
 bool run_micro_benchmark_tests(void)
 {
 	uint32_t loops = 100000;
@@ -463,6 +626,8 @@ bool run_micro_benchmark_tests(void)
 	run_bench_N_pattern_slab(loops, cpumask);
 	run_bench_N_pattern_qmempool(loops, cpumask);
 
+	run_bench_cross_node_qmempool(loops/10);
+
 	return true;
 }
 
@@ -8,6 +8,7 @@
 #include <linux/slab.h>
 #include <linux/time_bench.h>
 #include <linux/skbuff.h>
+#include <linux/shrinker.h>
 
 #include <linux/qmempool.h>
 
@@ -83,8 +84,8 @@ static bool test_basic_req_elem(void)
 	if (queue_sz != (QMEMPOOL_BULK - 1))
 		result = false;
 	if (verbose >= 2)
-		pr_info("%s() localq:%d sharedq:%d\n", __func__,
-			queue_sz, alf_queue_count(pool->sharedq));
+		pr_info("%s() localq:%d sharedq:%d\n", __func__, queue_sz,
+			alf_queue_count(pool->sharedq[numa_mem_id()]));
 	preempt_enable();
 
 	qmempool_destroy(pool);
@@ -101,7 +102,7 @@ static void print_qstats(struct qmempool *pool,
 	preempt_disable();
 	cpu = this_cpu_ptr(pool->percpu);
 	localq_sz  = alf_queue_count(cpu->localq);
-	sharedq_sz = alf_queue_count(pool->sharedq);
+	sharedq_sz = alf_queue_count(pool->sharedq[numa_mem_id()]);
 	if (verbose >= 2)
 		pr_info("%s() qstats localq:%d sharedq:%d (%s)\n", func,
 			localq_sz, sharedq_sz, msg);
@@ -156,6 +157,264 @@ static bool test_alloc_and_free_nr(int nr)
 	return result;
 }
 
+/* Concurrency torture test: all CPUs drain an empty pool at the same
+ * time, forcing simultaneous refill of sharedq from SLAB (and flush
+ * back).  The sharedq is minimal, thus refills race on a full sharedq.
+ * Elements are marked with an owner, to detect double hand-out.
+ */
+#define TORTURE_ELEMS 256
+
+struct torture_elem {
+	atomic_t owner;
+	char data[124];
+};
+
+struct torture_data {
+	struct qmempool *pool;
+	atomic_t errors;
+};
+
+static void torture_elem_ctor(void *obj)
+{
+	struct torture_elem *e = obj;
+
+	atomic_set(&e->owner, 0);
+}
+
+static int torture_concurrent_refill(struct time_bench_record *rec,
+				     void *data)
+{
+	struct torture_data *t = data;
+	struct torture_elem **elems;
+	int owner = rec->cpu + 1;
+	uint64_t cnt = 0;
+	int i, n, nr;
+
+	elems = kcalloc(TORTURE_ELEMS, sizeof(*elems), GFP_KERNEL);
+	if (!elems) {
+		atomic_inc(&t->errors);
+		return 0;
+	}
+
+	time_bench_start(rec);
+	for (i = 0; i < rec->loops; i++) {
+		/* Drain pool, SLAB running out is not an error */
+		for (nr = 0; nr < TORTURE_ELEMS; nr++) {
+			elems[nr] = qmempool_alloc(t->pool, GFP_ATOMIC);
+			if (elems[nr] == NULL)
+				break;
+			if (atomic_cmpxchg(&elems[nr]->owner, 0, owner) != 0)
+				atomic_inc(&t->errors);
+		}
+		for (n = 0; n < nr; n++) {
+			atomic_set(&elems[n]->owner, 0);
+			qmempool_free(t->pool, elems[n]);
+		}
+		cnt += nr;
+	}
+	time_bench_stop(rec, cnt);
+
+	kfree(elems);
+	return cnt;
+}
+
+static bool test_concurrent_refill(void)
+{
+	struct time_bench_sync sync;
+	struct time_bench_cpu *cpu_tasks;
+	struct kmem_cache *slab;
+	struct torture_data t;
+	bool result;
+
+	cpu_tasks = kcalloc(num_possible_cpus(), sizeof(*cpu_tasks),
+			    GFP_KERNEL);
+	if (!cpu_tasks)
+		return false;
+
+	slab = kmem_cache_create("qmempool_torture",
+				 sizeof(struct torture_elem), 0,
+				 SLAB_HWCACHE_ALIGN, torture_elem_ctor);
+	if (!slab) {
+		kfree(cpu_tasks);
+		return false;
+	}
+	t.pool = qmempool_create(QMEMPOOL_BULK,
+				 QMEMPOOL_BULK * QMEMPOOL_REFILL_MULTIPLIER,
+				 0, slab, GFP_ATOMIC);
+	if (t.pool == NULL) {
+		kmem_cache_destroy(slab);
+		kfree(cpu_tasks);
+		return false;
+	}
+	atomic_set(&t.errors, 0);
+
+	time_bench_run_concurrent(1000, 0, &t, cpu_online_mask, &sync,
+				  cpu_tasks, torture_concurrent_refill);
+	if (verbose >= 2)
+		time_bench_print_stats_cpumask(__func__, cpu_tasks,
+					       cpu_online_mask);
+
+	result = (atomic_read(&t.errors) == 0);
+	if (!result)
+		pr_err("%s() detected %d errors\n", __func__,
+		       atomic_read(&t.errors));
+
+	qmempool_destroy(t.pool);
+	kmem_cache_destroy(slab);
+	kfree(cpu_tasks);
+	return result;
+}
+
+/* Shrinker must release the elements cached in sharedq to SLAB
+ *
+ * The pool shrinker is registered, thus a concurrent reclaim scan, or
+ * the decay work (kicked by each scan) can release elements under us.
+ * Both only ever release, thus the counts are checked relative to each
+ * other, and must never grow.
+ */
+static bool test_shrinker_release(void)
+{
+	struct shrink_control sc = { .gfp_mask = GFP_KERNEL };
+	struct kmem_cache *slab;
+	struct qmempool *pool;
+	struct shrinker *shrink;
+	unsigned long count, freed, left;
+	bool result = true;
+
+	slab = kmem_cache_create("qmempool_shrink", 256, 0,
+				 SLAB_HWCACHE_ALIGN, NULL);
+	if (!slab)
+		return false;
+	pool = qmempool_create(32, 512, 256, slab, GFP_KERNEL);
+	if (pool == NULL) {
+		kmem_cache_destroy(slab);
+		return false;
+	}
+	shrink = qmempool_shrinker(pool);
+
+	/* Prealloc is per memory node */
+	count = shrink->count_objects(shrink, &sc);
+	if (count == SHRINK_EMPTY)
+		count = 0;
+	if (count > 256 * num_node_state(N_MEMORY))
+		result = false;
+
+	sc.nr_to_scan = 128;
+	freed = shrink->scan_objects(shrink, &sc);
+	if (freed == SHRINK_STOP)
+		freed = 0;
+	left = shrink->count_objects(shrink, &sc);
+	if (left == SHRINK_EMPTY)
+		left = 0;
+	if (freed > 128 || freed > count || left > count - freed)
+		result = false;
+	/* Only a concurrent scan emptying the pool can stop progress */
+	if (freed == 0 && left > 0)
+		result = false;
+
+	/* Release everything */
+	sc.nr_to_scan = count;
+	shrink->scan_objects(shrink, &sc);
+	if (shrink->count_objects(shrink, &sc) != SHRINK_EMPTY)
+		result = false;
+	if (verbose >= 2)
+		pr_info("%s() count:%lu freed:%lu\n", __func__, count, freed);
+
+	qmempool_destroy(pool);
+	kmem_cache_destroy(slab);
+	return result;
+}
+
+/* The ctor runs once per element taken from SLAB, and reset on every
+ * alloc, for both the single and bulk API.
+ */
+#define CTOR_MAGIC 0xC0FFEE
+struct ctor_elem {
+	u32 magic;
+	u32 resets;
+};
+static atomic_t ctor_calls;
+static atomic_t reset_calls;
+
+static void test_elem_ctor(void *elem)
+{
+	struct ctor_elem *e = elem;
+
+	e->magic  = CTOR_MAGIC;
+	e->resets = 0;
+	atomic_inc(&ctor_calls);
+}
+
+static void test_elem_reset(void *elem)
+{
+	struct ctor_elem *e = elem;
+
+	e->resets++;
+	atomic_inc(&reset_calls);
+}
+
+static bool test_ctor_and_reset(void)
+{
+	struct ctor_elem *elems[QMEMPOOL_BULK * 4];
+	const int nr = ARRAY_SIZE(elems);
+	struct kmem_cache *slab;
+	struct qmempool *pool;
+	bool result = true;
+	int i, round;
+
+	atomic_set(&ctor_calls, 0);
+	atomic_set(&reset_calls, 0);
+	slab = kmem_cache_create("qmempool_ctor", sizeof(struct ctor_elem),
+				 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!slab)
+		return false;
+	pool = qmempool_create_ctor(32, 128, 32, slab, GFP_ATOMIC,
+				    test_elem_ctor, test_elem_reset);
+	if (pool == NULL) {
+		kmem_cache_destroy(slab);
+		return false;
+	}
+
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < nr; i++) {
+			elems[i] = qmempool_alloc(pool, GFP_ATOMIC);
+			if (!elems[i]) {
+				qmempool_free_bulk(pool, i, (void **)elems);
+				result = false;
+				goto out;
+			}
+		}
+		for (i = 0; i < nr; i++)
+			if (elems[i]->magic != CTOR_MAGIC ||
+			    elems[i]->resets == 0)
+				result = false;
+		qmempool_free_bulk(pool, nr, (void **)elems);
+
+		i = qmempool_alloc_bulk(pool, GFP_ATOMIC, nr, (void **)elems);
+		if (i != nr) {
+			qmempool_free_bulk(pool, i, (void **)elems);
+			result = false;
+			goto out;
+		}
+		for (i = 0; i < nr; i++)
+			if (elems[i]->magic != CTOR_MAGIC)
+				result = false;
+		qmempool_free_bulk(pool, nr, (void **)elems);
+	}
+	/* Every alloc is reset, elements are constructed at least once */
+	if (atomic_read(&reset_calls) != nr * 4)
+		result = false;
+	if (atomic_read(&ctor_calls) < nr)
+		result = false;
+	if (verbose >= 2)
+		pr_info("%s() ctor:%d reset:%d\n", __func__,
+			atomic_read(&ctor_calls), atomic_read(&reset_calls));
+out:
+	qmempool_destroy(pool);
+	kmem_cache_destroy(slab);
+	return result;
+}
+
 #define TEST_FUNC(func) 					\
 do {								\
 	if (!(func)) {						\
@@ -178,6 +437,9 @@ int run_basic_tests(void)
 	TEST_FUNC(test_alloc_and_free_nr(129));
 	TEST_FUNC(test_alloc_and_free_nr((128+(128/(QMEMPOOL_BULK*QMEMPOOL_REFILL_MULTIPLIER)))));
 	TEST_FUNC(test_alloc_and_free_nr((128+(128/(QMEMPOOL_BULK*QMEMPOOL_REFILL_MULTIPLIER)))+1));
+	TEST_FUNC(test_concurrent_refill());
+	TEST_FUNC(test_shrinker_release());
+	TEST_FUNC(test_ctor_and_reset());
 	return failed_count;
 }
 
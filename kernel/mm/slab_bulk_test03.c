@@ -6,6 +6,11 @@
  *
  * This is worse-case for free_bulk, because it cannot exploit the
  * oppotunity to coalesce object belonging to the same page.
+ *
+ * The "sorted" variants sort the array by page (and NUMA node), via
+ * kmem_cache_free_bulk_sorted() from linux/slab_bulk.h, before bulk
+ * free.  Including the sort cost, to see how much of the page-locality
+ * fast-path benefit can be regained for badly ordered frees.
  */
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
@@ -17,6 +22,8 @@
 #include <linux/slab.h>
 #include <linux/skbuff.h>
 #include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/slab_bulk.h>
 
 /* GLOBAL */
 #define MAX_BULK 32768
@@ -204,12 +211,28 @@ bool my__kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t nr,
 
 enum test_type {
 	FALLBACK_BULK = 1,
-	BULK
+	BULK   = 2,
+	SORTED = 4, /* with BULK: sort array by page before free */
+	RANDOM = 8, /* random free order, instead of objhash pattern */
 };
 
+/* Fisher-Yates shuffle of the object array */
+static void shuffle_objs(void **p, size_t nr)
+{
+	size_t i, j;
+	void *tmp;
+
+	for (i = nr - 1; i > 0; i--) {
+		j = get_random_u32_below(i + 1);
+		tmp = p[i];
+		p[i] = p[j];
+		p[j] = tmp;
+	}
+}
+
 static __always_inline int __benchmark_slab_bulk(
 	struct time_bench_record *rec, void *data,
-	enum test_type type)
+	unsigned int type)
 {
 	uint64_t loops_cnt = 0;
 	int i, j;
@@ -257,6 +280,11 @@ static __always_inline int __benchmark_slab_bulk(
 		if (!success)
 			goto out;
 
+		if (type & RANDOM) {
+			shuffle_objs(GLOBAL_OBJS, bulk);
+			goto free_objs;
+		}
+
 		/* Place objects to the objhash */
 		for (j = 0; j < bulk; j++) {
 			objhash_add_one(GLOBAL_OBJS[j]);
@@ -289,8 +317,11 @@ static __always_inline int __benchmark_slab_bulk(
 				goto out;
 		}
 
+free_objs:
 		/* bulk return elems */
-		if (type & BULK) {
+		if (type & SORTED) {
+			kmem_cache_free_bulk_sorted(my_slab, bulk, GLOBAL_OBJS);
+		} else if (type & BULK) {
 			kmem_cache_free_bulk(my_slab, bulk, GLOBAL_OBJS);
 		} else if (type & FALLBACK_BULK) {
 			my__kmem_cache_free_bulk(my_slab, bulk, GLOBAL_OBJS);
@@ -317,6 +348,21 @@ static int benchmark_slab_bulk_fallback(
 {
 	return __benchmark_slab_bulk(rec, data, FALLBACK_BULK);
 }
+static int benchmark_slab_bulk_sorted(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_slab_bulk(rec, data, BULK | SORTED);
+}
+static int benchmark_slab_bulk_random(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_slab_bulk(rec, data, BULK | RANDOM);
+}
+static int benchmark_slab_bulk_random_sorted(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_slab_bulk(rec, data, BULK | RANDOM | SORTED);
+}
 
 
 void bulk_test(int bulk)
@@ -325,6 +371,17 @@ void bulk_test(int bulk)
 			benchmark_slab_bulk);
 	time_bench_loop(loops/bulk, bulk, "worse-case-fallback", NULL,
 			benchmark_slab_bulk_fallback);
+	time_bench_loop(loops/bulk, bulk, "worse-case-bulk-sorted", NULL,
+			benchmark_slab_bulk_sorted);
+}
+
+/* Random free order, without the objhash (and jhash) overhead */
+void bulk_random_order(int bulk)
+{
+	time_bench_loop(loops/bulk, bulk, "random-order-bulk", NULL,
+			benchmark_slab_bulk_random);
+	time_bench_loop(loops/bulk, bulk, "random-order-bulk-sorted", NULL,
+			benchmark_slab_bulk_random_sorted);
 }
 
 
@@ -335,6 +392,8 @@ void bulk_N_same_page(int bulk, long int modulo)
 			benchmark_slab_bulk);
 	time_bench_loop(loops/bulk, bulk, "N-page-match-fallback", data,
 			benchmark_slab_bulk_fallback);
+	time_bench_loop(loops/bulk, bulk, "N-page-match-bulk-sorted", data,
+			benchmark_slab_bulk_sorted);
 }
 
 
@@ -342,6 +401,7 @@ int run_timing_tests(void)
 {
 	pr_info("Bench bulk size:%d\n", bulksz);
 	bulk_test(bulksz);
+	bulk_random_order(bulksz);
 
 	bulk_N_same_page(bulksz, 1); /* Map every page same, optimal case */
 	bulk_N_same_page(bulksz, 2);
@@ -1,5 +1,15 @@
 /*
  * Slab memory exhaustion test, alloc lots of memory to get failures
+ *
+ * Pressure mode (pressure=N): instead of exhausting memory, hold the
+ * system at a free memory level close to the zone watermarks, and
+ * measure the per call latency distribution of kmem_cache_alloc_bulk,
+ * alloc_pages and the qmempool fast and slow paths.  Packet bursts
+ * typically hit when memory is tight, thus the tail latency near the
+ * watermarks is what matters.  Each level is compared against a
+ * baseline run without pressure, e.g.:
+ *
+ *  modprobe slab_bulk_test04_exhaust_mem pressure=3 samples=20000
  */
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
@@ -8,6 +18,13 @@
 #include <linux/slab.h>
 #include <linux/list.h>
 #include <linux/delay.h>
+#include <linux/log2.h>
+#include <linux/qmempool.h>
+#include <linux/mmzone.h>
+#include <linux/vmstat.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <asm/timex.h>
 
 /* For testing normal SLUB single alloc API use this module option */
 static int no_bulk=0;
@@ -38,6 +55,51 @@ static uint32_t msdelay = 200;
 module_param(msdelay, uint, 0);
 MODULE_PARM_DESC(msdelay, "delay in N ms after memory exhausted");
 
+/* Allow the allocations to enter reclaim (but not OOM), which invoke
+ * the shrinkers, e.g. testing that qmempool gives memory back.
+ */
+static int gfp_reclaim = 0;
+module_param(gfp_reclaim, uint, 0);
+MODULE_PARM_DESC(gfp_reclaim, "Alloc with GFP_KERNEL|__GFP_NORETRY");
+static gfp_t gfp = GFP_ATOMIC;
+
+/* Elements cached in a qmempool, on the same kmem_cache */
+#define MAX_QMEMPOOL_ELEMS 65536
+static unsigned int qmempool_elems = 0;
+module_param(qmempool_elems, uint, 0);
+MODULE_PARM_DESC(qmempool_elems, "Elems cached in qmempool (per node)");
+static struct qmempool *pool;
+
+/* Pressure levels, relative to the zone watermarks */
+enum pressure_bit {
+	bit_pressure_low = 0,
+	bit_pressure_min,
+};
+#define bit(b)		(1 << (b))
+#define enabled(b)	((pressure & (bit(b))))
+
+static unsigned int pressure = 0;
+module_param(pressure, uint, 0);
+MODULE_PARM_DESC(pressure, "Latency under pressure, bitmask: 1=low 2=min wmark (0=exhaust test)");
+
+static unsigned int pressure_margin = 0;
+module_param(pressure_margin, uint, 0);
+MODULE_PARM_DESC(pressure_margin, "Hold free memory this many pages above the watermark");
+
+static unsigned int samples = 10000;
+module_param(samples, uint, 0);
+MODULE_PARM_DESC(samples, "Latency samples per measured operation");
+
+/* Workaround for kernel v6.8
+ *  5e0a760b4441 ("mm, treewide: rename MAX_ORDER to MAX_PAGE_ORDER")
+ */
+#ifndef MAX_ORDER
+#define MAX_ORDER MAX_PAGE_ORDER
+#endif
+static unsigned int page_order = 0;
+module_param(page_order, uint, 0);
+MODULE_PARM_DESC(page_order, "Order of alloc_pages in pressure mode");
+
 struct kmem_cache *slab;
 LIST_HEAD(global_list);
 
@@ -58,7 +120,7 @@ bool obj_alloc_and_list_add(struct kmem_cache *s, struct my_queue *q)
 {
 	struct my_elem *object;
 
-	object = kmem_cache_alloc(s, GFP_ATOMIC);
+	object = kmem_cache_alloc(s, gfp);
 	if (!object) {
 		if (verbose)
 			pr_err("Could not alloc more objects\n");
@@ -77,7 +139,7 @@ bool obj_bulk_alloc_and_list_add(struct kmem_cache *s, struct my_queue *q)
 	bool success;
 	int i;
 
-	success = kmem_cache_alloc_bulk(s, GFP_ATOMIC, bulksz, objs);
+	success = kmem_cache_alloc_bulk(s, gfp, bulksz, objs);
 	if (!success) {
 		if (verbose)
 			pr_err("Could not bulk(%d) alloc objects\n", bulksz);
@@ -116,6 +178,16 @@ bool alloc_mem_loop(struct kmem_cache *s, struct my_queue *q)
 	return success;
 }
 
+static unsigned int qmempool_cached(void)
+{
+	unsigned int cnt = 0;
+	int nid;
+
+	for_each_node(nid)
+		cnt += alf_queue_count(pool->sharedq[nid]);
+	return cnt;
+}
+
 void free_all(struct kmem_cache *s, struct my_queue *q)
 {
 	struct my_elem *obj, *obj_tmp;
@@ -136,6 +208,344 @@ void free_all(struct kmem_cache *s, struct my_queue *q)
 		pr_info("Free: %llu objects\n", cnt);
 }
 
+/*** Pressure mode ***/
+
+/* Pages allocated for holding free memory at the target level.  They
+ * are allocated without any reclaim flags, which means the page
+ * allocator will not wake kswapd (that would reclaim back to the high
+ * watermark) and cannot dip below the min watermark.
+ */
+#define HOLD_GFP	(__GFP_NOWARN | __GFP_NORETRY)
+#define HOLD_ORDER	PAGE_ALLOC_COSTLY_ORDER
+static LIST_HEAD(hold_list);
+static unsigned long hold_pages;
+
+/* Samples are taken in batches, where the allocations of a batch are
+ * kept until the end of the batch.  Thus, objects come from fresh slab
+ * pages and page allocator, rather than a recycled per CPU freelist.
+ * The level is re-adjusted between batches, as other allocations and
+ * kswapd move the free memory level.
+ */
+#define PRESSURE_BATCH	256
+
+/* Sum of the watermarks over all populated zones.  This is an
+ * approximation, as the page allocator checks per zone (including
+ * lowmem_reserve), but allocations fall back across zones.
+ */
+static unsigned long wmark_pages_sum(int level)
+{
+	unsigned long sum = 0;
+	struct zone *zone;
+	int nid, i;
+
+	for_each_online_node(nid) {
+		for (i = 0; i < MAX_NR_ZONES; i++) {
+			zone = &NODE_DATA(nid)->node_zones[i];
+			if (!populated_zone(zone))
+				continue;
+			if (level == bit_pressure_min)
+				sum += min_wmark_pages(zone);
+			else
+				sum += low_wmark_pages(zone);
+		}
+	}
+	return sum;
+}
+
+static unsigned long free_pages_now(void)
+{
+	return global_zone_page_state(NR_FREE_PAGES);
+}
+
+static void hold_release(unsigned long nr)
+{
+	struct page *page, *tmp;
+
+	list_for_each_entry_safe(page, tmp, &hold_list, lru) {
+		unsigned int order = page_private(page);
+
+		if (!nr)
+			break;
+		list_del(&page->lru);
+		set_page_private(page, 0);
+		__free_pages(page, order);
+		hold_pages -= 1UL << order;
+		nr -= min(nr, 1UL << order);
+	}
+}
+
+/* Allocate (or release) held pages until free memory is at target */
+static void pressure_adjust(unsigned long target)
+{
+	unsigned int order = HOLD_ORDER;
+	unsigned long free = free_pages_now();
+	struct page *page;
+
+	if (free < target) {
+		hold_release(target - free);
+		return;
+	}
+	while (free > target) {
+		if ((free - target) < (1UL << order))
+			order = 0;
+		page = alloc_pages(HOLD_GFP, order);
+		if (!page) {
+			if (!order)
+				break; /* at min watermark */
+			order = 0;
+			continue;
+		}
+		set_page_private(page, order);
+		list_add(&page->lru, &hold_list);
+		hold_pages += 1UL << order;
+		free -= 1UL << order;
+		if ((hold_pages % (1UL << 16)) < (1UL << order)) {
+			cond_resched();
+			free = free_pages_now();
+		}
+	}
+}
+
+struct lat_stat {
+	const char *name;
+	u64 *lat;
+	unsigned int cnt;
+	unsigned int fail;
+};
+
+enum lat_type {
+	LAT_SLAB_BULK = 0,
+	LAT_PAGES,
+	LAT_QMEMPOOL_LOCALQ,
+	LAT_QMEMPOOL_SHAREDQ,
+	LAT_QMEMPOOL_SLAB,
+	LAT_MAX
+};
+
+static struct lat_stat lat_stats[LAT_MAX] = {
+	[LAT_SLAB_BULK]		= { .name = "kmem_cache_alloc_bulk" },
+	[LAT_PAGES]		= { .name = "alloc_pages" },
+	[LAT_QMEMPOOL_LOCALQ]	= { .name = "qmempool-fast-localq" },
+	[LAT_QMEMPOOL_SHAREDQ]	= { .name = "qmempool-slow-sharedq" },
+	[LAT_QMEMPOOL_SLAB]	= { .name = "qmempool-slow-slab" },
+};
+
+static inline void lat_record(struct lat_stat *st, u64 cycles, bool fail)
+{
+	if (st->cnt < samples)
+		st->lat[st->cnt++] = cycles;
+	if (fail)
+		st->fail++;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Percentile in permille, on sorted samples */
+static u64 lat_pct(struct lat_stat *st, unsigned int permille)
+{
+	return st->lat[(u64)(st->cnt - 1) * permille / 1000];
+}
+
+static void lat_report(const char *level)
+{
+	struct lat_stat *st;
+	int i;
+
+	for (i = 0; i < LAT_MAX; i++) {
+		st = &lat_stats[i];
+		if (!st->cnt) {
+			pr_info("%s %-22s no samples\n", level, st->name);
+			continue;
+		}
+		sort(st->lat, st->cnt, sizeof(u64), cmp_u64, NULL);
+		pr_info("%s %-22s n:%u fail:%u cycles p50:%llu p90:%llu p99:%llu p99.9:%llu max:%llu\n",
+			level, st->name, st->cnt, st->fail,
+			lat_pct(st, 500), lat_pct(st, 900), lat_pct(st, 990),
+			lat_pct(st, 999), st->lat[st->cnt - 1]);
+	}
+}
+
+static void lat_reset(void)
+{
+	int i;
+
+	for (i = 0; i < LAT_MAX; i++) {
+		lat_stats[i].cnt = 0;
+		lat_stats[i].fail = 0;
+	}
+}
+
+static void measure_slab_bulk(unsigned long target)
+{
+	struct lat_stat *st = &lat_stats[LAT_SLAB_BULK];
+	void **objs;
+	cycles_t start;
+	int i, n;
+
+	objs = vmalloc(array_size(PRESSURE_BATCH * bulksz, sizeof(void *)));
+	if (!objs)
+		return;
+	while (st->cnt < samples) {
+		if (target)
+			pressure_adjust(target);
+		for (i = 0, n = 0; i < PRESSURE_BATCH; i++) {
+			bool ok;
+
+			start = get_cycles();
+			ok = kmem_cache_alloc_bulk(slab, gfp, bulksz,
+						   &objs[n]);
+			lat_record(st, get_cycles() - start, !ok);
+			if (ok)
+				n += bulksz;
+		}
+		kmem_cache_free_bulk(slab, n, objs);
+		cond_resched();
+	}
+	vfree(objs);
+}
+
+static void measure_pages(unsigned long target)
+{
+	struct lat_stat *st = &lat_stats[LAT_PAGES];
+	struct page **pages;
+	struct page *page;
+	cycles_t start;
+	int i, n;
+
+	pages = vmalloc(array_size(PRESSURE_BATCH, sizeof(*pages)));
+	if (!pages)
+		return;
+	while (st->cnt < samples) {
+		if (target)
+			pressure_adjust(target);
+		for (i = 0, n = 0; i < PRESSURE_BATCH; i++) {
+			start = get_cycles();
+			page = alloc_pages(gfp | __GFP_NOWARN, page_order);
+			lat_record(st, get_cycles() - start, !page);
+			if (page)
+				pages[n++] = page;
+		}
+		for (i = 0; i < n; i++)
+			__free_pages(pages[i], page_order);
+		cond_resched();
+	}
+	vfree(pages);
+}
+
+/* A batch drains the pool, thus the first allocations hit the localq,
+ * followed by refills from sharedq, and finally refills from SLAB.
+ * Each sample is classified via the per CPU pool stats, which is why
+ * the CPU must stay the same during the call.  The rounds are bounded,
+ * as a large sharedq (qmempool_elems) can avoid the SLAB refills.
+ */
+static void measure_qmempool(unsigned long target)
+{
+	struct lat_stat *st_localq = &lat_stats[LAT_QMEMPOOL_LOCALQ];
+	struct lat_stat *st_slab = &lat_stats[LAT_QMEMPOOL_SLAB];
+	struct qmempool_stats *stat;
+	unsigned long slab_alloc;
+	unsigned long alloc_hit;
+	cycles_t start, cycles;
+	unsigned int round, max_rounds = DIV_ROUND_UP(samples, 32);
+	struct lat_stat *st;
+	void **elems;
+	int i, n;
+
+	elems = vmalloc(array_size(PRESSURE_BATCH, sizeof(void *)));
+	if (!elems)
+		return;
+	for (round = 0; round < max_rounds &&
+	     (st_localq->cnt < samples || st_slab->cnt < samples); round++) {
+		if (target)
+			pressure_adjust(target);
+		for (i = 0, n = 0; i < PRESSURE_BATCH; i++) {
+			preempt_disable();
+			stat = &this_cpu_ptr(pool->percpu)->stat;
+			alloc_hit  = stat->alloc_hit;
+			slab_alloc = stat->slab_alloc;
+			start = get_cycles();
+			elems[n] = qmempool_alloc(pool, GFP_ATOMIC);
+			cycles = get_cycles() - start;
+			if (stat->alloc_hit != alloc_hit)
+				st = st_localq;
+			else if (stat->slab_alloc != slab_alloc)
+				st = st_slab;
+			else
+				st = &lat_stats[LAT_QMEMPOOL_SHAREDQ];
+			preempt_enable();
+			lat_record(st, cycles, !elems[n]);
+			if (elems[n])
+				n++;
+		}
+		for (i = 0; i < n; i++)
+			qmempool_free(pool, elems[i]);
+		cond_resched();
+	}
+	vfree(elems);
+}
+
+static void run_pressure_level(const char *level, unsigned long target)
+{
+	unsigned long free_start, free_end;
+
+	lat_reset();
+	if (target)
+		pressure_adjust(target);
+	free_start = free_pages_now();
+
+	measure_slab_bulk(target);
+	measure_pages(target);
+	measure_qmempool(target);
+
+	free_end = free_pages_now();
+	if (verbose)
+		pr_info("%s target:%lu free pages start:%lu end:%lu held:%lu (bulksz:%u order:%u)\n",
+			level, target, free_start, free_end, hold_pages,
+			bulksz, page_order);
+	lat_report(level);
+	hold_release(hold_pages);
+}
+
+static int run_pressure_tests(void)
+{
+	unsigned long wmark;
+	int i, ret = -ENOMEM;
+
+	for (i = 0; i < LAT_MAX; i++) {
+		lat_stats[i].lat = vmalloc(array_size(samples, sizeof(u64)));
+		if (!lat_stats[i].lat)
+			goto out;
+	}
+	ret = 0;
+
+	run_pressure_level("baseline", 0);
+
+	if (enabled(bit_pressure_low)) {
+		wmark = wmark_pages_sum(bit_pressure_low);
+		if (verbose)
+			pr_info("low watermark sum: %lu pages\n", wmark);
+		run_pressure_level("wmark-low", wmark + pressure_margin);
+	}
+	if (enabled(bit_pressure_min)) {
+		wmark = wmark_pages_sum(bit_pressure_min);
+		if (verbose)
+			pr_info("min watermark sum: %lu pages\n", wmark);
+		run_pressure_level("wmark-min", wmark + pressure_margin);
+	}
+out:
+	for (i = 0; i < LAT_MAX; i++) {
+		vfree(lat_stats[i].lat);
+		lat_stats[i].lat = NULL;
+	}
+	return ret;
+}
+
 static int __init slab_bulk_test04_module_init(void)
 {
 	struct my_elem *object;
@@ -151,6 +561,18 @@ static int __init slab_bulk_test04_module_init(void)
 			bulksz, MAX_BULK);
 		return -EINVAL;
 	}
+	if (qmempool_elems > MAX_QMEMPOOL_ELEMS) {
+		pr_warn("ERROR: qmempool_elems(%d) too large (> %d)\n",
+			qmempool_elems, MAX_QMEMPOOL_ELEMS);
+		return -EINVAL;
+	}
+	if (samples == 0 || page_order >= MAX_ORDER) {
+		pr_warn("ERROR: invalid samples(%u) or page_order(%u)\n",
+			samples, page_order);
+		return -EINVAL;
+	}
+	if (gfp_reclaim)
+		gfp = GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN;
 
 	/* Create kmem_cache */
 	slab = kmem_cache_create("slab_bulk_test04", sizeof(struct my_elem),
@@ -168,6 +590,28 @@ static int __init slab_bulk_test04_module_init(void)
 	}
 	kmem_cache_free(slab, object);
 
+	if (qmempool_elems || pressure) {
+		pool = qmempool_create(32,
+				       roundup_pow_of_two(max(qmempool_elems, 32U)),
+				       qmempool_elems, slab, GFP_KERNEL);
+		if (!pool) {
+			pr_err("ERROR: could not create qmempool\n");
+			kmem_cache_destroy(slab);
+			return -ENOBUFS;
+		}
+		qmempool_elems = qmempool_cached();
+	}
+
+	if (pressure) {
+		if (run_pressure_tests() < 0) {
+			pr_err("ERROR: could not alloc latency sample arrays\n");
+			qmempool_destroy(pool);
+			kmem_cache_destroy(slab);
+			return -ENOMEM;
+		}
+		return 0;
+	}
+
 	/* Try to exhaust slab memory */
 	if (!alloc_mem_loop(slab, &global_q)) {
 		pr_info("Successful test: Alloc exceeded memory limit");
@@ -175,6 +619,11 @@ static int __init slab_bulk_test04_module_init(void)
 		pr_err("Invalid test: not exceeded memory limit");
 	}
 
+	/* Under reclaim the qmempool shrinker should give memory back */
+	if (pool)
+		pr_info("qmempool released %u of %u cached elements\n",
+			qmempool_elems - qmempool_cached(), qmempool_elems);
+
 	if (msdelay)
 		msleep(msdelay);
 
@@ -191,6 +640,8 @@ module_init(slab_bulk_test04_module_init);
 static void __exit slab_bulk_test04_module_exit(void)
 {
 	/* Cleanup, destroy the kmem_cache*/
+	if (pool)
+		qmempool_destroy(pool);
 	kmem_cache_destroy(slab);
 
 	if (verbose)
@@ -0,0 +1,402 @@
+/*
+ * Multi-CPU (parallel) benchmarking of slab bulk API
+ *
+ * The other slab_bulk_test0* modules are single CPU.  This module
+ * runs the bulk API concurrently on several CPUs, via
+ * time_bench_run_concurrent(), sweeping the bulk size and the number
+ * of CPUs (first N online CPUs):
+ *
+ *  - local:  bulk alloc+free on all CPUs, same kmem_cache
+ *  - mixed:  like local, but rotating between caches of mixed sizes
+ *  - remote: CPUs are paired up, the first CPU in a pair bulk allocs
+ *            and hands objects through a (SPSC) ptr_ring to the second
+ *            CPU, which bulk frees them.  This is the cross CPU free
+ *            pattern, e.g. of network TX completion.
+ *
+ * For local and mixed the cost is per object alloc+free.  For remote
+ * the producer cost is per object alloc+enqueue, and consumer cost is
+ * per object dequeue+free (including waiting for the producer).  The
+ * "step" printed is the bulk size.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/time_bench.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/skbuff.h>
+#include <linux/ptr_ring_spsc.h>
+
+static int verbose=1;
+
+static uint32_t loops = 1000000;
+module_param(loops, uint, 0);
+MODULE_PARM_DESC(loops, "Objects per CPU, divided by bulk size into loops");
+
+static int max_cpus = 0;
+module_param(max_cpus, int, 0);
+MODULE_PARM_DESC(max_cpus, "Max CPUs to sweep up-to (default all online)");
+
+static int max_bulk = 128;
+module_param(max_bulk, int, 0);
+MODULE_PARM_DESC(max_bulk, "Max bulk size to sweep up-to");
+
+/* Makes tests selectable. Useful for perf-record to analyze a single test.
+ * Hint: Bash shells support writing binary number like: $((2#101010)
+ *
+ * # modprobe slab_bulk_test06_parallel run_flags=$((2#100))
+ */
+static unsigned long run_flags = 0xFFFFFFFF;
+module_param(run_flags, ulong, 0);
+MODULE_PARM_DESC(run_flags, "Limit which bench test that runs");
+/* Count the bit number from the enum */
+enum benchmark_bit {
+	bit_run_bench_local,
+	bit_run_bench_mixed,
+	bit_run_bench_remote,
+};
+#define bit(b)		(1 << (b))
+#define enabled(b)	((run_flags & (bit(b))))
+
+#define MAX_BULK	256
+#define RING_SIZE	1024
+
+static const int bulk_sizes[] = { 1, 8, 16, 32, 64, 128, 256 };
+
+/* Mixed object sizes, must be a power-of-2 number of caches */
+static const int mixed_sizes[] = { 64, 256, 512, 2048 };
+#define NR_MIXED ARRAY_SIZE(mixed_sizes)
+
+struct my_elem {
+	/* element used for benchmark testing */
+	struct sk_buff skb;
+};
+
+struct bulk_bench_cpu {
+	void *objs[MAX_BULK];
+	struct ptr_ring_spsc *ring; /* remote: shared with peer CPU */
+	bool producer;
+};
+
+struct bulk_bench {
+	struct kmem_cache *slab[NR_MIXED];
+	unsigned int slab_mask; /* zero: only use slab[0] */
+	struct bulk_bench_cpu **cpu; /* indexed by CPU id */
+};
+
+static struct kmem_cache *my_slab;
+static struct kmem_cache *mixed_slab[NR_MIXED];
+
+static int time_bench_local_bulk(struct time_bench_record *rec, void *data)
+{
+	struct bulk_bench *b = data;
+	void **objs = b->cpu[rec->cpu]->objs;
+	uint64_t loops_cnt = 0;
+	int bulk = rec->step;
+	struct kmem_cache *s;
+	int i;
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+		s = b->slab[i & b->slab_mask];
+
+		if (!kmem_cache_alloc_bulk(s, GFP_ATOMIC, bulk, objs))
+			goto out;
+
+		barrier(); /* compiler barrier */
+
+		kmem_cache_free_bulk(s, bulk, objs);
+
+		/* NOTICE THIS COUNTS (bulk) alloc+free together*/
+		loops_cnt += bulk;
+	}
+out:
+	time_bench_stop(rec, loops_cnt);
+	return loops_cnt;
+}
+
+static int time_bench_remote_bulk(struct time_bench_record *rec, void *data)
+{
+	struct bulk_bench *b = data;
+	struct bulk_bench_cpu *c = b->cpu[rec->cpu];
+	struct kmem_cache *s = b->slab[0];
+	uint64_t retries = 0, max_retries;
+	uint64_t loops_cnt = 0, total;
+	int bulk = rec->step;
+	int i, n, cnt;
+
+	max_retries = (uint64_t)rec->loops * bulk * 1000;
+
+	time_bench_start(rec);
+	if (c->producer) {
+		for (i = 0; i < rec->loops; i++) {
+			if (!kmem_cache_alloc_bulk(s, GFP_ATOMIC, bulk,
+						   c->objs))
+				break;
+			/* Consumer might lag behind, retry until enqueued */
+			for (n = 0; n < bulk; n += cnt) {
+				cnt = ptr_ring_spsc_produce_batched(
+					c->ring, &c->objs[n], bulk - n);
+				if (cnt)
+					continue;
+				if (++retries > max_retries) {
+					kmem_cache_free_bulk(s, bulk - n,
+							     &c->objs[n]);
+					goto out;
+				}
+				cpu_relax();
+			}
+			loops_cnt += bulk;
+		}
+	} else {
+		total = (uint64_t)rec->loops * bulk;
+		while (loops_cnt < total) {
+			n = ptr_ring_spsc_consume_batched(c->ring, c->objs,
+							  bulk);
+			if (n == 0) {
+				if (++retries > max_retries)
+					break;
+				cpu_relax();
+				continue;
+			}
+			kmem_cache_free_bulk(s, n, c->objs);
+			loops_cnt += n;
+		}
+	}
+out:
+	time_bench_stop(rec, loops_cnt);
+	if (retries > max_retries)
+		pr_err("%s() WARN: CPU:%d gave up after %llu retries\n",
+		       __func__, rec->cpu, retries);
+	return loops_cnt;
+}
+
+int run_parallel(const char *desc, uint32_t loops, const cpumask_t *cpumask,
+		 int step, void *data,
+		 int (*func)(struct time_bench_record *record, void *data)
+	)
+{
+	struct time_bench_sync sync;
+	struct time_bench_cpu *cpu_tasks;
+	size_t size;
+
+	/* Allocate records for every CPU */
+	size = sizeof(*cpu_tasks) * num_possible_cpus();
+	cpu_tasks = kzalloc(size, GFP_KERNEL);
+	if (!cpu_tasks)
+		return 0;
+
+	time_bench_run_concurrent(loops, step, data,
+				  cpumask, &sync, cpu_tasks, func);
+	time_bench_print_stats_cpumask(desc, cpu_tasks, cpumask);
+
+	kfree(cpu_tasks);
+	return 1;
+}
+
+static void bench_free(struct bulk_bench *b)
+{
+	struct bulk_bench_cpu *c;
+	void *obj;
+	int cpu;
+
+	if (!b->cpu)
+		return;
+	for_each_possible_cpu(cpu) {
+		c = b->cpu[cpu];
+		if (!c)
+			continue;
+		/* The producer owns the ring, free objects left behind */
+		if (c->producer && c->ring) {
+			while ((obj = ptr_ring_spsc_consume(c->ring)))
+				kmem_cache_free(b->slab[0], obj);
+			ptr_ring_spsc_cleanup(c->ring, NULL);
+			kfree(c->ring);
+		}
+		kfree(c);
+	}
+	kfree(b->cpu);
+	b->cpu = NULL;
+}
+
+/* Allocate per CPU state, and for remote pair up the CPUs in the mask.
+ * An odd CPU out (last in mask) is removed from the mask.
+ */
+static bool bench_alloc(struct bulk_bench *b, cpumask_t *cpumask, bool remote)
+{
+	struct bulk_bench_cpu *c, *prod = NULL;
+	int cpu;
+
+	b->cpu = kcalloc(nr_cpu_ids, sizeof(*b->cpu), GFP_KERNEL);
+	if (!b->cpu)
+		return false;
+	for_each_cpu(cpu, cpumask) {
+		c = kzalloc(sizeof(*c), GFP_KERNEL);
+		if (!c)
+			goto fail;
+		b->cpu[cpu] = c;
+		if (!remote)
+			continue;
+
+		if (!prod) {
+			c->ring = kzalloc(sizeof(*c->ring), GFP_KERNEL);
+			if (!c->ring)
+				goto fail;
+			c->producer = true;
+			if (ptr_ring_spsc_init(c->ring, RING_SIZE,
+					       GFP_KERNEL) < 0) {
+				kfree(c->ring);
+				c->ring = NULL;
+				goto fail;
+			}
+			prod = c;
+		} else {
+			c->ring = prod->ring;
+			prod = NULL;
+		}
+	}
+	if (prod) {
+		cpu = cpumask_last(cpumask);
+		cpumask_clear_cpu(cpu, cpumask);
+	}
+	return true;
+fail:
+	bench_free(b);
+	return false;
+}
+
+enum bench_type {
+	LOCAL,
+	MIXED,
+	REMOTE,
+};
+static const char *bench_type_str[] = {
+	"local-bulk", "mixed-bulk", "remote-bulk"
+};
+
+void noinline run_bench(enum bench_type type, int nr_cpus, int bulk)
+{
+	struct bulk_bench b = {};
+	cpumask_t cpumask;
+	int cpu, i = 0;
+
+	cpumask_clear(&cpumask);
+	for_each_online_cpu(cpu) {
+		if (i++ >= nr_cpus)
+			break;
+		cpumask_set_cpu(cpu, &cpumask);
+	}
+
+	if (type == MIXED) {
+		for (i = 0; i < NR_MIXED; i++)
+			b.slab[i] = mixed_slab[i];
+		b.slab_mask = NR_MIXED - 1;
+	} else {
+		b.slab[0] = my_slab;
+	}
+
+	if (!bench_alloc(&b, &cpumask, type == REMOTE))
+		return;
+	if (cpumask_empty(&cpumask))
+		goto out;
+
+	if (verbose)
+		pr_info("%s CPUs:%d bulk:%d\n", bench_type_str[type],
+			cpumask_weight(&cpumask), bulk);
+	run_parallel(bench_type_str[type], max_t(uint32_t, loops / bulk, 1),
+		     &cpumask, bulk, &b,
+		     (type == REMOTE) ? time_bench_remote_bulk :
+					time_bench_local_bulk);
+out:
+	bench_free(&b);
+}
+
+static void run_bench_sweep(enum bench_type type)
+{
+	int nr_cpus, i;
+
+	/* Sweep CPU count 1, 2, 4 ... and max_cpus */
+	nr_cpus = (type == REMOTE) ? 2 : 1;
+	while (nr_cpus <= max_cpus) {
+		for (i = 0; i < ARRAY_SIZE(bulk_sizes); i++) {
+			if (bulk_sizes[i] > max_bulk)
+				break;
+			run_bench(type, nr_cpus, bulk_sizes[i]);
+		}
+		if (nr_cpus == max_cpus)
+			break;
+		nr_cpus = min(nr_cpus * 2, max_cpus);
+	}
+}
+
+int run_benchmark_tests(void)
+{
+	if (max_cpus <= 0 || max_cpus > num_online_cpus())
+		max_cpus = num_online_cpus();
+	if (max_bulk > MAX_BULK)
+		max_bulk = MAX_BULK;
+
+	if (enabled(bit_run_bench_local))
+		run_bench_sweep(LOCAL);
+	if (enabled(bit_run_bench_mixed))
+		run_bench_sweep(MIXED);
+	if (enabled(bit_run_bench_remote))
+		run_bench_sweep(REMOTE);
+
+	return 0;
+}
+
+static void destroy_slabs(void)
+{
+	int i;
+
+	for (i = 0; i < NR_MIXED; i++)
+		kmem_cache_destroy(mixed_slab[i]);
+	kmem_cache_destroy(my_slab);
+}
+
+static int __init slab_bulk_test06_module_init(void)
+{
+	char name[32];
+	int i;
+
+	if (verbose)
+		pr_info("Loaded\n");
+
+	my_slab = kmem_cache_create("slab_bulk_test06", sizeof(struct my_elem),
+				    0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!my_slab)
+		return -ENOMEM;
+	for (i = 0; i < NR_MIXED; i++) {
+		snprintf(name, sizeof(name), "slab_bulk_test06_%d",
+			 mixed_sizes[i]);
+		mixed_slab[i] = kmem_cache_create(name, mixed_sizes[i], 0,
+						  SLAB_HWCACHE_ALIGN, NULL);
+		if (!mixed_slab[i]) {
+			destroy_slabs();
+			return -ENOMEM;
+		}
+	}
+
+	if (run_benchmark_tests() < 0) {
+		destroy_slabs();
+		return -ECANCELED;
+	}
+
+	return 0;
+}
+module_init(slab_bulk_test06_module_init);
+
+static void __exit slab_bulk_test06_module_exit(void)
+{
+	destroy_slabs();
+
+	if (verbose)
+		pr_info("Unloaded\n");
+}
+module_exit(slab_bulk_test06_module_exit);
+
+MODULE_DESCRIPTION("Parallel (multi-CPU) benchmarking of slab bulk API");
+MODULE_AUTHOR("Jesper Dangaard Brouer <netoptimizer@brouer.com>");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,269 @@
+/*
+ * Synthetic micro-benchmarking of kfree_bulk() across size classes
+ *
+ * Follow-up on slab_bulk_test05_kfree_bulk.c, which only use a single
+ * object size.  Here objects are kmalloc'ed from several size
+ * classes, picked from a (configurable) size distribution, and
+ * free'ed either via individual kfree() calls or via kfree_bulk().
+ *
+ * kfree_bulk() looks up the kmem_cache per object, and can only
+ * build a detached freelist for objects belonging to the same slab
+ * page (thus same cache).  A mixed array will mostly free one object
+ * at a time.  The "sorted" variant groups the array by slab page,
+ * and thereby by cache, before kfree_bulk() (see linux/slab_bulk.h),
+ * to quantify whether grouping pays off.
+ *
+ * The measurements include the kmalloc() cost, which is the same for
+ * each free variant.  Thus, differences between variants are the
+ * free cost.  E.g. select sizes and their weights (in percent):
+ *
+ *  modprobe slab_bulk_test07_kfree_bulk_sizes sizes=64,256,1500 weights=50,30,20
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/time_bench.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/random.h>
+#include <linux/slab_bulk.h>
+
+static int verbose=1;
+
+/* If SLAB debugging is enabled the per object cost is approx a factor
+ * between 500 - 1000 times slower.  Thus, adjust the default number
+ * of loops in case CONFIG_SLUB_DEBUG_ON=y
+ */
+#if defined(CONFIG_SLUB_DEBUG_ON) || defined(CONFIG_DEBUG_SLAB)
+# define DEFAULT_LOOPS 10000
+#else
+# define DEFAULT_LOOPS 1000000
+#endif
+static uint32_t loops = DEFAULT_LOOPS;
+module_param(loops, uint, 0);
+MODULE_PARM_DESC(loops, "Parameter for loops in bench");
+
+static unsigned int bulksz = 0;
+module_param(bulksz, uint, 0);
+MODULE_PARM_DESC(bulksz, "Only bench this bulk size (default sweep)");
+
+/* Size distribution, default resembles a mix of small control
+ * objects and packet sized buffers.
+ */
+#define MAX_SIZES 16
+static unsigned int sizes[MAX_SIZES] = {
+	64, 128, 256, 512, 1024, 2048, 4096 };
+static int nr_sizes = 7;
+module_param_array(sizes, uint, &nr_sizes, 0);
+MODULE_PARM_DESC(sizes, "Object size classes (bytes), comma separated");
+
+static unsigned int weights[MAX_SIZES] = {
+	30, 20, 20, 10, 10, 5, 5 };
+static int nr_weights = 7;
+module_param_array(weights, uint, &nr_weights, 0);
+MODULE_PARM_DESC(weights, "Relative weight per size class, comma separated");
+
+#define MAX_BULK 256
+
+/* Pre-generated sequence of sizes following the distribution, to
+ * avoid the random number generation cost inside the measurement.
+ */
+#define PATTERN_SZ	4096 /* power-of-2 */
+#define PATTERN_MASK	(PATTERN_SZ - 1)
+static unsigned int size_pattern[PATTERN_SZ];
+
+static void *objs[MAX_BULK];
+
+static bool init_size_pattern(void)
+{
+	unsigned int total = 0, r;
+	int i, j;
+
+	if (nr_sizes <= 0)
+		return false;
+	/* Equal weights, if weights does not match sizes */
+	if (nr_weights != nr_sizes) {
+		pr_warn("weights(%d) do not match sizes(%d), use equal\n",
+			nr_weights, nr_sizes);
+		for (i = 0; i < nr_sizes; i++)
+			weights[i] = 1;
+		nr_weights = nr_sizes;
+	}
+	for (i = 0; i < nr_sizes; i++) {
+		if (sizes[i] == 0 || sizes[i] > KMALLOC_MAX_SIZE) {
+			pr_err("invalid size[%d]:%u\n", i, sizes[i]);
+			return false;
+		}
+		total += weights[i];
+	}
+	if (total == 0)
+		return false;
+
+	for (j = 0; j < PATTERN_SZ; j++) {
+		r = get_random_u32_below(total);
+		for (i = 0; r >= weights[i]; i++)
+			r -= weights[i];
+		size_pattern[j] = sizes[i];
+	}
+
+	if (verbose)
+		for (i = 0; i < nr_sizes; i++)
+			pr_info("size class %u bytes weight %u/%u\n",
+				sizes[i], weights[i], total);
+	return true;
+}
+
+enum free_type {
+	KFREE = 1,
+	KFREE_BULK,
+	KFREE_BULK_SORTED,
+};
+
+/* Objects of a single size class, given via data, or sizes from the
+ * mixed distribution pattern if data is zero.
+ */
+static __always_inline int __benchmark_kmalloc_free(
+	struct time_bench_record *rec, void *data, enum free_type type)
+{
+	unsigned long size = (unsigned long)data;
+	uint64_t loops_cnt = 0;
+	size_t bulk = rec->step;
+	unsigned int k = 0;
+	int i, j;
+
+	if (bulk > MAX_BULK) {
+		pr_warn("%s() bulk(%lu) request too big cap at %d\n",
+			__func__, bulk, MAX_BULK);
+		bulk = MAX_BULK;
+	}
+	/* loop count is limited to 32-bit due to div_u64_rem() use */
+	if (((uint64_t)rec->loops * bulk *2) >= ((1ULL<<32)-1)) {
+		pr_err("Loop cnt too big will overflow 32-bit\n");
+		return 0;
+	}
+
+	time_bench_start(rec);
+	/** Loop to measure **/
+	for (i = 0; i < rec->loops; i++) {
+
+		for (j = 0; j < bulk; j++) {
+			objs[j] = kmalloc(size ? size :
+					  size_pattern[k++ & PATTERN_MASK],
+					  GFP_ATOMIC);
+			if (!objs[j]) {
+				kfree_bulk(j, objs);
+				goto out;
+			}
+		}
+
+		barrier(); /* compiler barrier */
+
+		if (type == KFREE) {
+			for (j = 0; j < bulk; j++)
+				kfree(objs[j]);
+		} else if (type == KFREE_BULK) {
+			kfree_bulk(bulk, objs);
+		} else if (type == KFREE_BULK_SORTED) {
+			slab_bulk_sort(bulk, objs);
+			kfree_bulk(bulk, objs);
+		} else {
+			BUILD_BUG();
+		}
+
+		/* NOTICE THIS COUNTS (bulk) alloc+free together*/
+		loops_cnt += bulk;
+	}
+out:
+	time_bench_stop(rec, loops_cnt);
+	return loops_cnt;
+}
+/* Compiler should inline optimize other function "type" calls out */
+static int benchmark_kfree(struct time_bench_record *rec, void *data)
+{
+	return __benchmark_kmalloc_free(rec, data, KFREE);
+}
+static int benchmark_kfree_bulk(struct time_bench_record *rec, void *data)
+{
+	return __benchmark_kmalloc_free(rec, data, KFREE_BULK);
+}
+static int benchmark_kfree_bulk_sorted(
+	struct time_bench_record *rec, void *data)
+{
+	return __benchmark_kmalloc_free(rec, data, KFREE_BULK_SORTED);
+}
+
+void bulk_test(int bulk)
+{
+	void *data;
+	int i;
+
+	pr_info("Bench bulk size:%d\n", bulk);
+
+	/* Per size class */
+	for (i = 0; i < nr_sizes; i++) {
+		data = (void *)(unsigned long)sizes[i];
+		if (verbose)
+			pr_info("Size class %u bytes\n", sizes[i]);
+		time_bench_loop(loops/bulk, bulk, "class-kfree", data,
+				benchmark_kfree);
+		time_bench_loop(loops/bulk, bulk, "class-kfree_bulk", data,
+				benchmark_kfree_bulk);
+		cond_resched();
+	}
+
+	/* Mixed sizes from the distribution */
+	if (verbose)
+		pr_info("Mixed size classes\n");
+	time_bench_loop(loops/bulk, bulk, "mixed-kfree", NULL,
+			benchmark_kfree);
+	time_bench_loop(loops/bulk, bulk, "mixed-kfree_bulk", NULL,
+			benchmark_kfree_bulk);
+	time_bench_loop(loops/bulk, bulk, "mixed-kfree_bulk-sorted", NULL,
+			benchmark_kfree_bulk_sorted);
+	cond_resched();
+}
+
+int run_timing_tests(void)
+{
+	if (bulksz) {
+		bulk_test(min_t(unsigned int, bulksz, MAX_BULK));
+		return 0;
+	}
+	bulk_test(8);
+	bulk_test(16);
+	bulk_test(32);
+	bulk_test(64);
+	bulk_test(128);
+	bulk_test(256);
+
+	return 0;
+}
+
+static int __init slab_bulk_test07_module_init(void)
+{
+	if (verbose)
+		pr_info("Loaded\n");
+
+	if (!init_size_pattern())
+		return -EINVAL;
+
+#ifdef CONFIG_DEBUG_PREEMPT
+	pr_warn("WARN: CONFIG_DEBUG_PREEMPT is enabled: this affect results\n");
+#endif
+	if (run_timing_tests() < 0)
+		return -ECANCELED;
+
+	return 0;
+}
+module_init(slab_bulk_test07_module_init);
+
+static void __exit slab_bulk_test07_module_exit(void)
+{
+	if (verbose)
+		pr_info("Unloaded\n");
+}
+module_exit(slab_bulk_test07_module_exit);
+
+MODULE_DESCRIPTION("Synthetic micro-benchmarking of kfree_bulk across size classes");
+MODULE_AUTHOR("Jesper Dangaard Brouer <netoptimizer@brouer.com>");
+MODULE_LICENSE("GPL");
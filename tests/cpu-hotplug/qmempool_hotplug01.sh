@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# Stress test of qmempool CPU hotplug handling.
+#
+# Toggle CPUs offline/online while the qmempool_bench_parallel module
+# runs its benchmarks.  When a CPU goes offline, the elements cached
+# in its localq must be drained to sharedq (or SLAB), and a CPU coming
+# online must get a new localq, before it can use the pool.
+#
+# The kernel log is checked for BUG/WARNING splats, and for the slab
+# caches being destroyed with objects still allocated.
+#
+# Usage: $0 [nr-toggles-per-cpu]
+
+MODULE=qmempool_bench_parallel
+TOGGLES=${1:-20}
+VERBOSE=1
+
+if [[ $UID != 0 ]]; then
+	echo must be run as root >&2
+	exit 1
+fi
+
+$(modinfo $MODULE > /dev/null 2>&1)
+if [[ $? != 0 ]]; then
+    echo "ERR - Need kernel module $MODULE for this test"
+    exit 2
+fi
+
+# CPU0 often cannot be offlined, only toggle CPUs that allow it
+CPUS=""
+for f in /sys/devices/system/cpu/cpu[0-9]*/online; do
+    CPUS="$CPUS $(basename $(dirname $f))"
+done
+if [[ -z "$CPUS" ]]; then
+    echo "ERR - No hotpluggable CPUs found"
+    exit 3
+fi
+
+dmesg -C
+
+# Benchmarks runs from module init, thus modprobe blocks until done
+modprobe $MODULE &
+PID=$!
+
+i=0
+while kill -0 $PID 2> /dev/null; do
+    for cpu in $CPUS; do
+	echo 0 > /sys/devices/system/cpu/$cpu/online
+	sleep 0.1
+	echo 1 > /sys/devices/system/cpu/$cpu/online
+    done
+    i=$((i + 1))
+    if [[ $i -ge $TOGGLES ]]; then
+	break
+    fi
+done
+wait $PID
+
+# Make sure all CPUs are online again
+for cpu in $CPUS; do
+    echo 1 > /sys/devices/system/cpu/$cpu/online
+done
+
+rmmod $MODULE
+
+if [[ $VERBOSE > 0 ]]; then
+    dmesg | egrep -e "$MODULE|qmempool" | tail -n40
+fi
+
+if dmesg | egrep -q -e "BUG|WARNING|still has objects"; then
+    echo "selftests: qmempool_hotplug01 [FAILED]"
+    exit 1
+fi
+echo "selftests: qmempool_hotplug01 [PASS]"
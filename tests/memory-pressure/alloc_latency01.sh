@@ -0,0 +1,42 @@
+#!/bin/bash
+#
+# Measure allocation latency near the zone watermarks.
+#
+# The slab_bulk_test04_exhaust_mem module in pressure mode holds free
+# memory at the low and/or min watermark (by allocating pages without
+# waking kswapd), and reports percentile latencies of
+# kmem_cache_alloc_bulk, alloc_pages and the qmempool fast and slow
+# paths, compared against a baseline run without pressure.
+#
+# Usage: $0 [pressure-bitmask: 1=low 2=min 3=both] [samples]
+
+MODULE=slab_bulk_test04_exhaust_mem
+PRESSURE=${1:-3}
+SAMPLES=${2:-10000}
+
+if [[ $UID != 0 ]]; then
+	echo must be run as root >&2
+	exit 1
+fi
+
+$(modinfo $MODULE > /dev/null 2>&1)
+if [[ $? != 0 ]]; then
+    echo "ERR - Need kernel module $MODULE for this test"
+    exit 2
+fi
+
+dmesg -C
+modprobe $MODULE verbose=1 pressure=$PRESSURE samples=$SAMPLES
+if [[ $? != 0 ]]; then
+    echo "selftests: alloc_latency01 [FAILED] module load"
+    exit 1
+fi
+rmmod $MODULE
+
+dmesg | egrep -e "$MODULE" | egrep -e "baseline|wmark"
+
+if dmesg | egrep -q -e "Out of memory|invoked oom-killer"; then
+    echo "selftests: alloc_latency01 [FAILED] OOM triggered"
+    exit 1
+fi
+echo "selftests: alloc_latency01 [PASS]"
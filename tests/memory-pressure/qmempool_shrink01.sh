@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# Test that qmempool gives memory back under memory pressure.
+#
+# The slab_bulk_test04_exhaust_mem module caches elements in a
+# qmempool (on the same kmem_cache), and then allocates until memory
+# is exhausted.  With gfp_reclaim=1 allocations enter reclaim (but
+# cannot invoke the OOM killer, due to __GFP_NORETRY), which invoke
+# the qmempool shrinker.  The module reports how many of the cached
+# elements were released.
+#
+# Usage: $0 [qmempool_elems]
+
+MODULE=slab_bulk_test04_exhaust_mem
+ELEMS=${1:-65536}
+VERBOSE=1
+
+if [[ $UID != 0 ]]; then
+	echo must be run as root >&2
+	exit 1
+fi
+
+$(modinfo $MODULE > /dev/null 2>&1)
+if [[ $? != 0 ]]; then
+    echo "ERR - Need kernel module $MODULE for this test"
+    exit 2
+fi
+
+dmesg -C
+modprobe $MODULE verbose=1 gfp_reclaim=1 qmempool_elems=$ELEMS
+rmmod $MODULE
+
+if [[ $VERBOSE > 0 ]]; then
+    dmesg | egrep -e "$MODULE|qmempool|Out of memory" | tail -n20
+fi
+
+if dmesg | egrep -q -e "Out of memory|invoked oom-killer"; then
+    echo "selftests: qmempool_shrink01 [FAILED] OOM triggered"
+    exit 1
+fi
+if dmesg | egrep -q -e "qmempool released 0 of"; then
+    echo "selftests: qmempool_shrink01 [FAILED] nothing released"
+    exit 1
+fi
+echo "selftests: qmempool_shrink01 [PASS]"